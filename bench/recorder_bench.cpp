@@ -0,0 +1,370 @@
+// Micro-benchmarks for the recorder hot paths.
+//
+// Each benchmark prints one JSON object per line to stdout:
+//   {"name": "...", "iterations": N, "ns_per_op": median, "min_ns_per_op": min}
+// so results can be diffed between builds. Pass a substring to only run matching benchmarks.
+#include "alsa_sequencer.hpp"
+#include "midi_recorder.hpp"
+#include "smf_reader.hpp"
+#include "smf_writer.hpp"
+#include "spsc_ring.hpp"
+#include "time_base.hpp"
+#include "trace.hpp"
+
+#include <MidiFile.h>
+#include <alsa/asoundlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr auto kMinSampleTime = std::chrono::milliseconds(50);
+constexpr int kSamples = 5;
+// appends keep everything in memory until a save, so keep their batches realistic
+constexpr uint64_t kMaxAppendIterations = 1 << 20;
+constexpr pr::midi::TimeBase kTimeBase{};
+
+template <class T>
+inline void do_not_optimize(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class Bench {
+public:
+    explicit Bench(std::string filter) : filter_(std::move(filter)) {}
+
+    bool wants(const std::string &name) const {
+        return filter_.empty() || name.find(filter_) != std::string::npos;
+    }
+
+    // fn(n) must perform n operations
+    template <class Fn>
+    void run(const std::string &name, Fn &&fn, uint64_t max_iterations = UINT64_MAX) {
+        if (!wants(name)) {
+            return;
+        }
+
+        uint64_t iterations = 1;
+        while (iterations < max_iterations && time_(fn, iterations) < kMinSampleTime) {
+            iterations = std::min(iterations * 2, max_iterations);
+        }
+
+        std::vector<double> ns_per_op;
+        for (int i = 0; i < kSamples; i++) {
+            const auto elapsed = std::chrono::duration<double, std::nano>(time_(fn, iterations));
+            ns_per_op.push_back(elapsed.count() / static_cast<double>(iterations));
+        }
+        std::sort(ns_per_op.begin(), ns_per_op.end());
+
+        constexpr std::string_view kLine =
+            R"({{"name": "{}", "iterations": {}, "ns_per_op": {:.2f}, "min_ns_per_op": {:.2f}}})";
+        std::cout << fmt::format(kLine, name, iterations, ns_per_op[ns_per_op.size() / 2],
+                         ns_per_op.front())
+                  << std::endl;
+    }
+
+private:
+    template <class Fn>
+    static Clock::duration time_(Fn &fn, uint64_t iterations) {
+        const auto start = Clock::now();
+        fn(iterations);
+        return Clock::now() - start;
+    }
+
+    std::string filter_;
+};
+
+// Piano with continuous pedal sensors: controller heavy, some notes, a little bend/pressure
+std::vector<snd_seq_event_t> make_event_mix(size_t n, uint32_t seed = 42) {
+    std::mt19937 rng(seed);
+    std::discrete_distribution<int> kind{35, 55, 5, 5};
+    std::uniform_int_distribution<int> note(21, 108);
+    std::uniform_int_distribution<int> value(0, 127);
+    std::uniform_int_distribution<int> bend(-8192, 8191);
+    const int controllers[] = {64, 66, 67, 11, 1};
+    std::uniform_int_distribution<size_t> controller(0, std::size(controllers) - 1);
+
+    std::vector<snd_seq_event_t> events(n);
+    for (snd_seq_event_t &ev : events) {
+        ev = snd_seq_event_t{};
+        switch (kind(rng)) {
+            case 0:
+                ev.type = value(rng) < 64 ? SND_SEQ_EVENT_NOTEON : SND_SEQ_EVENT_NOTEOFF;
+                ev.data.note.note = static_cast<unsigned char>(note(rng));
+                ev.data.note.velocity = static_cast<unsigned char>(value(rng));
+                break;
+            case 1:
+                ev.type = SND_SEQ_EVENT_CONTROLLER;
+                ev.data.control.param = static_cast<unsigned int>(controllers[controller(rng)]);
+                ev.data.control.value = value(rng);
+                break;
+            case 2:
+                ev.type = SND_SEQ_EVENT_PITCHBEND;
+                ev.data.control.value = bend(rng);
+                break;
+            default:
+                ev.type = SND_SEQ_EVENT_CHANPRESS;
+                ev.data.control.value = value(rng);
+                break;
+        }
+    }
+    return events;
+}
+
+// the event mix as raw bytes with ticks ~1ms apart
+struct RawEvent {
+    int tick;
+    pr::midi::SeqMidi midi;
+};
+
+std::vector<RawEvent> to_raw(const std::vector<snd_seq_event_t> &events) {
+    std::vector<RawEvent> raw;
+    raw.reserve(events.size());
+    int tick = 0;
+    for (const snd_seq_event_t &ev : events) {
+        RawEvent r{.tick = tick, .midi = {}};
+        r.midi.len = pr::midi::AlsaSequencer::to_midi_bytes(ev, r.midi.bytes);
+        raw.push_back(r);
+        tick += 2;
+    }
+    return raw;
+}
+
+void bench_conversion(Bench &bench, const std::vector<snd_seq_event_t> &events) {
+    bench.run("alsa/to_midi_bytes/mixed", [&](uint64_t n) {
+        uint8_t bytes[3];
+        for (uint64_t i = 0; i < n; i++) {
+            const snd_seq_event_t &ev = events[i % events.size()];
+            do_not_optimize(pr::midi::AlsaSequencer::to_midi_bytes(ev, bytes));
+            do_not_optimize(bytes);
+        }
+    });
+
+    bench.run("alsa/event_ostream/mixed", [&](uint64_t n) {
+        std::ostringstream os;
+        for (uint64_t i = 0; i < n; i++) {
+            os << events[i % events.size()];
+            os.str("");
+        }
+    });
+
+    pr::midi::trace::set_enabled(true);
+    bench.run("trace/record/seq_event", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            pr::midi::trace::record(pr::midi::trace::Kind::SEQ_EVENT, events[i % events.size()]);
+        }
+    });
+    pr::midi::trace::set_enabled(false);
+}
+
+void bench_clock(Bench &bench) {
+    bench.run("tick_clock/now_tick", [](uint64_t n) {
+        pr::midi::TickClock clock;
+        for (uint64_t i = 0; i < n; i++) {
+            do_not_optimize(clock.now_tick());
+        }
+    });
+    bench.run("tick_clock/now_tick/us", [](uint64_t n) {
+        pr::midi::TickClock clock{.base = pr::midi::parse_time_base("us")};
+        for (uint64_t i = 0; i < n; i++) {
+            do_not_optimize(clock.now_tick());
+        }
+    });
+}
+
+void bench_append(
+    Bench &bench, const std::vector<RawEvent> &raw, const std::filesystem::path &dir) {
+    bench.run("midifile/add_event/mixed", [&](uint64_t n) {
+        smf::MidiFile midi_file;
+        midi_file.absoluteTicks();
+        std::vector<uint8_t> bytes;
+        for (uint64_t i = 0; i < n; i++) {
+            const RawEvent &ev = raw[i % raw.size()];
+            bytes.assign(ev.midi.bytes, ev.midi.bytes + ev.midi.len);
+            midi_file.addEvent(0, ev.tick, bytes);
+        }
+    }, kMaxAppendIterations);
+
+    pr::midi::SmfWriter writer(dir / "append.mid", kTimeBase.ppq, kTimeBase.bpm());
+    bench.run("smf_writer/append/mixed", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            const RawEvent &ev = raw[i % raw.size()];
+            writer.append(ev.tick, ev.midi.bytes, ev.midi.len);
+        }
+    }, kMaxAppendIterations);
+
+    // capture thread -> ring -> persistence thread, minus the syscalls, on one core
+    pr::midi::SpscRing<pr::midi::CapturedEvent> ring(kCaptureRingSize);
+    pr::midi::SmfWriter pipeline_writer(dir / "pipeline.mid", kTimeBase.ppq, kTimeBase.bpm());
+    bench.run("pipeline/capture_to_append/mixed", [&](uint64_t n) {
+        pr::midi::CapturedEvent out[kDrainBatch];
+        for (uint64_t i = 0; i < n; i++) {
+            const RawEvent &ev = raw[i % raw.size()];
+            (void)ring.try_push(pr::midi::CapturedEvent{
+                .tick = ev.tick, .track = 0, .midi = ev.midi, .skew_ns = -1, .dequeued_ns = 0});
+            if ((i + 1) % kDrainBatch == 0 || i + 1 == n) {
+                const size_t popped = ring.pop_bulk(out);
+                for (size_t j = 0; j < popped; j++) {
+                    pipeline_writer.append(out[j].tick, out[j].midi.bytes, out[j].midi.len);
+                }
+            }
+        }
+    }, kMaxAppendIterations);
+}
+
+// one periodic save (~0.5s of dense playing) on top of a session of a given size
+void bench_save(
+    Bench &bench, const std::vector<RawEvent> &raw, const std::filesystem::path &dir) {
+    constexpr size_t kEventsPerSave = 100;
+
+    for (size_t session : {size_t{1'000}, size_t{100'000}, size_t{10'000'000}}) {
+        const std::string name = fmt::format("smf_writer/save/session_{}", session);
+        if (!bench.wants(name)) {
+            continue;
+        }
+
+        pr::midi::SmfWriter writer(
+            dir / fmt::format("save_{}.mid", session), kTimeBase.ppq, kTimeBase.bpm());
+        int tick = 0;
+        for (size_t i = 0; i < session; i++) {
+            const RawEvent &ev = raw[i % raw.size()];
+            writer.append(tick++, ev.midi.bytes, ev.midi.len);
+        }
+        (void)writer.flush();
+
+        bench.run(name, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                for (size_t j = 0; j < kEventsPerSave; j++) {
+                    const RawEvent &ev = raw[j];
+                    writer.append(tick++, ev.midi.bytes, ev.midi.len);
+                }
+                (void)writer.flush();
+            }
+        });
+    }
+
+    // what save_midi_ used to do: copy, sort, convert and rewrite the whole session every time.
+    // Stops at 100k, the 10M-event in-memory MidiFile alone needs gigabytes.
+    for (size_t session : {size_t{1'000}, size_t{100'000}}) {
+        const std::string name = fmt::format("midifile/full_rewrite/session_{}", session);
+        if (!bench.wants(name)) {
+            continue;
+        }
+
+        smf::MidiFile midi_file;
+        midi_file.absoluteTicks();
+        midi_file.setTicksPerQuarterNote(kTimeBase.ppq);
+        midi_file.addTempo(0, 0, kTimeBase.bpm());
+        std::vector<uint8_t> bytes;
+        for (size_t i = 0; i < session; i++) {
+            const RawEvent &ev = raw[i % raw.size()];
+            bytes.assign(ev.midi.bytes, ev.midi.bytes + ev.midi.len);
+            midi_file.addEvent(0, static_cast<int>(i), bytes);
+        }
+
+        const std::filesystem::path out = dir / fmt::format("rewrite_{}.mid", session);
+        bench.run(
+            name,
+            [&](uint64_t n) {
+                for (uint64_t i = 0; i < n; i++) {
+                    smf::MidiFile copy = midi_file;
+                    copy.sortTracks();
+                    copy.deltaTicks();
+                    (void)copy.write(out.string());
+                    int fd = open(out.c_str(), O_RDONLY | O_CLOEXEC);
+                    if (fd >= 0) {
+                        (void)fdatasync(fd);
+                        close(fd);
+                    }
+                }
+            },
+            64);
+    }
+}
+
+// one walk over every event of a 1M-event take: in place from the mapping, and through midifile
+void bench_read(Bench &bench, const std::vector<RawEvent> &raw, const std::filesystem::path &dir) {
+    constexpr size_t kTakeEvents = 1'000'000;
+    const std::string walk_name = "smf_reader/walk/events_1000000";
+    const std::string midifile_name = "midifile/read/events_1000000";
+    if (!bench.wants(walk_name) && !bench.wants(midifile_name)) {
+        return;
+    }
+
+    const std::filesystem::path path = dir / "read.mid";
+    {
+        pr::midi::SmfWriter writer(path, kTimeBase.ppq, kTimeBase.bpm());
+        for (size_t i = 0; i < kTakeEvents; i++) {
+            const RawEvent &ev = raw[i % raw.size()];
+            writer.append(static_cast<int64_t>(i), ev.midi.bytes, ev.midi.len);
+        }
+        (void)writer.flush();
+    }
+
+    bench.run(
+        walk_name,
+        [&](uint64_t n) {
+            const pr::midi::SmfReader reader(path);
+            for (uint64_t i = 0; i < n; i++) {
+                uint64_t notes = 0;
+                for (const pr::midi::SmfEvent &ev : reader.tracks().front()) {
+                    notes += ev.is_note_on();
+                }
+                do_not_optimize(notes);
+            }
+        },
+        64);
+
+    bench.run(
+        midifile_name,
+        [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                smf::MidiFile midi_file;
+                (void)midi_file.read(path.string());
+                uint64_t notes = 0;
+                for (int e = 0; e < midi_file[0].getEventCount(); e++) {
+                    notes += midi_file[0][e].isNoteOn();
+                }
+                do_not_optimize(notes);
+            }
+        },
+        8);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    spdlog::set_level(spdlog::level::warn);
+    Bench bench(argc > 1 ? argv[1] : "");
+
+    const std::filesystem::path dir =
+        std::filesystem::temp_directory_path() / fmt::format("piano-recorder-bench-{}", getpid());
+    std::filesystem::create_directories(dir);
+
+    const std::vector<snd_seq_event_t> events = make_event_mix(4096);
+    const std::vector<RawEvent> raw = to_raw(events);
+
+    bench_conversion(bench, events);
+    bench_clock(bench);
+    bench_append(bench, raw, dir);
+    bench_save(bench, raw, dir);
+    bench_read(bench, raw, dir);
+
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+    return 0;
+}
@@ -1,4 +1,7 @@
 #include "alsa_sequencer.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
 #include <iostream>
 #include <spdlog/fmt/ostr.h>
 #include <spdlog/spdlog.h>
@@ -9,63 +12,72 @@ static void check_alsa(const char *what, int rc) {
     }
 }
 
+static const char *event_type_name(int type) {
+    switch (type) {
+        case SND_SEQ_EVENT_NOTEON: return "NOTEON";
+        case SND_SEQ_EVENT_NOTEOFF: return "NOTEOFF";
+        case SND_SEQ_EVENT_CONTROLLER: return "CC";
+        case SND_SEQ_EVENT_PGMCHANGE: return "PGM";
+        case SND_SEQ_EVENT_CHANPRESS: return "CHANPRESS";
+        case SND_SEQ_EVENT_PITCHBEND: return "PITCHBEND";
+        case SND_SEQ_EVENT_SYSEX: return "SYSEX";
+        case SND_SEQ_EVENT_CLIENT_START: return "CLIENT_START";
+        case SND_SEQ_EVENT_CLIENT_EXIT: return "CLIENT_EXIT";
+        case SND_SEQ_EVENT_CLIENT_CHANGE: return "CLIENT_CHANGE";
+        case SND_SEQ_EVENT_PORT_START: return "PORT_START";
+        case SND_SEQ_EVENT_PORT_EXIT: return "PORT_EXIT";
+        case SND_SEQ_EVENT_PORT_CHANGE: return "PORT_CHANGE";
+        default: return nullptr;
+    }
+}
+
 std::ostream &operator<<(std::ostream &os, const snd_seq_event_t &ev) {
-    std::map<int, std::string> EVENT_TYPE_NAME = {
-        {SND_SEQ_EVENT_NOTEON, "NOTEON"},
-        {SND_SEQ_EVENT_NOTEOFF, "NOTEOFF"},
-        {SND_SEQ_EVENT_CONTROLLER, "CC"},
-        {SND_SEQ_EVENT_PGMCHANGE, "PGM"},
-        {SND_SEQ_EVENT_CHANPRESS, "CHANPRESS"},
-        {SND_SEQ_EVENT_PITCHBEND, "PITCHBEND"},
-        {SND_SEQ_EVENT_SYSEX, "SYSEX"},
-        {SND_SEQ_EVENT_CLIENT_START, "CLIENT_START"},
-        {SND_SEQ_EVENT_CLIENT_EXIT, "CLIENT_EXIT"},
-        {SND_SEQ_EVENT_PORT_START, "PORT_START"},
-        {SND_SEQ_EVENT_PORT_EXIT, "PORT_EXIT"},
-        {SND_SEQ_EVENT_PORT_CHANGE, "PORT_CHANGE"},
-    };
+    const char *name = event_type_name(ev.type);
 
     // clang-format off
     switch (ev.type) {
         case SND_SEQ_EVENT_NOTEON:
         case SND_SEQ_EVENT_NOTEOFF:
-            os << fmt::format("{} ch={} note={} vel={}", EVENT_TYPE_NAME[ev.type],
+            os << fmt::format("{} ch={} note={} vel={}", name,
                 ev.data.note.channel, ev.data.note.note, ev.data.note.velocity);
             break;
 
         case SND_SEQ_EVENT_CONTROLLER:
-            os << fmt::format("{} ch={} cc={} val={}", EVENT_TYPE_NAME[ev.type],
+            os << fmt::format("{} ch={} cc={} val={}", name,
                 ev.data.control.channel, ev.data.control.param, ev.data.control.value);
             break;
 
         case SND_SEQ_EVENT_PGMCHANGE:
-            os << fmt::format("{} ch={} program={}", EVENT_TYPE_NAME[ev.type],
+            os << fmt::format("{} ch={} program={}", name,
                 ev.data.control.channel, ev.data.control.value);
             break;
 
         case SND_SEQ_EVENT_CHANPRESS:
-            os << fmt::format("{} ch={} pressure={}", EVENT_TYPE_NAME[ev.type],
+            os << fmt::format("{} ch={} pressure={}", name,
                 ev.data.control.channel, ev.data.control.value);
             break;
 
         case SND_SEQ_EVENT_PITCHBEND:
-            os << fmt::format("{} ch={} value={}", EVENT_TYPE_NAME[ev.type],
+            os << fmt::format("{} ch={} value={}", name,
                 ev.data.control.channel, ev.data.control.value);
             break;
 
         case SND_SEQ_EVENT_SYSEX:
-            os << fmt::format("{} len=", EVENT_TYPE_NAME[ev.type], ev.data.ext.len);
+            os << fmt::format("{} len={}", name, ev.data.ext.len);
             break;
 
-        default: {
-            auto it = EVENT_TYPE_NAME.find(ev.type);
-            if (it != EVENT_TYPE_NAME.end()) {
-                os << fmt::format("{}", it->second);
-            } else {
-                os << fmt::format("0x{:08x} (unknown type)", ev.type);
-            }
+        case SND_SEQ_EVENT_CLIENT_START:
+        case SND_SEQ_EVENT_CLIENT_EXIT:
+        case SND_SEQ_EVENT_CLIENT_CHANGE:
+        case SND_SEQ_EVENT_PORT_START:
+        case SND_SEQ_EVENT_PORT_EXIT:
+        case SND_SEQ_EVENT_PORT_CHANGE:
+            os << fmt::format("{} {}:{}", name, ev.data.addr.client, ev.data.addr.port);
+            break;
+
+        default:
+            os << fmt::format("0x{:02x} (unknown type)", ev.type);
             break;
-        }
     }
     // clang-format on
 
@@ -101,6 +113,10 @@ static inline bool is_announce_event(int type) {
     }
 }
 
+static std::chrono::nanoseconds to_nanoseconds(const snd_seq_real_time_t &t) {
+    return std::chrono::seconds(t.tv_sec) + std::chrono::nanoseconds(t.tv_nsec);
+}
+
 static AnnounceType to_announce_type(int type) {
     switch (type) {
         case SND_SEQ_EVENT_CLIENT_START:
@@ -118,8 +134,10 @@ static AnnounceType to_announce_type(int type) {
     }
 }
 
-AlsaSequencer::AlsaSequencer(const std::string &client_name, const std::string &port_name) {
-    int rc = snd_seq_open(&seq_, "default", SND_SEQ_OPEN_INPUT, 0);
+AlsaSequencer::AlsaSequencer(
+    const std::string &client_name, const std::string &port_name, bool use_queue) {
+    // duplex, since starting a queue means sending it a control event
+    int rc = snd_seq_open(&seq_, "default", SND_SEQ_OPEN_DUPLEX, 0);
     check_alsa("snd_seq_open", rc);
 
     snd_seq_nonblock(seq_, 1);
@@ -131,7 +149,13 @@ AlsaSequencer::AlsaSequencer(const std::string &client_name, const std::string &
         SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE, SND_SEQ_PORT_TYPE_APPLICATION);
     check_alsa("snd_seq_create_simple_port", input_.port_id);
 
+    if (use_queue) {
+        start_queue_(client_name);
+    }
+
+    // announcements first, so a port that appears during the walk is caught either way
     subscribe_announcements_();
+    seed_registry_();
 }
 
 AlsaSequencer::~AlsaSequencer(void) {
@@ -139,10 +163,56 @@ AlsaSequencer::~AlsaSequencer(void) {
         return;
     }
 
+    if (queue_ >= 0) {
+        (void)snd_seq_free_queue(seq_, queue_);
+        queue_ = -1;
+    }
+
     snd_seq_close(seq_);
     seq_ = nullptr;
 }
 
+void AlsaSequencer::start_queue_(const std::string &name) {
+    int queue = snd_seq_alloc_named_queue(seq_, name.c_str());
+    if (queue < 0) {
+        spdlog::warn("Could not allocate a sequencer queue ({}), using dequeue timestamps",
+            snd_strerror(queue));
+        return;
+    }
+
+    int rc = snd_seq_start_queue(seq_, queue, nullptr);
+    if (rc >= 0) {
+        rc = snd_seq_drain_output(seq_);
+    }
+
+    if (rc < 0) {
+        spdlog::warn("Could not start sequencer queue ({}), using dequeue timestamps",
+            snd_strerror(rc));
+        (void)snd_seq_free_queue(seq_, queue);
+        return;
+    }
+
+    queue_ = queue;
+    spdlog::info("Timestamping events on sequencer queue {}", queue_);
+}
+
+std::optional<std::chrono::nanoseconds> AlsaSequencer::queue_time(void) {
+    if (queue_ < 0) {
+        return std::nullopt;
+    }
+
+    snd_seq_queue_status_t *status = nullptr;
+    snd_seq_queue_status_alloca(&status);
+
+    int rc = snd_seq_get_queue_status(seq_, queue_, status);
+    if (rc < 0) {
+        spdlog::error("snd_seq_get_queue_status - {}", snd_strerror(rc));
+        return std::nullopt;
+    }
+
+    return to_nanoseconds(*snd_seq_queue_status_get_real_time(status));
+}
+
 std::vector<struct pollfd> AlsaSequencer::get_poll_desc(void) {
     std::vector<struct pollfd> pollfds;
     const int ndesc = snd_seq_poll_descriptors_count(seq_, POLLIN);
@@ -156,16 +226,22 @@ std::vector<struct pollfd> AlsaSequencer::get_poll_desc(void) {
 }
 
 bool AlsaSequencer::subscribe(const MidiPortHandle &new_src) {
-    unsubscribe(src_);
+    if (is_subscribed(new_src)) {
+        return true;
+    }
 
     if (!subscribe_naive_(new_src)) {
         return false;
     }
 
-    src_ = new_src;
+    sources_.push_back(new_src);
     return true;
 }
 
+bool AlsaSequencer::is_subscribed(const MidiPortHandle &src) const {
+    return std::find(sources_.begin(), sources_.end(), src) != sources_.end();
+}
+
 bool AlsaSequencer::subscribe_naive_(const MidiPortHandle &src) {
     if (!src.is_valid()) {
         return false;
@@ -179,8 +255,11 @@ bool AlsaSequencer::subscribe_naive_(const MidiPortHandle &src) {
     snd_seq_port_subscribe_set_sender(sub, &src_addr);
     snd_seq_port_subscribe_set_dest(sub, &dst_addr);
 
-    snd_seq_port_subscribe_set_time_update(sub, 1);
-    snd_seq_port_subscribe_set_time_real(sub, 1);
+    if (queue_ >= 0) {
+        snd_seq_port_subscribe_set_queue(sub, queue_);
+        snd_seq_port_subscribe_set_time_update(sub, 1);
+        snd_seq_port_subscribe_set_time_real(sub, 1);
+    }
 
     int rc = snd_seq_subscribe_port(seq_, sub);
     if (rc != 0) {
@@ -198,12 +277,78 @@ void AlsaSequencer::subscribe_announcements_(void) {
     subscribe_naive_(announce);
 }
 
+void AlsaSequencer::seed_registry_(void) {
+    for (MidiPortHandle &handle : query_ports(seq_)) {
+        const uint16_t key = registry_key(handle.to_snd_addr());
+        ports_[key] = KnownPort{.handle = std::move(handle), .present = true};
+    }
+    spdlog::debug("Port registry seeded with {} ports", ports_.size());
+}
+
+void AlsaSequencer::update_registry_(const snd_seq_event_t &ev) {
+    const snd_seq_addr_t &addr = ev.data.addr;
+    switch (ev.type) {
+        case SND_SEQ_EVENT_PORT_START:
+        case SND_SEQ_EVENT_PORT_CHANGE: {
+            MidiPortHandle handle = MidiPortHandle::from_snd_addr(addr);
+            handle.expand_from_seq(seq_);
+            ports_[registry_key(addr)] = KnownPort{.handle = std::move(handle), .present = true};
+            break;
+        }
+        case SND_SEQ_EVENT_PORT_EXIT:
+            if (auto it = ports_.find(registry_key(addr)); it != ports_.end()) {
+                it->second.present = false;
+            }
+            break;
+        case SND_SEQ_EVENT_CLIENT_EXIT:
+            for (auto &[key, port] : ports_) {
+                if (port.handle.client_id == addr.client) {
+                    port.present = false;
+                }
+            }
+            break;
+        case SND_SEQ_EVENT_CLIENT_CHANGE:
+            // renamed, most likely; the ports carry the client name
+            for (auto &[key, port] : ports_) {
+                if (port.present && port.handle.client_id == addr.client) {
+                    port.handle.expand_from_seq(seq_);
+                }
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+std::vector<MidiPortHandle> AlsaSequencer::available_sources(void) {
+    std::vector<MidiPortHandle> out;
+    for (auto &[key, port] : ports_) {
+        if (port.present && port.handle.is_subscribable_source()) {
+            out.push_back(port.handle);
+        }
+    }
+    return out;
+}
+
+void AlsaSequencer::expand_midi_port(MidiPortHandle &handle) {
+    if (!handle.is_valid()) {
+        return;
+    }
+
+    const auto it = ports_.find(registry_key(handle.to_snd_addr()));
+    if (it != ports_.end()) {
+        handle = it->second.handle;
+    }
+}
+
 void AlsaSequencer::unsubscribe(const MidiPortHandle &src) {
-    if (!src.is_valid()) {
+    auto it = std::find(sources_.begin(), sources_.end(), src);
+    if (it == sources_.end()) {
         return;
     }
+    sources_.erase(it);
 
-    snd_seq_addr_t src_addr = src_.to_snd_addr();
+    snd_seq_addr_t src_addr = src.to_snd_addr();
     snd_seq_addr_t dst_addr = input_.to_snd_addr();
 
     snd_seq_port_subscribe_t *sub = nullptr;
@@ -211,65 +356,89 @@ void AlsaSequencer::unsubscribe(const MidiPortHandle &src) {
     snd_seq_port_subscribe_set_sender(sub, &src_addr);
     snd_seq_port_subscribe_set_dest(sub, &dst_addr);
 
+    // fails harmlessly if the port is already gone, in which case ALSA dropped the subscription
     (void)snd_seq_unsubscribe_port(seq_, sub);
 }
 
-std::optional<SequencerMsg> AlsaSequencer::get_event(void) {
-    snd_seq_event_t *ev = nullptr;
-    if (snd_seq_event_input(seq_, &ev) < 0 || ev == nullptr) {
-        return std::nullopt;
-    }
+size_t AlsaSequencer::drain(std::span<SeqEvent> out) {
+    size_t n = 0;
+
+    while (n < out.size()) {
+        snd_seq_event_t *ev = nullptr;
+        int rc = snd_seq_event_input(seq_, &ev);
+        if (rc == -ENOSPC) {
+            input_overruns_.fetch_add(1, std::memory_order_relaxed);
+            trace::record(trace::Kind::SEQ_OVERRUN);
+            spdlog::warn("Sequencer input overrun, events were lost");
+            continue;
+        }
+        if (rc < 0 || ev == nullptr) {
+            break;
+        }
 
-    spdlog::trace("Got: {}", fmt::streamed(*ev));
+        trace::record(trace::Kind::SEQ_EVENT, *ev);
 
-    if (is_midi_event(ev->type)) {
-        MidiMsg msg;
-        if (to_midi_bytes_(*ev, msg.data) && !msg.data.empty()) {
-            return msg;
-        }
-    }
+        SeqEvent &dst = out[n];
+        dst.source = ev->source;
+        dst.stamped = queue_ >= 0 && ev->queue == queue_ &&
+                      (ev->flags & SND_SEQ_TIME_STAMP_MASK) == SND_SEQ_TIME_STAMP_REAL;
+        dst.stamp = dst.stamped ? to_nanoseconds(ev->time.time) : std::chrono::nanoseconds{0};
 
-    if (is_announce_event(ev->type)) {
-        AnnounceMsg msg{
-            .type = to_announce_type(ev->type),
-            .addr = MidiPortHandle::from_snd_addr(ev->data.addr),
-        };
-        if (AnnounceType::UNKNOWN != msg.type) {
-            return msg;
+        if (is_midi_event(ev->type)) {
+            dst.type = SeqEventType::MIDI;
+            dst.data.midi.len = to_midi_bytes(*ev, dst.data.midi.bytes);
+            if (dst.data.midi.len > 0) {
+                n++;
+            }
+        } else if (is_announce_event(ev->type)) {
+            update_registry_(*ev);
+            dst.type = SeqEventType::ANNOUNCE;
+            dst.data.announce.type = to_announce_type(ev->type);
+            dst.data.announce.addr = ev->data.addr;
+            if (dst.data.announce.type != AnnounceType::UNKNOWN) {
+                n++;
+            }
+        } else if (ev->type == SND_SEQ_EVENT_CLIENT_CHANGE) {
+            update_registry_(*ev);
         }
     }
 
-    return std::nullopt;
+    return n;
 }
 
-bool AlsaSequencer::to_midi_bytes_(const snd_seq_event_t &ev, std::vector<uint8_t> &out) {
-    out.clear();
+uint8_t AlsaSequencer::to_midi_bytes(const snd_seq_event_t &ev, uint8_t (&out)[3]) {
     auto ch = [](int c) -> uint8_t { return static_cast<uint8_t>(c & 0x0F); };
+    auto b7 = [](int v) -> uint8_t { return static_cast<uint8_t>(v & 0x7F); };
 
     switch (ev.type) {
         case SND_SEQ_EVENT_NOTEON:
-            out = {static_cast<uint8_t>(0x90 | ch(ev.data.note.channel)),
-                static_cast<uint8_t>(ev.data.note.note & 0x7F),
-                static_cast<uint8_t>(ev.data.note.velocity & 0x7F)};
-            return true;
+            out[0] = static_cast<uint8_t>(0x90 | ch(ev.data.note.channel));
+            out[1] = b7(ev.data.note.note);
+            out[2] = b7(ev.data.note.velocity);
+            return 3;
         case SND_SEQ_EVENT_NOTEOFF:
-            out = {static_cast<uint8_t>(0x80 | ch(ev.data.note.channel)),
-                static_cast<uint8_t>(ev.data.note.note & 0x7F),
-                static_cast<uint8_t>(ev.data.note.velocity & 0x7F)};
-            return true;
+            out[0] = static_cast<uint8_t>(0x80 | ch(ev.data.note.channel));
+            out[1] = b7(ev.data.note.note);
+            out[2] = b7(ev.data.note.velocity);
+            return 3;
+        case SND_SEQ_EVENT_KEYPRESS:
+            out[0] = static_cast<uint8_t>(0xA0 | ch(ev.data.note.channel));
+            out[1] = b7(ev.data.note.note);
+            out[2] = b7(ev.data.note.velocity);
+            return 3;
         case SND_SEQ_EVENT_CONTROLLER:
-            out = {static_cast<uint8_t>(0xB0 | ch(ev.data.control.channel)),
-                static_cast<uint8_t>(ev.data.control.param & 0x7F),
-                static_cast<uint8_t>(ev.data.control.value & 0x7F)};
-            return true;
+            out[0] = static_cast<uint8_t>(0xB0 | ch(ev.data.control.channel));
+            out[1] = b7(static_cast<int>(ev.data.control.param));
+            out[2] = b7(ev.data.control.value);
+            return 3;
         case SND_SEQ_EVENT_PGMCHANGE:
-            out = {static_cast<uint8_t>(0xC0 | ch(ev.data.control.channel)),
-                static_cast<uint8_t>(ev.data.control.value & 0x7F)};
-            return true;
+            out[0] = static_cast<uint8_t>(0xC0 | ch(ev.data.control.channel));
+            out[1] = b7(ev.data.control.value);
+            return 2;
         case SND_SEQ_EVENT_CHANPRESS:
-            out = {static_cast<uint8_t>(0xD0 | ch(ev.data.control.channel)),
-                static_cast<uint8_t>(ev.data.control.value & 0x7F)};
-            return true;
+            out[0] = static_cast<uint8_t>(0xD0 | ch(ev.data.control.channel));
+            out[1] = b7(ev.data.control.value);
+            return 2;
         case SND_SEQ_EVENT_PITCHBEND: {
             int v = ev.data.control.value;
             if (v < -8192)
@@ -277,15 +446,46 @@ bool AlsaSequencer::to_midi_bytes_(const snd_seq_event_t &ev, std::vector<uint8_
             if (v > 8191)
                 v = 8191;
             int pb = v + 8192; // 0..16383
-            out = {static_cast<uint8_t>(0xE0 | ch(ev.data.control.channel)),
-                static_cast<uint8_t>(pb & 0x7F), static_cast<uint8_t>((pb >> 7) & 0x7F)};
-            return true;
+            out[0] = static_cast<uint8_t>(0xE0 | ch(ev.data.control.channel));
+            out[1] = b7(pb);
+            out[2] = b7(pb >> 7);
+            return 3;
         }
-        case SND_SEQ_EVENT_SYSEX:
-            if (!ev.data.ext.ptr || ev.data.ext.len <= 0)
-                return false;
-            out.resize(static_cast<size_t>(ev.data.ext.len));
-            std::memcpy(out.data(), ev.data.ext.ptr, out.size());
+        default:
+            return 0;
+    }
+}
+
+bool AlsaSequencer::from_midi_bytes(const SeqMidi &midi, snd_seq_event_t &ev) {
+    if (midi.len == 0) {
+        return false;
+    }
+
+    const auto channel = static_cast<unsigned char>(midi.bytes[0] & 0x0F);
+    const uint8_t d1 = midi.len > 1 ? midi.bytes[1] : 0;
+    const uint8_t d2 = midi.len > 2 ? midi.bytes[2] : 0;
+
+    switch (midi.bytes[0] & 0xF0) {
+        case 0x90:
+            snd_seq_ev_set_noteon(&ev, channel, d1, d2);
+            return true;
+        case 0x80:
+            snd_seq_ev_set_noteoff(&ev, channel, d1, d2);
+            return true;
+        case 0xA0:
+            snd_seq_ev_set_keypress(&ev, channel, d1, d2);
+            return true;
+        case 0xB0:
+            snd_seq_ev_set_controller(&ev, channel, d1, d2);
+            return true;
+        case 0xC0:
+            snd_seq_ev_set_pgmchange(&ev, channel, d1);
+            return true;
+        case 0xD0:
+            snd_seq_ev_set_chanpress(&ev, channel, d1);
+            return true;
+        case 0xE0:
+            snd_seq_ev_set_pitchbend(&ev, channel, (d1 | d2 << 7) - 8192);
             return true;
         default:
             return false;
@@ -3,58 +3,95 @@
 #include <alsa/asoundlib.h>
 #include <poll.h>
 
+#include <atomic>
 #include <chrono>
 #include <iosfwd>
 #include <optional>
+#include <span>
 #include <string>
-#include <variant>
+#include <unordered_map>
 #include <vector>
 
+#include "event_source.hpp"
 #include "midi_device.hpp"
 
 std::ostream &operator<<(std::ostream &os, const snd_seq_event_t &ev);
 
 namespace pr::midi {
 
-enum class AnnounceType { UNKNOWN, CLIENT_START, CLIENT_EXIT, PORT_START, PORT_EXIT, PORT_CHANGE };
+// Sequencer client the recorder reads from. It keeps a registry of every port on the system,
+// filled by one walk at startup and then kept current from the announcements drain() reads, so
+// resolving a hot-plugged port is a lookup rather than a fresh enumeration (which would open a
+// sequencer client of its own) however often a device comes and goes.
+class AlsaSequencer : public EventSource {
+public:
+    AlsaSequencer(
+        const std::string &client_name, const std::string &port_name, bool use_queue = true);
+    AlsaSequencer(const AlsaSequencer &) = delete;
+    AlsaSequencer &operator=(const AlsaSequencer &) = delete;
+    ~AlsaSequencer(void) override;
 
-struct MidiMsg {
-    std::vector<uint8_t> data;
-};
+    bool subscribe(const MidiPortHandle &new_src) override;
+    void unsubscribe(const MidiPortHandle &src) override;
+    bool is_subscribed(const MidiPortHandle &src) const override;
 
-struct AnnounceMsg {
-    AnnounceType type;
-    MidiPortHandle addr;
-};
+    std::vector<MidiPortHandle> available_sources(void) override;
 
-using SequencerMsg = std::variant<MidiMsg, AnnounceMsg>;
+    std::vector<MidiPortHandle> sources(void) const override {
+        return sources_;
+    }
 
-class AlsaSequencer {
-public:
-    AlsaSequencer(const std::string &client_name, const std::string &port_name);
-    AlsaSequencer(const AlsaSequencer &) = delete;
-    AlsaSequencer &operator=(const AlsaSequencer &) = delete;
-    ~AlsaSequencer(void);
+    int client_id(void) const override {
+        return input_.client_id;
+    }
 
-    bool subscribe(const MidiPortHandle &new_src);
-    void unsubscribe(const MidiPortHandle &src);
+    // times the kernel reported that the client input pool overflowed and events were lost
+    uint64_t input_overruns(void) const override {
+        return input_overruns_.load(std::memory_order_relaxed);
+    }
 
-    std::vector<struct pollfd> get_poll_desc(void);
-    std::optional<SequencerMsg> get_event(void);
+    std::vector<struct pollfd> get_poll_desc(void) override;
+    // Reads every pending event into out; returns how many were written. Only allocates to update
+    // the port registry on announcements.
+    size_t drain(std::span<SeqEvent> out) override;
 
-    void expand_midi_port(MidiPortHandle &handle) {
-        handle.expand_from_seq(seq_);
+    bool has_queue(void) const noexcept {
+        return queue_ >= 0;
     }
+    std::optional<std::chrono::nanoseconds> queue_time(void) override;
+
+    // Converts a channel event to raw MIDI bytes; returns the length, or 0 if it isn't one
+    static uint8_t to_midi_bytes(const snd_seq_event_t &ev, uint8_t (&out)[3]);
+    // The reverse: sets the type and data of ev for a channel message; false if it isn't one
+    static bool from_midi_bytes(const SeqMidi &midi, snd_seq_event_t &ev);
+
+    // fills in what the registry knows about the port; ports that are gone keep their last info
+    void expand_midi_port(MidiPortHandle &handle) override;
 
 private:
-    static bool to_midi_bytes_(const snd_seq_event_t &ev, std::vector<uint8_t> &out);
+    struct KnownPort {
+        MidiPortHandle handle;
+        bool present;
+    };
+
+    static uint16_t registry_key(const snd_seq_addr_t &addr) noexcept {
+        return static_cast<uint16_t>(addr.client << 8 | addr.port);
+    }
+
     bool subscribe_naive_(const MidiPortHandle &src);
     void subscribe_announcements_(void);
+    void start_queue_(const std::string &name);
+    void seed_registry_(void);
+    void update_registry_(const snd_seq_event_t &ev);
 
 private:
     snd_seq_t *seq_{nullptr};
-    MidiPortHandle src_;
+    int queue_{-1};
+    std::atomic<uint64_t> input_overruns_{0};
+    std::vector<MidiPortHandle> sources_;
     MidiPortHandle input_;
+    // capture thread once the recorder has started
+    std::unordered_map<uint16_t, KnownPort> ports_;
 };
 
 } // namespace pr::midi
@@ -0,0 +1,220 @@
+#include "analytics.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <span>
+
+#include <spdlog/spdlog.h>
+
+namespace pr::midi {
+
+static constexpr size_t kHistory = AnalyticsSnapshot::kHistorySeconds;
+
+template <class T, size_t N>
+static void append_json_array(std::string &out, const std::array<T, N> &values) {
+    out += '[';
+    for (size_t i = 0; i < N; i++) {
+        fmt::format_to(std::back_inserter(out), "{}{}", i ? "," : "", values[i]);
+    }
+    out += ']';
+}
+
+void LiveAnalytics::reset(int64_t now_ns) {
+    start_ns_ = last_ns_ = now_ns;
+    notes_ = 0;
+    held_.reset();
+    holders_.fill(0);
+    sustained_.reset();
+    held_keys_ = sustained_keys_ = 0;
+    pedals_.reset();
+    pedal_down_since_ = pedal_down_ns_ = 0;
+    polyphony_ = peak_polyphony_ = 0;
+    polyphony_since_ = now_ns;
+    polyphony_area_ = 0.0;
+    seconds_.fill(Second{});
+    second_ = 0;
+    peak_notes_per_second_ = 0;
+    key_hits_.fill(0);
+    for (auto &octave : velocity_) {
+        octave.fill(0);
+    }
+}
+
+void LiveAnalytics::advance_(int64_t ns) {
+    last_ns_ = std::max(ns, last_ns_);
+    const int64_t second = (last_ns_ - start_ns_) / kSecond;
+    if (second <= second_) {
+        return;
+    }
+
+    peak_notes_per_second_ =
+        std::max(peak_notes_per_second_, seconds_[static_cast<size_t>(second_) % kHistory].notes);
+    // at most one pass over the ring however long nothing happened
+    for (int64_t s = std::max(second_ + 1, second - static_cast<int64_t>(kHistory) + 1);
+         s <= second; s++) {
+        seconds_[static_cast<size_t>(s) % kHistory] =
+            Second{.notes = 0, .max_polyphony = static_cast<uint16_t>(polyphony_)};
+    }
+    second_ = second;
+}
+
+void LiveAnalytics::set_polyphony_(int64_t ns, size_t polyphony) {
+    polyphony_area_ += static_cast<double>(polyphony_) * static_cast<double>(ns - polyphony_since_);
+    polyphony_since_ = ns;
+    polyphony_ = polyphony;
+    peak_polyphony_ = std::max(peak_polyphony_, polyphony);
+
+    Second &current = seconds_[static_cast<size_t>(second_) % kHistory];
+    current.max_polyphony =
+        std::max(current.max_polyphony, static_cast<uint16_t>(std::min<size_t>(polyphony, 0xFFFF)));
+}
+
+void LiveAnalytics::observe(int64_t ns, const SeqMidi &midi) {
+    if (midi.len < 3) {
+        return;
+    }
+    advance_(ns);
+
+    const size_t channel = midi.bytes[0] & 0x0F;
+    const uint8_t note = midi.bytes[1] & 0x7F;
+    switch (midi.bytes[0] & 0xF0) {
+        case 0x90:
+        case 0x80: {
+            const bool down = (midi.bytes[0] & 0xF0) == 0x90 && midi.bytes[2] > 0;
+            const size_t index = channel * 128 + note;
+            if (held_[index] == down) {
+                return;
+            }
+            held_[index] = down;
+
+            if (down) {
+                notes_++;
+                seconds_[static_cast<size_t>(second_) % kHistory].notes++;
+                key_hits_[note]++;
+                velocity_[note / 12][(midi.bytes[2] & 0x7F) / 8]++;
+                if (holders_[note]++ == 0) {
+                    held_keys_++;
+                    if (sustained_[note]) {
+                        sustained_[note] = false;
+                        sustained_keys_--;
+                    }
+                }
+            } else if (--holders_[note] == 0) {
+                held_keys_--;
+                if (pedals_.any()) {
+                    sustained_[note] = true;
+                    sustained_keys_++;
+                }
+            }
+            break;
+        }
+        case 0xB0: {
+            if (midi.bytes[1] != 64) {
+                return;
+            }
+            const bool down = midi.bytes[2] >= 64;
+            if (pedals_[channel] == down) {
+                return;
+            }
+
+            const bool was_down = pedals_.any();
+            pedals_[channel] = down;
+            if (!was_down) {
+                pedal_down_since_ = last_ns_;
+            } else if (pedals_.none()) {
+                pedal_down_ns_ += last_ns_ - pedal_down_since_;
+                sustained_.reset();
+                sustained_keys_ = 0;
+            }
+            break;
+        }
+        default:
+            return;
+    }
+
+    set_polyphony_(last_ns_, held_keys_ + sustained_keys_);
+}
+
+void LiveAnalytics::publish(int64_t now_ns) {
+    advance_(now_ns);
+    set_polyphony_(last_ns_, polyphony_);
+
+    const int64_t session_ns = last_ns_ - start_ns_;
+    AnalyticsSnapshot snapshot{};
+    snapshot.session_s = static_cast<double>(session_ns) / 1e9;
+    snapshot.notes = notes_;
+
+    // the current second counts for the part of it that has passed
+    const int64_t window = std::min(kRateWindowS, second_ + 1);
+    uint64_t window_notes = 0;
+    for (int64_t i = 0; i < window; i++) {
+        window_notes += seconds_[static_cast<size_t>(second_ - i) % kHistory].notes;
+    }
+    const int64_t window_ns = session_ns - (second_ + 1 - window) * kSecond;
+    if (window_ns > 0) {
+        snapshot.notes_per_second =
+            static_cast<double>(window_notes) * 1e9 / static_cast<double>(window_ns);
+    }
+    snapshot.peak_notes_per_second =
+        std::max(peak_notes_per_second_, seconds_[static_cast<size_t>(second_) % kHistory].notes);
+
+    if (session_ns > 0) {
+        const int64_t down_ns = pedal_down_ns_ + (pedals_.any() ? last_ns_ - pedal_down_since_ : 0);
+        snapshot.sustain_duty = static_cast<double>(down_ns) / static_cast<double>(session_ns);
+        snapshot.average_polyphony = polyphony_area_ / static_cast<double>(session_ns);
+    }
+    snapshot.polyphony = static_cast<uint16_t>(std::min<size_t>(polyphony_, 0xFFFF));
+    snapshot.peak_polyphony = static_cast<uint16_t>(std::min<size_t>(peak_polyphony_, 0xFFFF));
+
+    for (size_t i = 0; i < kHistory; i++) {
+        const int64_t s = second_ - static_cast<int64_t>(kHistory) + 1 + static_cast<int64_t>(i);
+        snapshot.polyphony_history[i] =
+            s >= 0 ? seconds_[static_cast<size_t>(s) % kHistory].max_polyphony : 0;
+    }
+    snapshot.key_hits = key_hits_;
+    snapshot.velocity = velocity_;
+
+    published_.publish(snapshot);
+}
+
+bool LiveAnalytics::snapshot(AnalyticsSnapshot &out) const noexcept {
+    while (true) {
+        const uint64_t head = published_.head();
+        if (head == 0) {
+            return false;
+        }
+
+        // only fails if the owner published over this slot while it was being copied
+        uint64_t cursor = head - 1;
+        uint64_t skipped = 0;
+        if (published_.read(cursor, std::span(&out, 1), skipped) == 1) {
+            return true;
+        }
+    }
+}
+
+std::string render_analytics_json(const AnalyticsSnapshot &snapshot) {
+    std::string out = fmt::format(
+        "{{\"session_s\": {:.3f}, \"notes\": {}, \"notes_per_second\": {:.2f}, "
+        "\"peak_notes_per_second\": {}, \"sustain_duty\": {:.4f}, \"polyphony\": {}, "
+        "\"peak_polyphony\": {}, \"average_polyphony\": {:.2f},\n\"polyphony_history\": ",
+        snapshot.session_s, snapshot.notes, snapshot.notes_per_second,
+        snapshot.peak_notes_per_second, snapshot.sustain_duty, snapshot.polyphony,
+        snapshot.peak_polyphony, snapshot.average_polyphony);
+    append_json_array(out, snapshot.polyphony_history);
+
+    out += ",\n\"key_hits\": ";
+    append_json_array(out, snapshot.key_hits);
+
+    // octave -1 holds notes 0-11, as in C-1
+    out += ",\n\"velocity_by_octave\": {";
+    for (size_t octave = 0; octave < snapshot.velocity.size(); octave++) {
+        fmt::format_to(std::back_inserter(out), "{}\n\"{}\": ", octave ? "," : "",
+            static_cast<int>(octave) - 1);
+        append_json_array(out, snapshot.velocity[octave]);
+    }
+    out += "\n}}\n";
+    return out;
+}
+
+} // namespace pr::midi
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "broadcast_ring.hpp"
+#include "event_source.hpp"
+
+namespace pr::midi {
+
+// What LiveAnalytics publishes; plain data so it can go through a BroadcastRing
+struct AnalyticsSnapshot {
+    static constexpr size_t kKeys = 128;
+    // MIDI octaves, C-1 to G9
+    static constexpr size_t kOctaves = 11;
+    static constexpr size_t kVelocityBuckets = 16;
+    static constexpr size_t kHistorySeconds = 60;
+
+    double session_s;
+    uint64_t notes;
+    // over the last kRateWindowS seconds
+    double notes_per_second;
+    // busiest whole second so far
+    uint32_t peak_notes_per_second;
+    // share of the session the sustain pedal was down on any channel
+    double sustain_duty;
+    uint16_t polyphony;
+    uint16_t peak_polyphony;
+    // time-weighted over the session
+    double average_polyphony;
+    // most notes sounding in each of the last kHistorySeconds seconds, oldest first
+    std::array<uint16_t, kHistorySeconds> polyphony_history;
+    std::array<uint32_t, kKeys> key_hits;
+    // note-on velocities by octave, velocity / 8
+    std::array<std::array<uint32_t, kVelocityBuckets>, kOctaves> velocity;
+};
+
+// Running practice statistics over every captured note and pedal change of the session.
+//
+// observe() is O(1) over fixed arrays indexed by key and controller, so it keeps up with the
+// capture rate. The owning thread publish()es a snapshot now and then into a small broadcast
+// ring, which any number of readers copy from without a lock and without holding it up.
+class LiveAnalytics {
+public:
+    static constexpr int64_t kRateWindowS = 10;
+
+    // owning thread only; times are steady_clock nanoseconds
+    void reset(int64_t now_ns);
+    void observe(int64_t ns, const SeqMidi &midi);
+    void publish(int64_t now_ns);
+
+    // the most recent snapshot; false if nothing was published yet
+    bool snapshot(AnalyticsSnapshot &out) const noexcept;
+
+private:
+    static constexpr int64_t kSecond = 1'000'000'000;
+
+    struct Second {
+        uint32_t notes;
+        uint16_t max_polyphony;
+    };
+
+    void advance_(int64_t ns);
+    void set_polyphony_(int64_t ns, size_t polyphony);
+
+private:
+    int64_t start_ns_{0};
+    int64_t last_ns_{0};
+    uint64_t notes_{0};
+
+    // indexed by channel * 128 + note
+    std::bitset<16 * 128> held_;
+    // channels holding each key, and keys only still sounding because of the pedal
+    std::array<uint8_t, AnalyticsSnapshot::kKeys> holders_{};
+    std::bitset<AnalyticsSnapshot::kKeys> sustained_;
+    size_t held_keys_{0};
+    size_t sustained_keys_{0};
+
+    std::bitset<16> pedals_;
+    int64_t pedal_down_since_{0};
+    int64_t pedal_down_ns_{0};
+
+    size_t polyphony_{0};
+    size_t peak_polyphony_{0};
+    int64_t polyphony_since_{0};
+    // polyphony integrated over time, in note-nanoseconds
+    double polyphony_area_{0.0};
+
+    // ring of the last kHistorySeconds seconds, indexed by second % kHistorySeconds
+    std::array<Second, AnalyticsSnapshot::kHistorySeconds> seconds_{};
+    int64_t second_{0};
+    uint32_t peak_notes_per_second_{0};
+
+    std::array<uint32_t, AnalyticsSnapshot::kKeys> key_hits_{};
+    std::array<std::array<uint32_t, AnalyticsSnapshot::kVelocityBuckets>,
+        AnalyticsSnapshot::kOctaves>
+        velocity_{};
+
+    BroadcastRing<AnalyticsSnapshot> published_{4};
+};
+
+std::string render_analytics_json(const AnalyticsSnapshot &snapshot);
+
+} // namespace pr::midi
@@ -0,0 +1,488 @@
+#include "archive.hpp"
+
+#include "file_io.hpp"
+#include "smf_writer.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <spdlog/spdlog.h>
+
+namespace pr::midi {
+
+static constexpr char kMagic[8] = {'P', 'R', 'A', 'R', 'C', '0', '1', '\n'};
+static constexpr char kTrailerMagic[8] = {'P', 'R', 'A', 'R', 'C', 'I', 'D', 'X'};
+static constexpr char kBlockMagic[4] = {'P', 'R', 'B', 'K'};
+static constexpr size_t kHeaderSize = sizeof(kMagic) + 2 * sizeof(uint32_t);
+static constexpr size_t kTrailerSize = 2 * sizeof(uint64_t) + sizeof(kTrailerMagic);
+// keeps the .mid writer's buffer bounded on export
+static constexpr size_t kExportFlushBlocks = 256;
+
+// bytes in a message with this status, or 0 for ones that don't fit in an event (sysex)
+static uint8_t message_length(uint8_t status) {
+    if (status < 0x80) {
+        return 0;
+    }
+    if (status < 0xF0) {
+        const uint8_t kind = status & 0xF0;
+        return kind == 0xC0 || kind == 0xD0 ? 2 : 3;
+    }
+    switch (status) {
+        case 0xF1:
+        case 0xF3:
+            return 2;
+        case 0xF2:
+            return 3;
+        case 0xF0:
+        case 0xF7:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+static void put_varint(std::vector<uint8_t> &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(0x80 | (value & 0x7F)));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+static bool get_varint(const uint8_t *&p, const uint8_t *end, uint64_t &value) {
+    value = 0;
+    for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+        const uint8_t byte = *p++;
+        value |= uint64_t{byte & 0x7Fu} << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the header fields in front of the crc, then the packed bytes
+static uint32_t block_crc(const ArchiveBlockHeader &header, const uint8_t *packed) {
+    const auto *fields = reinterpret_cast<const Bytef *>(&header);
+    const uLong crc = crc32(0, fields, offsetof(ArchiveBlockHeader, crc));
+    return static_cast<uint32_t>(crc32(crc, packed, header.packed_bytes));
+}
+
+// the columns of one block, before deflating: tick deltas, then statuses, then first data bytes,
+// then second data bytes
+static std::vector<uint8_t> encode_columns(const ArchiveEvent *events, size_t count) {
+    std::vector<uint8_t> ticks;
+    std::vector<uint8_t> status;
+    std::vector<uint8_t> data1;
+    std::vector<uint8_t> data2;
+    status.reserve(count);
+    data1.reserve(count);
+    data2.reserve(count);
+
+    uint64_t last_tick = events[0].tick;
+    for (size_t i = 0; i < count; i++) {
+        const ArchiveEvent &ev = events[i];
+        put_varint(ticks, ev.tick - last_tick);
+        last_tick = ev.tick;
+
+        status.push_back(ev.bytes[0]);
+        if (ev.len > 1) {
+            data1.push_back(ev.bytes[1]);
+        }
+        if (ev.len > 2) {
+            data2.push_back(ev.bytes[2]);
+        }
+    }
+
+    ticks.insert(ticks.end(), status.begin(), status.end());
+    ticks.insert(ticks.end(), data1.begin(), data1.end());
+    ticks.insert(ticks.end(), data2.begin(), data2.end());
+    return ticks;
+}
+
+static bool decode_columns(const std::vector<uint8_t> &raw, const ArchiveBlockHeader &header,
+    std::vector<ArchiveEvent> &out) {
+    const size_t first = out.size();
+    const uint8_t *p = raw.data();
+    const uint8_t *end = raw.data() + raw.size();
+
+    uint64_t tick = header.first_tick;
+    for (uint32_t i = 0; i < header.events; i++) {
+        uint64_t delta = 0;
+        if (!get_varint(p, end, delta)) {
+            return false;
+        }
+        tick += delta;
+        out.push_back(ArchiveEvent{.tick = tick, .len = 0, .bytes = {0, 0, 0}});
+    }
+
+    if (static_cast<size_t>(end - p) < header.events) {
+        return false;
+    }
+    for (size_t i = first; i < out.size(); i++) {
+        out[i].bytes[0] = *p++;
+        out[i].len = message_length(out[i].bytes[0]);
+    }
+    for (unsigned column = 1; column < 3; column++) {
+        for (size_t i = first; i < out.size(); i++) {
+            if (out[i].len > column) {
+                if (p == end) {
+                    return false;
+                }
+                out[i].bytes[column] = *p++;
+            }
+        }
+    }
+    return p == end;
+}
+
+ArchiveWriter::ArchiveWriter(const std::filesystem::path &path, int ppq, double tempo_bpm)
+    : path_(path) {
+    const auto usec_per_quarter = static_cast<uint32_t>(std::lround(60'000'000.0 / tempo_bpm));
+    const auto ppq32 = static_cast<uint32_t>(ppq);
+
+    uint8_t header[kHeaderSize];
+    std::memcpy(header, kMagic, sizeof(kMagic));
+    std::memcpy(header + sizeof(kMagic), &ppq32, sizeof(ppq32));
+    std::memcpy(header + sizeof(kMagic) + sizeof(ppq32), &usec_per_quarter, sizeof(uint32_t));
+
+    fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        throw_sys("open", path_);
+    }
+    if (!pwrite_all(fd_, header, sizeof(header), 0) || fdatasync(fd_) != 0) {
+        ::close(fd_);
+        fd_ = -1;
+        throw_sys("write", path_);
+    }
+
+    sealed_end_ = file_end_ = static_cast<off_t>(kHeaderSize);
+    open_block_.reserve(kBlockEvents);
+}
+
+ArchiveWriter::~ArchiveWriter(void) {
+    if (fd_ >= 0) {
+        (void)close();
+    }
+}
+
+void ArchiveWriter::append(int64_t tick, const uint8_t *data, size_t len) {
+    if (len == 0 || len > 3 || message_length(data[0]) != len) {
+        return;
+    }
+
+    ArchiveEvent ev{.tick = static_cast<uint64_t>(std::max<int64_t>(tick, 0)),
+        .len = static_cast<uint8_t>(len),
+        .bytes = {0, 0, 0}};
+    std::memcpy(ev.bytes, data, len);
+    // ticks only go forward within a block, so the deltas stay unsigned
+    if (!open_block_.empty()) {
+        ev.tick = std::max(ev.tick, open_block_.back().tick);
+    } else if (!index_.empty()) {
+        ev.tick = std::max(ev.tick, index_.back().last_tick);
+    }
+
+    open_block_.push_back(ev);
+    open_block_dirty_ = true;
+}
+
+bool ArchiveWriter::write_block_(
+    const ArchiveEvent *events, size_t count, off_t offset, off_t &end) {
+    const std::vector<uint8_t> raw = encode_columns(events, count);
+    uLongf packed_len = compressBound(static_cast<uLong>(raw.size()));
+    std::vector<uint8_t> packed(sizeof(ArchiveBlockHeader) + packed_len);
+    if (compress2(packed.data() + sizeof(ArchiveBlockHeader), &packed_len, raw.data(),
+            static_cast<uLong>(raw.size()), Z_DEFAULT_COMPRESSION) != Z_OK) {
+        return false;
+    }
+
+    ArchiveBlockHeader header{};
+    std::memcpy(header.magic, kBlockMagic, sizeof(kBlockMagic));
+    header.events = static_cast<uint32_t>(count);
+    header.raw_bytes = static_cast<uint32_t>(raw.size());
+    header.packed_bytes = static_cast<uint32_t>(packed_len);
+    header.first_tick = events[0].tick;
+    header.last_tick = events[count - 1].tick;
+    header.crc = block_crc(header, packed.data() + sizeof(header));
+    std::memcpy(packed.data(), &header, sizeof(header));
+
+    const size_t total = sizeof(header) + packed_len;
+    if (!pwrite_all(fd_, packed.data(), total, offset)) {
+        return false;
+    }
+    end = offset + static_cast<off_t>(total);
+    return true;
+}
+
+bool ArchiveWriter::flush(void) {
+    if (fd_ < 0) {
+        return false;
+    }
+    if (!open_block_dirty_) {
+        return true;
+    }
+
+    // full blocks go where the previous partial one was, and stay. The events of the ones that
+    // made it into the index leave the open block even if a later one fails, or the next flush
+    // would seal them a second time.
+    size_t sealed = 0;
+    bool ok = true;
+    while (ok && open_block_.size() - sealed >= kBlockEvents) {
+        const ArchiveEvent *events = open_block_.data() + sealed;
+        off_t end = 0;
+        if (!(ok = write_block_(events, kBlockEvents, sealed_end_, end))) {
+            break;
+        }
+        index_.push_back(ArchiveIndexEntry{.first_tick = events[0].tick,
+            .last_tick = events[kBlockEvents - 1].tick,
+            .offset = static_cast<uint64_t>(sealed_end_),
+            .events = kBlockEvents});
+        sealed_end_ = end;
+        sealed += kBlockEvents;
+    }
+    open_block_.erase(open_block_.begin(), open_block_.begin() + static_cast<ptrdiff_t>(sealed));
+    if (!ok) {
+        spdlog::error("Could not write {}: {}", path_.string(), std::strerror(errno));
+        return false;
+    }
+
+    off_t end = sealed_end_;
+    if (!open_block_.empty() &&
+        !write_block_(open_block_.data(), open_block_.size(), sealed_end_, end)) {
+        spdlog::error("Could not write {}: {}", path_.string(), std::strerror(errno));
+        return false;
+    }
+    // a longer partial block from before would otherwise still be found past this one
+    if (end < file_end_ && ftruncate(fd_, end) != 0) {
+        return false;
+    }
+    file_end_ = end;
+
+    if (fdatasync(fd_) != 0) {
+        return false;
+    }
+    open_block_dirty_ = false;
+    return true;
+}
+
+bool ArchiveWriter::close(void) {
+    if (fd_ < 0) {
+        return false;
+    }
+
+    bool ok = flush();
+    if (ok && !open_block_.empty()) {
+        index_.push_back(ArchiveIndexEntry{.first_tick = open_block_.front().tick,
+            .last_tick = open_block_.back().tick,
+            .offset = static_cast<uint64_t>(sealed_end_),
+            .events = open_block_.size()});
+        open_block_.clear();
+    }
+
+    if (ok) {
+        std::vector<uint8_t> tail(index_.size() * sizeof(ArchiveIndexEntry) + kTrailerSize);
+        const uint64_t trailer[2] = {static_cast<uint64_t>(file_end_), index_.size()};
+        uint8_t *p = tail.data();
+        std::memcpy(p, index_.data(), index_.size() * sizeof(ArchiveIndexEntry));
+        p += index_.size() * sizeof(ArchiveIndexEntry);
+        std::memcpy(p, trailer, sizeof(trailer));
+        std::memcpy(p + sizeof(trailer), kTrailerMagic, sizeof(kTrailerMagic));
+        ok = pwrite_all(fd_, tail.data(), tail.size(), file_end_) && fdatasync(fd_) == 0;
+    }
+
+    ok = ::close(fd_) == 0 && ok;
+    fd_ = -1;
+    return ok;
+}
+
+ArchiveReader::ArchiveReader(const std::filesystem::path &path) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw_sys("open", path);
+    }
+
+    struct stat st {};
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw_sys("stat", path);
+    }
+    if (static_cast<size_t>(st.st_size) < kHeaderSize) {
+        ::close(fd);
+        throw std::runtime_error(path.string() + " is not an archive");
+    }
+
+    const bool mapped = map_.map(fd, static_cast<size_t>(st.st_size));
+    ::close(fd);
+    if (!mapped) {
+        throw_sys("mmap", path);
+    }
+    const uint8_t *const data = map_.data();
+
+    uint32_t ppq = 0;
+    std::memcpy(&ppq, data + sizeof(kMagic), sizeof(ppq));
+    std::memcpy(&usec_per_quarter_, data + sizeof(kMagic) + sizeof(ppq), sizeof(uint32_t));
+    ppq_ = static_cast<int>(ppq);
+    if (std::memcmp(data, kMagic, sizeof(kMagic)) != 0 || ppq == 0 || ppq > 0x7FFF ||
+        usec_per_quarter_ == 0) {
+        throw std::runtime_error(path.string() + " is not an archive");
+    }
+
+    if (!(complete_ = load_index_())) {
+        scan_blocks_();
+        spdlog::warn("{} has no index, recovered {} blocks", path.string(), index_.size());
+    }
+}
+
+bool ArchiveReader::load_index_(void) {
+    const uint8_t *const data = map_.data();
+    const size_t size = map_.size();
+    if (size < kHeaderSize + kTrailerSize ||
+        std::memcmp(data + size - sizeof(kTrailerMagic), kTrailerMagic, sizeof(kTrailerMagic))) {
+        return false;
+    }
+
+    uint64_t trailer[2];
+    std::memcpy(trailer, data + size - kTrailerSize, sizeof(trailer));
+    const uint64_t index_offset = trailer[0];
+    const uint64_t count = trailer[1];
+    if (index_offset < kHeaderSize || index_offset > size - kTrailerSize ||
+        count != (size - kTrailerSize - index_offset) / sizeof(ArchiveIndexEntry) ||
+        index_offset + count * sizeof(ArchiveIndexEntry) + kTrailerSize != size) {
+        return false;
+    }
+
+    index_.resize(count);
+    std::memcpy(index_.data(), data + index_offset, count * sizeof(ArchiveIndexEntry));
+    for (const ArchiveIndexEntry &entry : index_) {
+        if (entry.offset < kHeaderSize ||
+            entry.offset + sizeof(ArchiveBlockHeader) > index_offset) {
+            index_.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+void ArchiveReader::scan_blocks_(void) {
+    index_.clear();
+
+    const uint8_t *const data = map_.data();
+    const size_t size = map_.size();
+    size_t offset = kHeaderSize;
+    while (size - offset >= sizeof(ArchiveBlockHeader)) {
+        ArchiveBlockHeader header;
+        std::memcpy(&header, data + offset, sizeof(header));
+        const uint8_t *packed = data + offset + sizeof(header);
+        if (std::memcmp(header.magic, kBlockMagic, sizeof(kBlockMagic)) != 0 ||
+            header.packed_bytes > size - offset - sizeof(header) ||
+            block_crc(header, packed) != header.crc) {
+            break;
+        }
+
+        index_.push_back(ArchiveIndexEntry{.first_tick = header.first_tick,
+            .last_tick = header.last_tick,
+            .offset = offset,
+            .events = header.events});
+        offset += sizeof(header) + header.packed_bytes;
+    }
+}
+
+uint64_t ArchiveReader::event_count(void) const noexcept {
+    uint64_t total = 0;
+    for (const ArchiveIndexEntry &entry : index_) {
+        total += entry.events;
+    }
+    return total;
+}
+
+size_t ArchiveReader::find_block(uint64_t tick) const noexcept {
+    const auto it = std::lower_bound(index_.begin(), index_.end(), tick,
+        [](const ArchiveIndexEntry &entry, uint64_t t) { return entry.last_tick < t; });
+    return static_cast<size_t>(it - index_.begin());
+}
+
+bool ArchiveReader::read_block(size_t block, std::vector<ArchiveEvent> &out) const {
+    if (block >= index_.size()) {
+        return false;
+    }
+
+    const uint64_t offset = index_[block].offset;
+    ArchiveBlockHeader header;
+    std::memcpy(&header, map_.data() + offset, sizeof(header));
+    const uint8_t *packed = map_.data() + offset + sizeof(header);
+    if (std::memcmp(header.magic, kBlockMagic, sizeof(kBlockMagic)) != 0 ||
+        header.packed_bytes > map_.size() - offset - sizeof(header) ||
+        block_crc(header, packed) != header.crc) {
+        return false;
+    }
+
+    std::vector<uint8_t> raw(header.raw_bytes);
+    uLongf raw_len = header.raw_bytes;
+    if (uncompress(raw.data(), &raw_len, packed, header.packed_bytes) != Z_OK ||
+        raw_len != header.raw_bytes) {
+        return false;
+    }
+
+    const size_t before = out.size();
+    if (!decode_columns(raw, header, out)) {
+        out.resize(before);
+        return false;
+    }
+    return true;
+}
+
+std::vector<ArchiveEvent> ArchiveReader::events(uint64_t from_tick, uint64_t to_tick) const {
+    std::vector<ArchiveEvent> out;
+    std::vector<ArchiveEvent> block_events;
+    for (size_t b = find_block(from_tick); b < index_.size() && index_[b].first_tick < to_tick;
+         b++) {
+        block_events.clear();
+        if (!read_block(b, block_events)) {
+            break;
+        }
+        for (const ArchiveEvent &ev : block_events) {
+            if (ev.tick >= from_tick && ev.tick < to_tick) {
+                out.push_back(ev);
+            }
+        }
+    }
+    return out;
+}
+
+void export_archive_to_midi(
+    const std::filesystem::path &archive_path, const std::filesystem::path &midi_path) {
+    const ArchiveReader archive(archive_path);
+    SmfWriter writer(midi_path, archive.ppq(), archive.tempo_bpm());
+
+    std::vector<ArchiveEvent> events;
+    for (size_t b = 0; b < archive.blocks().size(); b++) {
+        events.clear();
+        if (!archive.read_block(b, events)) {
+            spdlog::warn("{}: block {} is damaged, stopping there", archive_path.string(), b);
+            break;
+        }
+        for (const ArchiveEvent &ev : events) {
+            writer.append(static_cast<int64_t>(std::min<uint64_t>(ev.tick, INT64_MAX)), ev.bytes,
+                ev.len);
+        }
+        if ((b + 1) % kExportFlushBlocks == 0 && !writer.flush()) {
+            throw std::runtime_error("could not write " + midi_path.string());
+        }
+    }
+
+    if (!writer.finish()) {
+        throw std::runtime_error("could not write " + midi_path.string());
+    }
+}
+
+} // namespace pr::midi
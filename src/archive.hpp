@@ -0,0 +1,156 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+#include <vector>
+
+#include "file_io.hpp"
+
+namespace pr::midi {
+
+static constexpr std::string_view kArchiveExtension = ".prarc";
+
+// Compact long-term store for one track: the events in blocks of kBlockEvents, each block stored
+// as columns (delta-varint ticks, status bytes, first data bytes, second data bytes) and deflated,
+// with an index of the tick range and offset of every block at the end of the file.
+//
+// File layout, host byte order:
+//   header   magic "PRARC01\n", u32 ppq, u32 microseconds per quarter
+//   blocks   ArchiveBlockHeader + deflated columns, back to back
+//   index    one ArchiveIndexEntry per block
+//   trailer  u64 index offset, u64 block count, magic "PRARCIDX"
+// A file without a valid trailer (still being written, or cut short by a crash) is read by
+// walking the block headers up to the first one that doesn't check out.
+struct ArchiveBlockHeader {
+    char magic[4];
+    uint32_t events;
+    uint32_t raw_bytes;
+    uint32_t packed_bytes;
+    uint64_t first_tick;
+    uint64_t last_tick;
+    // crc32 of the fields above, then of the packed bytes
+    uint32_t crc;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(ArchiveBlockHeader) == 40);
+
+struct ArchiveIndexEntry {
+    uint64_t first_tick;
+    uint64_t last_tick;
+    uint64_t offset;
+    uint64_t events;
+};
+
+static_assert(sizeof(ArchiveIndexEntry) == 32);
+
+struct ArchiveEvent {
+    uint64_t tick;
+    uint8_t len;
+    uint8_t bytes[3];
+};
+
+// Append-only writer, same interface as SmfWriter so the recorder can keep both side by side.
+//
+// Full blocks are written once and never touched again. The events after the last full block are
+// written as a short block past them on every flush, replacing the previous one, so a crash in the
+// middle of a flush can lose that partial block but never anything before it.
+class ArchiveWriter {
+public:
+    static constexpr size_t kBlockEvents = 4096;
+
+    ArchiveWriter(const std::filesystem::path &path, int ppq, double tempo_bpm);
+    ~ArchiveWriter(void);
+
+    ArchiveWriter(const ArchiveWriter &) = delete;
+    ArchiveWriter &operator=(const ArchiveWriter &) = delete;
+
+    // events that aren't a complete MIDI message (by their status byte) are skipped
+    void append(int64_t tick, const uint8_t *data, size_t len);
+
+    bool flush(void);
+    // flushes, writes the index and closes the file
+    bool close(void);
+
+    const std::filesystem::path &path(void) const noexcept {
+        return path_;
+    }
+
+private:
+    bool write_block_(const ArchiveEvent *events, size_t count, off_t offset, off_t &end);
+
+private:
+    int fd_{-1};
+    std::filesystem::path path_;
+
+    // everything after the last full block
+    std::vector<ArchiveEvent> open_block_;
+    bool open_block_dirty_{false};
+    std::vector<ArchiveIndexEntry> index_;
+    off_t sealed_end_{0};
+    off_t file_end_{0};
+};
+
+// Memory-mapped reader. Finding the block that holds a given tick is a binary search over the
+// index; only the blocks that are actually read get inflated.
+class ArchiveReader {
+public:
+    // throws std::runtime_error if the file can't be mapped or isn't an archive
+    explicit ArchiveReader(const std::filesystem::path &path);
+
+    ArchiveReader(const ArchiveReader &) = delete;
+    ArchiveReader &operator=(const ArchiveReader &) = delete;
+
+    int ppq(void) const noexcept {
+        return ppq_;
+    }
+
+    double tempo_bpm(void) const noexcept {
+        return 60'000'000.0 / usec_per_quarter_;
+    }
+
+    double ticks_per_second(void) const noexcept {
+        return ppq_ * 1'000'000.0 / usec_per_quarter_;
+    }
+
+    // false if the index had to be rebuilt from the blocks
+    bool complete(void) const noexcept {
+        return complete_;
+    }
+
+    const std::vector<ArchiveIndexEntry> &blocks(void) const noexcept {
+        return index_;
+    }
+
+    uint64_t event_count(void) const noexcept;
+
+    // first block with events at or after tick, or blocks().size() if there is none
+    size_t find_block(uint64_t tick) const noexcept;
+
+    // appends the events of one block to out; false if the block is damaged
+    bool read_block(size_t block, std::vector<ArchiveEvent> &out) const;
+
+    // events with from_tick <= tick < to_tick
+    std::vector<ArchiveEvent> events(uint64_t from_tick, uint64_t to_tick) const;
+
+private:
+    bool load_index_(void);
+    void scan_blocks_(void);
+
+private:
+    FileMapping map_;
+    int ppq_{0};
+    uint32_t usec_per_quarter_{0};
+    bool complete_{false};
+    std::vector<ArchiveIndexEntry> index_;
+};
+
+// Writes the archive as a format 0 .mid; throws std::runtime_error on failure
+void export_archive_to_midi(
+    const std::filesystem::path &archive_path, const std::filesystem::path &midi_path);
+
+} // namespace pr::midi
@@ -0,0 +1,90 @@
+#include "beat_tracker.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+namespace pr::midi {
+
+void BeatTracker::onset(double t_s) {
+    const size_t known = std::min(onset_count_, kHistory);
+    if (known > 0 && t_s - onsets_[(onset_count_ - 1) % kHistory] < kChordS) {
+        return;
+    }
+
+    for (double &bin : histogram_) {
+        bin *= kDecay;
+    }
+    // the nearest onsets are the likeliest to be a beat or a subdivision of one apart
+    for (size_t back = 1; back <= known; back++) {
+        vote_(t_s - onsets_[(onset_count_ - back) % kHistory], 1.0 / static_cast<double>(back));
+    }
+
+    onsets_[onset_count_ % kHistory] = t_s;
+    onset_count_++;
+    if (onset_count_ >= kMinOnsets) {
+        estimate_();
+    }
+}
+
+void BeatTracker::vote_(double interval_s, double weight) {
+    if (interval_s < kMinIntervalS || interval_s > kMaxIntervalS) {
+        return;
+    }
+
+    // position in the octave, split between the two nearest bins
+    double octave = std::log2(60.0 / interval_s / kMinBpm);
+    octave -= std::floor(octave);
+    const double pos = octave * static_cast<double>(kBins);
+    const auto lower = static_cast<size_t>(pos) % kBins;
+    const double frac = pos - std::floor(pos);
+    histogram_[lower] += weight * (1.0 - frac);
+    histogram_[(lower + 1) % kBins] += weight * frac;
+}
+
+void BeatTracker::estimate_(void) {
+    const double total = std::accumulate(histogram_.begin(), histogram_.end(), 0.0);
+    if (total <= 0.0) {
+        return;
+    }
+
+    const auto peak = static_cast<size_t>(
+        std::max_element(histogram_.begin(), histogram_.end()) - histogram_.begin());
+    // the octave wraps around, so bin 0 and bin kBins - 1 are neighbours
+    const double left = histogram_[(peak + kBins - 1) % kBins];
+    const double mid = histogram_[peak];
+    const double right = histogram_[(peak + 1) % kBins];
+    if ((left + mid + right) / total < kMinConfidence) {
+        return;
+    }
+
+    // vertex of the parabola through the peak and its neighbours
+    const double denom = left - 2.0 * mid + right;
+    const double offset = denom != 0.0 ? 0.5 * (left - right) / denom : 0.0;
+    double bpm = kMinBpm * std::exp2((static_cast<double>(peak) + offset) / kBins);
+
+    // stay in the octave the estimate was already in rather than halve or double the tempo
+    if (bpm_ > 0.0) {
+        while (bpm > bpm_ * std::sqrt(2.0)) {
+            bpm /= 2.0;
+        }
+        while (bpm < bpm_ / std::sqrt(2.0)) {
+            bpm *= 2.0;
+        }
+    }
+    bpm_ = bpm;
+}
+
+int64_t TempoMap::to_file_tick(int64_t clock_tick) const noexcept {
+    return segment_file_ +
+        std::llround(static_cast<double>(clock_tick - segment_clock_) * bpm_ / clock_bpm_);
+}
+
+int64_t TempoMap::change(int64_t clock_tick, double bpm) noexcept {
+    segment_file_ = to_file_tick(clock_tick);
+    segment_clock_ = clock_tick;
+    bpm_ = bpm;
+    return segment_file_;
+}
+
+} // namespace pr::midi
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace pr::midi {
+
+// Online tempo estimate from note onsets.
+//
+// Every onset adds the intervals back to the last kHistory onsets to a histogram of tempi folded
+// into one octave (kMinBpm to twice that), so beats, half beats and whole bars all vote for the
+// same tempo, and the histogram decays a little with each onset so the estimate follows the
+// music. The cost per onset is bounded by kHistory and kBins, however long the session.
+class BeatTracker {
+public:
+    static constexpr double kMinBpm = 72.0;
+    // 1% steps across the octave
+    static constexpr size_t kBins = 70;
+    static constexpr size_t kHistory = 8;
+
+    // onsets closer than this to the previous one are the same chord
+    static constexpr double kChordS = 0.05;
+    static constexpr double kMinIntervalS = 0.1;
+    static constexpr double kMaxIntervalS = 3.0;
+    static constexpr double kDecay = 0.97;
+    // share of the histogram the peak has to hold before there is an estimate
+    static constexpr double kMinConfidence = 0.2;
+    static constexpr size_t kMinOnsets = 8;
+
+    void onset(double t_s);
+
+    // current tempo, in the octave closest to the previous estimate, or 0 if it isn't clear yet
+    double bpm(void) const noexcept {
+        return bpm_;
+    }
+
+private:
+    void vote_(double interval_s, double weight);
+    void estimate_(void);
+
+private:
+    std::array<double, kHistory> onsets_{};
+    size_t onset_count_{0};
+    std::array<double, kBins> histogram_{};
+    double bpm_{0.0};
+};
+
+// Maps the capture clock, which ticks at a fixed tempo, to the ticks of a file whose tempo
+// changes: piecewise linear, one segment per tempo change, so the file plays back at the same
+// times as the capture clock while its beats follow the music.
+class TempoMap {
+public:
+    TempoMap(double clock_bpm, double bpm) : clock_bpm_(clock_bpm), bpm_(bpm) {}
+
+    int64_t to_file_tick(int64_t clock_tick) const noexcept;
+
+    // starts a segment at clock_tick; returns the file tick it starts at
+    int64_t change(int64_t clock_tick, double bpm) noexcept;
+
+    double bpm(void) const noexcept {
+        return bpm_;
+    }
+
+    // file tick of the last change
+    int64_t segment_start(void) const noexcept {
+        return segment_file_;
+    }
+
+private:
+    double clock_bpm_;
+    double bpm_;
+    int64_t segment_clock_{0};
+    int64_t segment_file_{0};
+};
+
+} // namespace pr::midi
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <type_traits>
+
+namespace pr::midi {
+
+// Bounded lock-free single-producer/multi-consumer broadcast ring.
+//
+// The producer never looks at the readers: publish() overwrites the oldest slot and is O(1) no
+// matter how many there are. Each reader keeps its own cursor (a sequence number) and calls
+// read(); a reader that fell more than capacity() behind is moved up to the oldest event still
+// in the ring and told how many it missed. Slots are seqlocks, so a read racing an overwrite is
+// detected and counted as missed instead of returning a torn value.
+template <class T>
+class BroadcastRing {
+    static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+    explicit BroadcastRing(size_t capacity)
+        : capacity_(std::bit_ceil(std::max<size_t>(capacity, 2))), mask_(capacity_ - 1),
+          slots_(std::make_unique<Slot[]>(capacity_)) {}
+
+    BroadcastRing(const BroadcastRing &) = delete;
+    BroadcastRing &operator=(const BroadcastRing &) = delete;
+
+    // producer only
+    void publish(const T &value) noexcept {
+        const uint64_t seq = head_.load(std::memory_order_relaxed);
+        Slot &slot = slots_[seq & mask_];
+
+        // odd while being written, 2 * (seq + 1) once it holds seq
+        // release on every word keeps the odd version ahead of them for any reader that sees one
+        slot.version.store(2 * seq + 1, std::memory_order_relaxed);
+
+        uint64_t words[kWords] = {};
+        std::memcpy(words, &value, sizeof(T));
+        for (size_t i = 0; i < kWords; i++) {
+            slot.words[i].store(words[i], std::memory_order_release);
+        }
+
+        slot.version.store(2 * seq + 2, std::memory_order_release);
+        head_.store(seq + 1, std::memory_order_release);
+    }
+
+    // sequence number the next publish() will get
+    uint64_t head(void) const noexcept {
+        return head_.load(std::memory_order_acquire);
+    }
+
+    // Copies events from cursor onwards into out and advances cursor past them. Returns how many
+    // were copied; skipped is set to the number of events that were overwritten before this reader
+    // got to them.
+    size_t read(uint64_t &cursor, std::span<T> out, uint64_t &skipped) const noexcept {
+        skipped = 0;
+        size_t n = 0;
+        while (n < out.size()) {
+            const uint64_t head = head_.load(std::memory_order_acquire);
+            if (cursor >= head) {
+                break;
+            }
+            if (head - cursor > capacity_) {
+                skipped += head - capacity_ - cursor;
+                cursor = head - capacity_;
+            }
+
+            // a failed read means the slot was overwritten under us, so that event is gone too
+            if (try_read_(cursor, out[n])) {
+                n++;
+            } else {
+                skipped++;
+            }
+            cursor++;
+        }
+        return n;
+    }
+
+    size_t capacity(void) const noexcept {
+        return capacity_;
+    }
+
+private:
+    static constexpr size_t kCacheLine = 64;
+    static constexpr size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    struct Slot {
+        std::atomic<uint64_t> version{0};
+        std::atomic<uint64_t> words[kWords];
+    };
+
+    bool try_read_(uint64_t seq, T &out) const noexcept {
+        const Slot &slot = slots_[seq & mask_];
+
+        const uint64_t version = slot.version.load(std::memory_order_acquire);
+        if (version != 2 * seq + 2) {
+            return false;
+        }
+
+        // acquire on every word keeps the version re-check behind them
+        uint64_t words[kWords];
+        for (size_t i = 0; i < kWords; i++) {
+            words[i] = slot.words[i].load(std::memory_order_acquire);
+        }
+
+        if (slot.version.load(std::memory_order_relaxed) != version) {
+            return false;
+        }
+
+        std::memcpy(&out, words, sizeof(T));
+        return true;
+    }
+
+private:
+    const size_t capacity_;
+    const size_t mask_;
+    std::unique_ptr<Slot[]> slots_;
+
+    alignas(kCacheLine) std::atomic<uint64_t> head_{0};
+};
+
+} // namespace pr::midi
@@ -0,0 +1,466 @@
+#include "catalog.hpp"
+#include "file_io.hpp"
+#include "json_escape.hpp"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <regex>
+#include <stdexcept>
+
+#include <spdlog/spdlog.h>
+
+namespace pr::midi {
+
+// journal records: [u8 kind][entry]
+static constexpr char kMagic[8] = {'P', 'R', 'C', 'A', 'T', '0', '2', '\n'};
+static constexpr uint8_t kUpsert = 1;
+static constexpr uint8_t kRemove = 2;
+
+static RecordWriter encode_record(uint8_t kind, const CatalogEntry &entry) {
+    RecordWriter w;
+    w.put(kind);
+    if (kind == kUpsert) {
+        w.put(entry.started_ns);
+        w.put(entry.duration_ns);
+        w.put(entry.notes);
+        w.put(entry.events);
+        w.put(entry.min_pitch);
+        w.put(entry.max_pitch);
+        w.put(entry.dynamics);
+        w.put(entry.density);
+        w.put(entry.size);
+        w.put(entry.mtime_ns);
+        w.put_str(entry.device);
+    }
+    w.put_str(entry.file);
+    return w;
+}
+
+static bool decode_record(RecordReader &r, uint8_t &kind, CatalogEntry &entry) {
+    if (!r.get(kind)) {
+        return false;
+    }
+    if (kind == kUpsert) {
+        if (!r.get(entry.started_ns) || !r.get(entry.duration_ns) || !r.get(entry.notes) ||
+            !r.get(entry.events) || !r.get(entry.min_pitch) || !r.get(entry.max_pitch) ||
+            !r.get(entry.dynamics) || !r.get(entry.density) || !r.get(entry.size) ||
+            !r.get(entry.mtime_ns) || !r.get_str(entry.device)) {
+            return false;
+        }
+    }
+    return r.get_str(entry.file);
+}
+
+static bool is_recording(const std::filesystem::path &path) {
+    return path.extension() == ".mid";
+}
+
+// "<stem>-YYYYmmdd-HHMMSS[-N]-<device>" as written by the recorder
+static bool parse_take_name(const std::string &stem, int64_t &started_ns, std::string &device) {
+    static const std::regex kTakeName(R"(^.*-(\d{8}-\d{6})(?:-\d+)?-([^-].*)$)");
+
+    std::smatch m;
+    if (!std::regex_match(stem, m, kTakeName)) {
+        return false;
+    }
+
+    struct tm local {};
+    if (strptime(m[1].str().c_str(), "%Y%m%d-%H%M%S", &local) == nullptr) {
+        return false;
+    }
+    local.tm_isdst = -1;
+    started_ns = int64_t{mktime(&local)} * 1'000'000'000;
+    device = m[2].str();
+    return true;
+}
+
+static std::optional<CatalogEntry> scan_file(const std::filesystem::path &path) {
+    CatalogEntry entry;
+    entry.file = path.filename().string();
+    if (!stat_file(path, entry.size, entry.mtime_ns)) {
+        return std::nullopt;
+    }
+
+    std::optional<TakeSummary> summary = load_summary(path);
+    if (!summary && !(summary = summarize_file(path))) {
+        spdlog::warn("Catalog: could not parse {}", path.string());
+        return std::nullopt;
+    }
+    entry.duration_ns = static_cast<int64_t>(summary->duration_us) * 1000;
+    entry.notes = summary->notes;
+    entry.events = summary->events;
+    entry.min_pitch = summary->min_pitch;
+    entry.max_pitch = summary->max_pitch;
+    entry.dynamics = summary->dynamics;
+    entry.density = summary->density;
+
+    if (!parse_take_name(path.stem().string(), entry.started_ns, entry.device)) {
+        entry.started_ns = entry.mtime_ns - entry.duration_ns;
+    }
+    return entry;
+}
+
+Catalog::Catalog(std::filesystem::path dir) : dir_(std::move(dir)), journal_("Catalog", kMagic) {
+    load_();
+}
+
+Catalog::~Catalog(void) {
+    stop_watching();
+}
+
+void Catalog::load_(void) {
+    journal_.open(dir_ / kIndexName, [this](RecordReader &r) {
+        uint8_t kind = 0;
+        CatalogEntry entry;
+        if (!decode_record(r, kind, entry)) {
+            return false;
+        }
+        if (kind == kUpsert) {
+            upsert_(std::move(entry));
+        } else {
+            (void)erase_(entry.file);
+        }
+        return true;
+    });
+
+    if (journal_.bloated(entries_.size())) {
+        compact_();
+    }
+    spdlog::info("Catalog: {} recordings in {}", entries_.size(), dir_.string());
+}
+
+void Catalog::compact_(void) {
+    std::vector<RecordWriter> records;
+    records.reserve(entries_.size());
+    for (const CatalogEntry &entry : entries_) {
+        records.push_back(encode_record(kUpsert, entry));
+    }
+    journal_.rewrite(records);
+}
+
+void Catalog::append_record_(uint8_t kind, const CatalogEntry &entry) {
+    if (journal_.append(encode_record(kind, entry)) && journal_.bloated(entries_.size())) {
+        compact_();
+    }
+}
+
+static bool started_before(const CatalogEntry &a, int64_t started_ns, const std::string &file) {
+    return a.started_ns < started_ns || (a.started_ns == started_ns && a.file < file);
+}
+
+void Catalog::upsert_(CatalogEntry entry) {
+    (void)erase_(entry.file);
+
+    auto it = std::lower_bound(entries_.begin(), entries_.end(), entry,
+        [](const CatalogEntry &a, const CatalogEntry &b) {
+            return started_before(a, b.started_ns, b.file);
+        });
+    started_by_file_[entry.file] = entry.started_ns;
+    entries_.insert(it, std::move(entry));
+}
+
+bool Catalog::erase_(const std::string &file) {
+    auto found = started_by_file_.find(file);
+    if (found == started_by_file_.end()) {
+        return false;
+    }
+
+    const int64_t started_ns = found->second;
+    auto it = std::lower_bound(entries_.begin(), entries_.end(), file,
+        [&](const CatalogEntry &a, const std::string &f) {
+            return started_before(a, started_ns, f);
+        });
+    if (it != entries_.end() && it->file == file) {
+        entries_.erase(it);
+    }
+    started_by_file_.erase(found);
+    return true;
+}
+
+std::vector<CatalogEntry> Catalog::scan_parallel_(
+    const std::vector<std::filesystem::path> &files, unsigned threads) const {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned>(std::min<size_t>(threads, files.size()));
+
+    std::vector<std::optional<CatalogEntry>> scanned(files.size());
+    std::atomic<size_t> next{0};
+    const auto worker = [&]() {
+        for (size_t i = next++; i < files.size(); i = next++) {
+            scanned[i] = scan_file(files[i]);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : pool) {
+        t.join();
+    }
+
+    std::vector<CatalogEntry> out;
+    for (std::optional<CatalogEntry> &entry : scanned) {
+        if (entry) {
+            out.push_back(std::move(*entry));
+        }
+    }
+    return out;
+}
+
+void Catalog::sync(unsigned threads) {
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::filesystem::path> stale;
+    std::vector<std::string> missing;
+    {
+        std::shared_lock lock(mutex_);
+        std::unordered_map<std::string, bool> seen;
+
+        std::error_code ec;
+        for (const auto &dirent : std::filesystem::directory_iterator(dir_, ec)) {
+            const std::filesystem::path &path = dirent.path();
+            if (!is_recording(path)) {
+                continue;
+            }
+
+            const std::string file = path.filename().string();
+            seen[file] = true;
+
+            uint64_t size = 0;
+            int64_t mtime_ns = 0;
+            auto found = started_by_file_.find(file);
+            if (found == started_by_file_.end() || !stat_file(path, size, mtime_ns)) {
+                stale.push_back(path);
+                continue;
+            }
+
+            auto it = std::lower_bound(entries_.begin(), entries_.end(), file,
+                [&](const CatalogEntry &a, const std::string &f) {
+                    return started_before(a, found->second, f);
+                });
+            if (it == entries_.end() || it->size != size || it->mtime_ns != mtime_ns) {
+                stale.push_back(path);
+            }
+        }
+
+        for (const CatalogEntry &entry : entries_) {
+            if (!seen.contains(entry.file)) {
+                missing.push_back(entry.file);
+            }
+        }
+    }
+
+    std::vector<CatalogEntry> scanned = scan_parallel_(stale, threads);
+
+    std::unique_lock lock(mutex_);
+    for (const std::string &file : missing) {
+        if (erase_(file)) {
+            append_record_(kRemove, CatalogEntry{.file = file});
+        }
+    }
+    for (CatalogEntry &entry : scanned) {
+        append_record_(kUpsert, entry);
+        upsert_(std::move(entry));
+    }
+
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    spdlog::info("Catalog: synced {} recordings ({} scanned, {} gone) in {:.1f}ms",
+        entries_.size(), scanned.size(), missing.size(), elapsed.count());
+}
+
+void Catalog::rebuild(unsigned threads) {
+    {
+        std::unique_lock lock(mutex_);
+        entries_.clear();
+        started_by_file_.clear();
+        compact_();
+    }
+    sync(threads);
+}
+
+void Catalog::add(const std::filesystem::path &file,
+    std::optional<std::chrono::system_clock::time_point> started, const std::string &device) {
+    const std::filesystem::path path = dir_ / file.filename();
+    const std::string key = path.filename().string();
+
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    if (!is_recording(path) || !stat_file(path, size, mtime_ns)) {
+        return;
+    }
+
+    // the inotify watch and the recorder both report a finalized take; only parse it once
+    std::optional<CatalogEntry> entry;
+    {
+        std::shared_lock lock(mutex_);
+        if (auto found = started_by_file_.find(key); found != started_by_file_.end()) {
+            auto it = std::lower_bound(entries_.begin(), entries_.end(), key,
+                [&](const CatalogEntry &a, const std::string &f) {
+                    return started_before(a, found->second, f);
+                });
+            if (it != entries_.end() && it->size == size && it->mtime_ns == mtime_ns) {
+                if (!started && device.empty()) {
+                    return;
+                }
+                entry = *it;
+            }
+        }
+    }
+
+    if (!entry && !(entry = scan_file(path))) {
+        return;
+    }
+    if (started) {
+        entry->started_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            started->time_since_epoch())
+                                .count();
+    }
+    if (!device.empty()) {
+        entry->device = device;
+    }
+
+    std::unique_lock lock(mutex_);
+    append_record_(kUpsert, *entry);
+    upsert_(std::move(*entry));
+}
+
+void Catalog::remove(const std::filesystem::path &file) {
+    const std::string key = file.filename().string();
+
+    std::unique_lock lock(mutex_);
+    if (erase_(key)) {
+        append_record_(kRemove, CatalogEntry{.file = key});
+    }
+}
+
+std::vector<CatalogEntry> Catalog::list(int64_t from_ns, int64_t to_ns, size_t limit) const {
+    std::shared_lock lock(mutex_);
+
+    const auto by_start = [](const CatalogEntry &a, int64_t t) { return a.started_ns < t; };
+    auto first = std::lower_bound(entries_.begin(), entries_.end(), from_ns, by_start);
+    auto last = std::lower_bound(first, entries_.end(), to_ns, by_start);
+
+    std::vector<CatalogEntry> out;
+    out.reserve(std::min<size_t>(limit, static_cast<size_t>(last - first)));
+    while (last != first && out.size() < limit) {
+        out.push_back(*--last);
+    }
+    return out;
+}
+
+size_t Catalog::size(void) const {
+    std::shared_lock lock(mutex_);
+    return entries_.size();
+}
+
+bool Catalog::watch(void) {
+    if (watch_thread_.joinable()) {
+        return true;
+    }
+
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inotify_fd_ < 0 || stop_fd_ < 0 ||
+        inotify_add_watch(inotify_fd_, dir_.c_str(),
+            IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) < 0) {
+        spdlog::warn("Catalog: not watching {}: {}", dir_.string(), std::strerror(errno));
+        stop_watching();
+        return false;
+    }
+
+    watch_thread_ = std::thread([this]() { watch_loop_(); });
+    return true;
+}
+
+void Catalog::stop_watching(void) {
+    if (watch_thread_.joinable()) {
+        const uint64_t one = 1;
+        (void)write(stop_fd_, &one, sizeof(one));
+        watch_thread_.join();
+    }
+
+    for (int *fd : {&inotify_fd_, &stop_fd_}) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+void Catalog::watch_loop_(void) {
+    pollfd fds[] = {
+        {.fd = stop_fd_, .events = POLLIN, .revents = 0},
+        {.fd = inotify_fd_, .events = POLLIN, .revents = 0},
+    };
+
+    alignas(inotify_event) char buf[16 * 1024];
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            spdlog::error("Catalog: poll: {}", std::strerror(errno));
+            return;
+        }
+        if (fds[0].revents & POLLIN) {
+            return;
+        }
+
+        ssize_t len = 0;
+        while ((len = read(inotify_fd_, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len;) {
+                const auto *ev = reinterpret_cast<const inotify_event *>(p);
+                p += sizeof(inotify_event) + ev->len;
+
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    sync(1);
+                    continue;
+                }
+                if (ev->len == 0 || !is_recording(ev->name)) {
+                    continue;
+                }
+
+                if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                    add(ev->name);
+                } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    remove(ev->name);
+                }
+            }
+        }
+    }
+}
+
+std::string render_catalog_json(const std::vector<CatalogEntry> &entries) {
+    std::string out = "[";
+    for (const CatalogEntry &entry : entries) {
+        std::string density;
+        for (const uint8_t slice : entry.density) {
+            fmt::format_to(std::back_inserter(density), "{}{}", density.empty() ? "" : ", ", slice);
+        }
+        fmt::format_to(std::back_inserter(out),
+            "{}\n{{\"file\": \"{}\", \"device\": \"{}\", \"started\": {:.3f}, "
+            "\"duration_s\": {:.3f}, \"notes\": {}, \"events\": {}, \"min_pitch\": {}, "
+            "\"max_pitch\": {}, \"dynamics\": \"{}\", \"density\": [{}], \"size\": {}}}",
+            out.size() > 1 ? "," : "", json_escape(entry.file), json_escape(entry.device),
+            static_cast<double>(entry.started_ns) / 1e9,
+            static_cast<double>(entry.duration_ns) / 1e9, entry.notes, entry.events,
+            entry.min_pitch, entry.max_pitch, dynamics_name(entry.dynamics), density, entry.size);
+    }
+    out += "\n]\n";
+    return out;
+}
+
+} // namespace pr::midi
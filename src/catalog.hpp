@@ -0,0 +1,108 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "record_io.hpp"
+#include "take_summary.hpp"
+
+namespace pr::midi {
+
+// What the catalog knows about one finished recording
+struct CatalogEntry {
+    // relative to the catalog directory
+    std::string file;
+    std::string device;
+    // unix time of the first event, and how long the take runs
+    int64_t started_ns = 0;
+    int64_t duration_ns = 0;
+    uint32_t notes = 0;
+    uint32_t events = 0;
+    // 127 / 0 if there are no notes
+    uint8_t min_pitch = 127;
+    uint8_t max_pitch = 0;
+    // as in TakeSummary
+    uint8_t dynamics = 0;
+    std::array<uint8_t, TakeSummary::kDensitySlices> density{};
+    // to notice files changed behind our back
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+};
+
+// Persistent index of the .mid files in one directory, so listing the library never has to parse
+// them. Entries are kept in memory sorted by start time; every change is appended to a journal
+// ("catalog.idx") that is replayed on load and compacted when it gets much larger than the index.
+//
+// It is kept current three ways: add() from the recorder when a take is finalized, an inotify
+// watch for files copied in or deleted out-of-band, and sync() on startup, which parses whatever
+// is new or changed on all cores. A recording with a "<take>.mid.sum" summary is indexed from that
+// one small read; only the others are parsed.
+class Catalog {
+public:
+    static constexpr const char *kIndexName = "catalog.idx";
+
+    explicit Catalog(std::filesystem::path dir);
+    ~Catalog(void);
+
+    Catalog(const Catalog &) = delete;
+    Catalog &operator=(const Catalog &) = delete;
+
+    // brings the index in line with the directory; threads = 0 uses every core
+    void sync(unsigned threads = 0);
+    // forgets everything and rescans the whole directory
+    void rebuild(unsigned threads = 0);
+
+    // (re)indexes one file; started/device override what would be guessed from the file
+    void add(const std::filesystem::path &file,
+        std::optional<std::chrono::system_clock::time_point> started = {},
+        const std::string &device = {});
+    void remove(const std::filesystem::path &file);
+
+    bool watch(void);
+    void stop_watching(void);
+
+    // newest first, started within [from_ns, to_ns)
+    std::vector<CatalogEntry> list(int64_t from_ns, int64_t to_ns, size_t limit) const;
+    size_t size(void) const;
+
+    const std::filesystem::path &dir(void) const noexcept {
+        return dir_;
+    }
+
+private:
+    void load_(void);
+    void compact_(void);
+    void append_record_(uint8_t kind, const CatalogEntry &entry);
+    void upsert_(CatalogEntry entry);
+    bool erase_(const std::string &file);
+    std::vector<CatalogEntry> scan_parallel_(
+        const std::vector<std::filesystem::path> &files, unsigned threads) const;
+    void watch_loop_(void);
+
+private:
+    std::filesystem::path dir_;
+
+    mutable std::shared_mutex mutex_;
+    // sorted by (started_ns, file)
+    std::vector<CatalogEntry> entries_;
+    std::unordered_map<std::string, int64_t> started_by_file_;
+    Journal journal_;
+
+    int inotify_fd_{-1};
+    int stop_fd_{-1};
+    std::thread watch_thread_{};
+};
+
+// JSON array of entries, as served by /recordings
+std::string render_catalog_json(const std::vector<CatalogEntry> &entries);
+
+} // namespace pr::midi
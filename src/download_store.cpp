@@ -0,0 +1,333 @@
+#include "download_store.hpp"
+
+#include "file_io.hpp"
+#include "take_finalizer.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <httplib.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace pr::midi {
+
+// per call of the content provider
+static constexpr size_t kChunkBytes = 256 * 1024;
+
+// the layout SmfWriter gives every take
+static constexpr size_t kTrackLengthOffset = 18;
+static constexpr size_t kTrackDataOffset = 22;
+static constexpr uint8_t kEndOfTrack[] = {0x00, 0xFF, 0x2F, 0x00};
+
+// what a response sends: head bytes of the mapping, then the tail. The mapping is shared, so it
+// stays alive as long as a response still uses it.
+struct Body {
+    std::shared_ptr<const FileMapping> file;
+    size_t head = 0;
+    std::string_view tail;
+    std::string etag;
+
+    size_t size(void) const noexcept {
+        return head + tail.size();
+    }
+};
+
+static std::shared_ptr<const FileMapping> map_prefix(int fd, size_t size) {
+    auto mapping = std::make_shared<FileMapping>();
+    if (!mapping->map(fd, size)) {
+        return nullptr;
+    }
+    return mapping;
+}
+
+// the committed part of a take SmfWriter is still appending to, with its own end-of-track: the
+// last four bytes the MTrk length covers are the end-of-track of that flush, or already the empty
+// text event the next flush turned it into
+static bool open_partial(int fd, const struct stat &st, Body &body) {
+    uint8_t header[kTrackDataOffset];
+    if (pread(fd, header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) ||
+        std::memcmp(header, "MThd", 4) != 0 || std::memcmp(header + 14, "MTrk", 4) != 0) {
+        return false;
+    }
+
+    const size_t committed = kTrackDataOffset + be32(header + kTrackLengthOffset);
+    if (committed < kTrackDataOffset + sizeof(kEndOfTrack) ||
+        committed > static_cast<size_t>(st.st_size) || !(body.file = map_prefix(fd, committed))) {
+        return false;
+    }
+
+    const uint8_t *end = body.file->data() + committed - sizeof(kEndOfTrack);
+    if (end[0] != 0x00 || end[1] != 0xFF || (end[2] != 0x2F && end[2] != 0x01) || end[3] != 0x00) {
+        return false;
+    }
+    body.head = committed - sizeof(kEndOfTrack);
+    body.tail = std::string_view(reinterpret_cast<const char *>(kEndOfTrack), sizeof(kEndOfTrack));
+    // the bytes a length covers never change, so the length is as good as a hash
+    body.etag = fmt::format("\"{:x}-{:x}\"", st.st_ino, committed);
+    return true;
+}
+
+static bool open_body(const std::filesystem::path &path, bool partial, Body &body) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st {};
+    bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (ok && partial) {
+        ok = open_partial(fd, st, body);
+    } else if (ok) {
+        body.head = static_cast<size_t>(st.st_size);
+        body.etag = fmt::format("\"{:x}-{:x}-{:x}\"", st.st_ino, st.st_size, mtime_ns(st));
+        ok = (body.file = map_prefix(fd, body.head)) != nullptr;
+    }
+    // the mapping outlives the descriptor
+    close(fd);
+    return ok;
+}
+
+static bool write_body(const Body &body, size_t offset, size_t length, httplib::DataSink &sink) {
+    if (offset < body.head) {
+        return sink.write(reinterpret_cast<const char *>(body.file->data() + offset),
+            std::min(length, body.head - offset));
+    }
+    const size_t at = offset - body.head;
+    return sink.write(body.tail.data() + at, std::min(length, body.tail.size() - at));
+}
+
+// "<file>.gz", if it was written after the file was last changed
+static bool fresh_gzip(const std::filesystem::path &file, const std::filesystem::path &gz) {
+    struct stat file_st {};
+    struct stat gz_st {};
+    return stat(file.c_str(), &file_st) == 0 && stat(gz.c_str(), &gz_st) == 0 &&
+        mtime_ns(gz_st) >= mtime_ns(file_st);
+}
+
+// compressed kChunkBytes at a time from the mapping, so memory use doesn't grow with the file
+static bool write_gzip(const std::filesystem::path &file, const std::filesystem::path &gz) {
+    Body body;
+    if (!open_body(file, false, body)) {
+        return false;
+    }
+
+    const std::filesystem::path tmp = gz.string() + ".tmp";
+    const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    z_stream zs{};
+    bool ok = deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                  Z_DEFAULT_STRATEGY) == Z_OK;
+    if (ok) {
+        std::vector<uint8_t> packed(kChunkBytes);
+        const uint8_t *in = body.file->data();
+        size_t left = body.head;
+        int rc = Z_OK;
+        while (ok && rc != Z_STREAM_END) {
+            if (zs.avail_in == 0 && left > 0) {
+                const size_t n = std::min(left, kChunkBytes);
+                zs.next_in = const_cast<Bytef *>(in);
+                zs.avail_in = static_cast<uInt>(n);
+                in += n;
+                left -= n;
+            }
+            zs.next_out = packed.data();
+            zs.avail_out = static_cast<uInt>(packed.size());
+            rc = deflate(&zs, left == 0 ? Z_FINISH : Z_NO_FLUSH);
+            ok = (rc == Z_OK || rc == Z_STREAM_END) &&
+                write_all(fd, packed.data(), packed.size() - zs.avail_out);
+        }
+        deflateEnd(&zs);
+    }
+
+    // synced before the rename, so a crash never leaves a short .gz that looks fresh
+    ok = ok && fdatasync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), gz.c_str()) != 0) {
+        (void)unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+static std::string_view trim(std::string_view s) {
+    s.remove_prefix(std::min(s.find_first_not_of(" \t"), s.size()));
+    return s.substr(0, s.find_last_not_of(" \t") + 1);
+}
+
+static bool same_token(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return std::tolower(static_cast<unsigned char>(x)) ==
+            std::tolower(static_cast<unsigned char>(y));
+    });
+}
+
+// gzip (or x-gzip) listed with a q-value above 0, or else * with one; "gzip;q=0" refuses it
+static bool accepts_gzip(std::string_view accept_encoding) {
+    std::optional<bool> gzip;
+    std::optional<bool> any;
+    while (!accept_encoding.empty()) {
+        const size_t comma = std::min(accept_encoding.find(','), accept_encoding.size());
+        std::string_view item = accept_encoding.substr(0, comma);
+        accept_encoding.remove_prefix(std::min(comma + 1, accept_encoding.size()));
+
+        const size_t semi = std::min(item.find(';'), item.size());
+        const std::string_view coding = trim(item.substr(0, semi));
+        // q is 0 to 1 with up to three decimals, so it is above 0 iff it has a non-zero digit
+        bool wanted = true;
+        for (std::string_view params = item.substr(semi); !params.empty();) {
+            params.remove_prefix(1);
+            const size_t next = std::min(params.find(';'), params.size());
+            const std::string_view param = trim(params.substr(0, next));
+            params.remove_prefix(next);
+            if (param.size() >= 2 && same_token(param.substr(0, 2), "q=")) {
+                wanted = param.find_first_of("123456789", 2) != std::string_view::npos;
+            }
+        }
+
+        if (same_token(coding, "gzip") || same_token(coding, "x-gzip")) {
+            gzip = wanted;
+        } else if (coding == "*") {
+            any = wanted;
+        }
+    }
+    return gzip ? *gzip : any.value_or(false);
+}
+
+// a list of tags, or *; weak tags compare as if they were strong
+static bool etag_matches(std::string_view if_none_match, std::string_view etag) {
+    while (!if_none_match.empty()) {
+        const size_t comma = std::min(if_none_match.find(','), if_none_match.size());
+        std::string_view tag = if_none_match.substr(0, comma);
+        if_none_match.remove_prefix(std::min(comma + 1, if_none_match.size()));
+
+        tag = trim(tag);
+        if (tag.starts_with("W/")) {
+            tag.remove_prefix(2);
+        }
+        if (tag == "*" || tag == etag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+DownloadStore::DownloadStore(std::filesystem::path dir) : dir_(std::move(dir)) {
+    thread_ = std::thread([this]() { run_(); });
+}
+
+DownloadStore::~DownloadStore(void) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+void DownloadStore::precompress(const std::filesystem::path &file) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!pending_.insert(file.string()).second) {
+            return;
+        }
+        queue_.push_back(file);
+    }
+    cv_.notify_one();
+}
+
+void DownloadStore::run_(void) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+        if (stopping_) {
+            break;
+        }
+
+        const std::filesystem::path file = std::move(queue_.front());
+        queue_.pop_front();
+
+        lock.unlock();
+        const std::filesystem::path gz = file.string() + kGzipSuffix;
+        if (!fresh_gzip(file, gz)) {
+            const auto start = std::chrono::steady_clock::now();
+            if (write_gzip(file, gz)) {
+                const std::chrono::duration<double, std::milli> elapsed =
+                    std::chrono::steady_clock::now() - start;
+                spdlog::debug("Compressed {} in {:.1f}ms", gz.string(), elapsed.count());
+            } else {
+                spdlog::warn("Could not write {}", gz.string());
+            }
+        }
+        lock.lock();
+
+        pending_.erase(file.string());
+    }
+}
+
+void DownloadStore::attach(httplib::Server &router) {
+    router.Get(
+        R"(/recordings/([^/]+))", [this](const httplib::Request &req, httplib::Response &res) {
+            // never leave the directory
+            const std::string name = req.matches[1].str();
+            const std::filesystem::path path = dir_ / std::filesystem::path(name).filename();
+            const bool partial = path.extension() == kPartialSuffix;
+            const std::filesystem::path take = partial ? path.stem() : path.filename();
+            if (path.filename() != name || take.extension() != ".mid") {
+                res.status = 404;
+                return;
+            }
+
+            // a range continues bytes the client already has, so it always gets the file itself
+            const bool gzip = !partial && !req.has_header("Range") &&
+                accepts_gzip(req.get_header_value("Accept-Encoding"));
+            const std::filesystem::path gz = path.string() + kGzipSuffix;
+            Body body;
+            const bool compressed = gzip && fresh_gzip(path, gz) && open_body(gz, false, body);
+            if (!compressed && !open_body(path, partial, body)) {
+                res.status = 404;
+                return;
+            }
+            if (gzip && !compressed) {
+                precompress(path);
+            }
+
+            res.set_header("ETag", body.etag);
+            res.set_header("Cache-Control", "no-cache");
+            res.set_header("Accept-Ranges", "bytes");
+            if (!partial) {
+                res.set_header("Vary", "Accept-Encoding");
+            }
+            if (etag_matches(req.get_header_value("If-None-Match"), body.etag)) {
+                res.status = 304;
+                return;
+            }
+
+            if (compressed) {
+                res.set_header("Content-Encoding", "gzip");
+            }
+            res.set_header("Content-Disposition",
+                fmt::format("attachment; filename=\"{}\"", take.string()));
+            const size_t size = body.size();
+            res.set_content_provider(size, "audio/midi",
+                [body = std::move(body)](size_t offset, size_t length, httplib::DataSink &sink) {
+                    return write_body(body, offset, std::min(length, kChunkBytes), sink);
+                });
+        });
+}
+
+} // namespace pr::midi
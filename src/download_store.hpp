@@ -0,0 +1,61 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+
+namespace httplib {
+class Server;
+}
+
+namespace pr::midi {
+
+// Downloads of the recordings in one directory.
+//
+//   GET /recordings/<file>    a finished .mid, or a "<take>.mid.part" still being recorded
+//
+// Files are mapped and handed to the connection straight from the page cache. Range requests are
+// answered by httplib from the same provider, ETag / If-None-Match by us. A finished take also
+// gets a "<take>.mid.gz" next to it, compressed once on a thread of its own when the take is
+// finalized (or on the first request that accepts gzip, for older takes), and served to clients
+// that accept it.
+//
+// A take being recorded is served as it stood at its last flush: SmfWriter only ever appends past
+// the committed end of the track and bumps the MTrk length afterwards, so the bytes the length
+// covers never change except for the end-of-track at the end, which is served from memory.
+// Nothing here touches the recorder; it all runs on the server's threads and the compressor's.
+class DownloadStore {
+public:
+    static constexpr const char *kGzipSuffix = ".gz";
+
+    explicit DownloadStore(std::filesystem::path dir);
+    ~DownloadStore(void);
+
+    DownloadStore(const DownloadStore &) = delete;
+    DownloadStore &operator=(const DownloadStore &) = delete;
+
+    // queues "<file>.gz" to be written; returns at once
+    void precompress(const std::filesystem::path &file);
+
+    void attach(httplib::Server &router);
+
+private:
+    void run_(void);
+
+private:
+    std::filesystem::path dir_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::filesystem::path> queue_;
+    // queued or being compressed
+    std::unordered_set<std::string> pending_;
+    bool stopping_{false};
+    std::thread thread_{};
+};
+
+} // namespace pr::midi
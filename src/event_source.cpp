@@ -0,0 +1,39 @@
+#include "event_source.hpp"
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace pr::midi {
+
+TimerFd::TimerFd(std::chrono::nanoseconds period) {
+    fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd_ < 0) {
+        throw std::runtime_error(std::string("timerfd_create: ") + std::strerror(errno));
+    }
+
+    const auto secs = std::chrono::duration_cast<std::chrono::seconds>(period);
+    const timespec ts{.tv_sec = secs.count(), .tv_nsec = (period - secs).count()};
+    const itimerspec spec{.it_interval = ts, .it_value = ts};
+    if (timerfd_settime(fd_, 0, &spec, nullptr) != 0) {
+        close(fd_);
+        throw std::runtime_error(std::string("timerfd_settime: ") + std::strerror(errno));
+    }
+}
+
+TimerFd::~TimerFd(void) {
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+void TimerFd::acknowledge(void) {
+    uint64_t expirations = 0;
+    (void)read(fd_, &expirations, sizeof(expirations));
+}
+
+} // namespace pr::midi
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <alsa/asoundlib.h>
+#include <poll.h>
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+#include "midi_device.hpp"
+
+namespace pr::midi {
+
+enum class AnnounceType { UNKNOWN, CLIENT_START, CLIENT_EXIT, PORT_START, PORT_EXIT, PORT_CHANGE };
+
+enum class SeqEventType : uint8_t { MIDI, ANNOUNCE };
+
+// Channel messages are at most 3 bytes, so they are stored inline
+struct SeqMidi {
+    uint8_t len;
+    uint8_t bytes[3];
+};
+
+struct SeqAnnounce {
+    AnnounceType type;
+    snd_seq_addr_t addr;
+};
+
+// Fixed-size, trivially copyable event as drained from an EventSource
+struct SeqEvent {
+    SeqEventType type;
+    // true if stamp holds the capture time on the source's queue_time() clock; for ALSA that is
+    // the kernel real-time stamp relative to the start of the queue
+    bool stamped;
+    snd_seq_addr_t source;
+    std::chrono::nanoseconds stamp;
+
+    union {
+        SeqMidi midi;
+        SeqAnnounce announce;
+    } data;
+};
+
+static_assert(std::is_trivially_copyable_v<SeqEvent>);
+
+// Where the recorder's events come from. The recorder polls get_poll_desc() and then drains the
+// source until it returns 0, exactly as it used to with the ALSA sequencer alone.
+class EventSource {
+public:
+    virtual ~EventSource(void) = default;
+
+    virtual std::vector<struct pollfd> get_poll_desc(void) = 0;
+    virtual size_t drain(std::span<SeqEvent> out) = 0;
+
+    // current time on the clock SeqEvent::stamp is measured against, if events are stamped
+    virtual std::optional<std::chrono::nanoseconds> queue_time(void) = 0;
+
+    // fills in the names for a source address seen on an event
+    virtual void expand_midi_port(MidiPortHandle &handle) = 0;
+
+    virtual uint64_t input_overruns(void) const {
+        return 0;
+    }
+
+    // true once a finite source (e.g. a replayed file) has handed out its last event
+    virtual bool finished(void) const {
+        return false;
+    }
+
+    // Hot-plug. Sources without real ports have nothing to subscribe to and keep these defaults;
+    // their events are routed to tracks by source address on arrival.
+    virtual std::vector<MidiPortHandle> available_sources(void) {
+        return {};
+    }
+    virtual bool subscribe(const MidiPortHandle &) {
+        return false;
+    }
+    virtual void unsubscribe(const MidiPortHandle &) {}
+    virtual bool is_subscribed(const MidiPortHandle &) const {
+        return false;
+    }
+    virtual std::vector<MidiPortHandle> sources(void) const {
+        return {};
+    }
+    virtual int client_id(void) const {
+        return -1;
+    }
+};
+
+// Periodic CLOCK_MONOTONIC timerfd, so software sources can sit in the recorder's poll set
+class TimerFd {
+public:
+    explicit TimerFd(std::chrono::nanoseconds period);
+    ~TimerFd(void);
+
+    TimerFd(const TimerFd &) = delete;
+    TimerFd &operator=(const TimerFd &) = delete;
+
+    struct pollfd poll_desc(void) const {
+        return {.fd = fd_, .events = POLLIN, .revents = 0};
+    }
+
+    // clears pending expirations so poll() blocks until the next one
+    void acknowledge(void);
+
+private:
+    int fd_{-1};
+};
+
+// Fake client number for software sources, above anything the kernel hands out
+static constexpr int kVirtualClient = 250;
+
+} // namespace pr::midi
@@ -0,0 +1,226 @@
+#include "file_io.hpp"
+#include "record_io.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <spdlog/spdlog.h>
+
+namespace pr::midi {
+
+void throw_sys(const char *what, const std::filesystem::path &path) {
+    int e = errno;
+    throw std::runtime_error(std::string(what) + " " + path.string() + ": " + std::strerror(e));
+}
+
+bool write_all(int fd, const void *data, size_t len) {
+    const auto *p = static_cast<const uint8_t *>(data);
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool pwrite_all(int fd, const void *data, size_t len, off_t offset) {
+    const auto *p = static_cast<const uint8_t *>(data);
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= static_cast<size_t>(n);
+        offset += n;
+    }
+    return true;
+}
+
+int64_t mtime_ns(const struct stat &st) {
+    return int64_t{st.st_mtim.tv_sec} * 1'000'000'000 + st.st_mtim.tv_nsec;
+}
+
+bool stat_file(const std::filesystem::path &path, uint64_t &size, int64_t &mtime) {
+    struct stat st {};
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    size = static_cast<uint64_t>(st.st_size);
+    mtime = mtime_ns(st);
+    return true;
+}
+
+void sync_dir(const std::filesystem::path &dir) {
+    int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        (void)fsync(fd);
+        close(fd);
+    }
+}
+
+bool write_file(const std::filesystem::path &path, const void *data, size_t len) {
+    const std::filesystem::path tmp = path.string() + ".tmp";
+    const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = write_all(fd, data, len) && fdatasync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        (void)unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+FileMapping::~FileMapping(void) {
+    unmap_();
+}
+
+FileMapping::FileMapping(FileMapping &&other) noexcept
+    : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+
+FileMapping &FileMapping::operator=(FileMapping &&other) noexcept {
+    if (this != &other) {
+        unmap_();
+        data_ = std::exchange(other.data_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+    }
+    return *this;
+}
+
+bool FileMapping::map(int fd, size_t size) {
+    unmap_();
+    if (size == 0) {
+        return true;
+    }
+
+    void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    data_ = static_cast<const uint8_t *>(map);
+    size_ = size;
+    return true;
+}
+
+void FileMapping::unmap_(void) noexcept {
+    if (data_) {
+        munmap(const_cast<uint8_t *>(data_), size_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+}
+
+static void append_framed(std::vector<uint8_t> &out, const RecordWriter &record) {
+    const std::vector<uint8_t> &payload = record.bytes();
+    const auto len = static_cast<uint32_t>(payload.size());
+    const auto *p = reinterpret_cast<const uint8_t *>(&len);
+    out.insert(out.end(), p, p + sizeof(len));
+    out.insert(out.end(), payload.begin(), payload.end());
+}
+
+Journal::Journal(const char *log_name, const char (&magic)[8])
+    : log_name_(log_name), magic_(magic, sizeof(magic)) {}
+
+Journal::~Journal(void) {
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+void Journal::open(const std::filesystem::path &path,
+    const std::function<bool(RecordReader &)> &apply) {
+    path_ = path;
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        throw_sys("open", path);
+    }
+
+    std::vector<uint8_t> data;
+    uint8_t buf[1 << 16];
+    ssize_t n = 0;
+    while ((n = read(fd_, buf, sizeof(buf))) > 0) {
+        data.insert(data.end(), buf, buf + n);
+    }
+
+    if (data.size() < magic_.size() ||
+        std::memcmp(data.data(), magic_.data(), magic_.size()) != 0) {
+        if (!data.empty()) {
+            spdlog::warn("{}: {} is not an index, starting over", log_name_, path.string());
+        }
+        (void)ftruncate(fd_, 0);
+        (void)write_all(fd_, magic_.data(), magic_.size());
+        return;
+    }
+
+    // replay; a record cut short by a crash ends the journal
+    size_t pos = magic_.size();
+    while (data.size() - pos >= sizeof(uint32_t)) {
+        uint32_t payload = 0;
+        std::memcpy(&payload, data.data() + pos, sizeof(payload));
+        if (data.size() - pos - sizeof(uint32_t) < payload) {
+            break;
+        }
+
+        RecordReader reader(data.data() + pos + sizeof(uint32_t), payload);
+        if (!apply(reader)) {
+            break;
+        }
+        records_++;
+        pos += sizeof(uint32_t) + payload;
+    }
+
+    if (pos != data.size()) {
+        spdlog::warn("{}: dropping {} bytes of torn journal", log_name_, data.size() - pos);
+        (void)ftruncate(fd_, static_cast<off_t>(pos));
+    }
+}
+
+bool Journal::append(const RecordWriter &record) {
+    std::vector<uint8_t> out;
+    append_framed(out, record);
+    if (fd_ < 0 || !write_all(fd_, out.data(), out.size())) {
+        spdlog::warn("{}: could not append to the journal: {}", log_name_, std::strerror(errno));
+        return false;
+    }
+    records_++;
+    return true;
+}
+
+void Journal::rewrite(const std::vector<RecordWriter> &records) {
+    std::vector<uint8_t> out(magic_.begin(), magic_.end());
+    for (const RecordWriter &record : records) {
+        append_framed(out, record);
+    }
+    if (!write_file(path_, out.data(), out.size())) {
+        spdlog::warn("{}: could not compact {}: {}", log_name_, path_.string(),
+            std::strerror(errno));
+        return;
+    }
+
+    close(fd_);
+    fd_ = ::open(path_.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+    records_ = records.size();
+}
+
+} // namespace pr::midi
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+namespace pr::midi {
+
+// throws std::runtime_error("<what> <path>: <errno>")
+[[noreturn]] void throw_sys(const char *what, const std::filesystem::path &path);
+
+// false on any error but EINTR; a short write is continued
+bool write_all(int fd, const void *data, size_t len);
+bool pwrite_all(int fd, const void *data, size_t len, off_t offset);
+
+int64_t mtime_ns(const struct stat &st);
+// false unless path is a regular file
+bool stat_file(const std::filesystem::path &path, uint64_t &size, int64_t &mtime_ns);
+// makes the renames into dir durable; an empty dir is the working directory
+void sync_dir(const std::filesystem::path &dir);
+// replaces path with data through "<path>.tmp", synced before the rename so a crash leaves the
+// old file or the new one; the directory is not synced
+bool write_file(const std::filesystem::path &path, const void *data, size_t len);
+
+inline uint32_t be32(const uint8_t *p) {
+    return uint32_t{p[0]} << 24 | uint32_t{p[1]} << 16 | uint32_t{p[2]} << 8 | p[3];
+}
+
+inline uint16_t be16(const uint8_t *p) {
+    return static_cast<uint16_t>(p[0] << 8 | p[1]);
+}
+
+inline void put_be32(uint8_t *out, uint32_t value) {
+    out[0] = static_cast<uint8_t>(value >> 24);
+    out[1] = static_cast<uint8_t>(value >> 16);
+    out[2] = static_cast<uint8_t>(value >> 8);
+    out[3] = static_cast<uint8_t>(value);
+}
+
+// A read-only, shared mapping of the start of a file; it stays valid after the descriptor is closed
+class FileMapping {
+public:
+    FileMapping(void) = default;
+    ~FileMapping(void);
+
+    FileMapping(FileMapping &&other) noexcept;
+    FileMapping &operator=(FileMapping &&other) noexcept;
+    FileMapping(const FileMapping &) = delete;
+    FileMapping &operator=(const FileMapping &) = delete;
+
+    // maps the first size bytes of fd in place of what was mapped; false with errno set if mmap
+    // fails. Nothing is mapped for size 0.
+    bool map(int fd, size_t size);
+
+    const uint8_t *data(void) const noexcept {
+        return data_;
+    }
+    size_t size(void) const noexcept {
+        return size_;
+    }
+
+private:
+    void unmap_(void) noexcept;
+
+private:
+    const uint8_t *data_{nullptr};
+    size_t size_{0};
+};
+
+} // namespace pr::midi
@@ -0,0 +1,50 @@
+#include "http_server.hpp"
+#include "live_stream.hpp"
+
+#include <httplib.h>
+#include <spdlog/spdlog.h>
+
+#include <charconv>
+
+namespace pr::midi {
+
+// every open live stream holds on to a worker for as long as the viewer stays
+static constexpr size_t kWorkerThreads = 64;
+static_assert(kWorkerThreads >= LiveStream::kMaxViewers + 16, "no workers left for other routes");
+
+HttpServer::HttpServer(std::string host, int port)
+    : host_(std::move(host)), port_(port), server_(std::make_unique<httplib::Server>()) {
+    server_->new_task_queue = []() { return new httplib::ThreadPool(kWorkerThreads); };
+}
+
+HttpServer::~HttpServer(void) {
+    stop();
+}
+
+bool HttpServer::start(void) {
+    if (!server_->bind_to_port(host_, port_)) {
+        spdlog::error("Could not bind HTTP server to {}:{}", host_, port_);
+        return false;
+    }
+
+    thread_ = std::thread([this]() { server_->listen_after_bind(); });
+    spdlog::info("Serving HTTP on {}:{}", host_, port_);
+    return true;
+}
+
+void HttpServer::stop(void) {
+    if (!thread_.joinable()) {
+        return;
+    }
+
+    server_->stop();
+    thread_.join();
+}
+
+bool parse_u32(const std::string &text, uint32_t &value) {
+    const char *end = text.data() + text.size();
+    const auto [ptr, ec] = std::from_chars(text.data(), end, value);
+    return ec == std::errc() && ptr == end;
+}
+
+} // namespace pr::midi
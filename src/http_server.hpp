@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace httplib {
+class Server;
+}
+
+namespace pr::midi {
+
+// The built-in web server. Routes are registered on router() before start(); requests are served
+// from httplib's own worker threads, never from the recorder's.
+class HttpServer {
+public:
+    HttpServer(std::string host, int port);
+    ~HttpServer(void);
+
+    HttpServer(const HttpServer &) = delete;
+    HttpServer &operator=(const HttpServer &) = delete;
+
+    httplib::Server &router(void) noexcept {
+        return *server_;
+    }
+
+    bool start(void);
+    void stop(void);
+
+private:
+    std::string host_;
+    int port_;
+    std::unique_ptr<httplib::Server> server_;
+    std::thread thread_{};
+};
+
+// a numeric request parameter: decimal, nothing else; false if it doesn't fit
+bool parse_u32(const std::string &text, uint32_t &value);
+
+} // namespace pr::midi
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <iterator>
+#include <string>
+#include <string_view>
+
+#include <spdlog/spdlog.h>
+
+namespace pr::midi {
+
+// escapes s for use inside a JSON string literal
+inline std::string json_escape(std::string_view s) {
+    std::string out;
+    out.reserve(s.size());
+    for (char c : s) {
+        switch (c) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    fmt::format_to(std::back_inserter(out), "\\u{:04x}", static_cast<int>(c));
+                } else {
+                    out += c;
+                }
+                break;
+        }
+    }
+    return out;
+}
+
+} // namespace pr::midi
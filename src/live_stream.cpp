@@ -0,0 +1,173 @@
+#include "live_stream.hpp"
+
+#include "metrics.hpp"
+#include "midi_recorder.hpp"
+
+#include <httplib.h>
+#include <spdlog/spdlog.h>
+
+#include <array>
+#include <iterator>
+#include <memory>
+#include <thread>
+
+namespace pr::midi {
+
+static constexpr size_t kStreamBatch = 256;
+static constexpr auto kStreamPoll = std::chrono::milliseconds(20);
+static constexpr auto kKeepAlive = std::chrono::seconds(15);
+
+// falling notes over an 88 key keyboard, sustain pedal tints the background
+static constexpr std::string_view kLivePage = R"html(<!doctype html>
+<meta name="viewport" content="width=device-width,initial-scale=1">
+<title>piano-recorder live</title>
+<style>
+  html, body { margin: 0; height: 100%; background: #111; }
+  canvas { display: block; width: 100%; height: 100%; }
+</style>
+<canvas id="roll"></canvas>
+<script>
+const canvas = document.getElementById('roll'), g = canvas.getContext('2d');
+const span = 10, held = new Map(), notes = [];
+let offset = 0, pedal = false;
+const resize = () => {
+  canvas.width = innerWidth * devicePixelRatio;
+  canvas.height = innerHeight * devicePixelRatio;
+};
+addEventListener('resize', resize);
+resize();
+
+new EventSource('live/events').onmessage = (e) => {
+  const m = JSON.parse(e.data), status = m.bytes[0] & 0xF0, id = m.track + ':' + m.bytes[1];
+  offset = m.t - performance.now() / 1000;
+  if (status == 0x90 && m.bytes[2] > 0) {
+    const note = {key: m.bytes[1], vel: m.bytes[2], on: m.t, off: null};
+    held.set(id, note);
+    notes.push(note);
+  } else if (status == 0x80 || status == 0x90) {
+    const note = held.get(id);
+    if (note) { note.off = m.t; held.delete(id); }
+  } else if (status == 0xB0 && m.bytes[1] == 64) {
+    pedal = m.bytes[2] >= 64;
+  }
+};
+
+function draw() {
+  const w = canvas.width, h = canvas.height, kw = w / 88, now = performance.now() / 1000 + offset;
+  g.fillStyle = pedal ? '#1c1c2c' : '#111';
+  g.fillRect(0, 0, w, h);
+  while (notes.length && notes[0].off !== null && notes[0].off < now - span) notes.shift();
+  for (const n of notes) {
+    const top = h - (now - n.on) / span * h;
+    const bottom = n.off === null ? h : h - (now - n.off) / span * h;
+    g.fillStyle = `hsl(${200 - n.vel}, 80%, ${30 + n.vel / 4}%)`;
+    g.fillRect((n.key - 21) * kw, top, kw - 1, Math.max(bottom - top, 2));
+  }
+  requestAnimationFrame(draw);
+}
+draw();
+</script>
+)html";
+
+namespace {
+
+struct Viewer {
+    uint64_t cursor;
+    std::chrono::steady_clock::time_point last_write;
+};
+
+} // namespace
+
+void LiveStream::attach(httplib::Server &router) {
+    router.Get("/live", [](const httplib::Request &, httplib::Response &res) {
+        res.set_content(std::string(kLivePage), "text/html; charset=utf-8");
+    });
+
+    router.Get("/live/events", [this](const httplib::Request &req, httplib::Response &res) {
+        const BroadcastRing<LiveEvent> &ring = recorder_.live();
+
+        // a reconnecting EventSource resumes after the last event it saw, if that is still around
+        auto viewer = std::make_shared<Viewer>(
+            Viewer{.cursor = ring.head(), .last_write = std::chrono::steady_clock::now()});
+        if (req.has_header("Last-Event-ID")) {
+            try {
+                viewer->cursor = std::min(std::stoull(req.get_header_value("Last-Event-ID")) + 1,
+                    static_cast<unsigned long long>(ring.head()));
+            } catch (const std::exception &) {
+            }
+        }
+
+        uint64_t open = viewers_.load(std::memory_order_relaxed);
+        do {
+            if (open >= kMaxViewers) {
+                refused_.fetch_add(1, std::memory_order_relaxed);
+                res.status = 503;
+                res.set_header("Retry-After", "10");
+                return;
+            }
+        } while (!viewers_.compare_exchange_weak(open, open + 1, std::memory_order_relaxed));
+
+        res.set_header("Cache-Control", "no-cache");
+        res.set_chunked_content_provider(
+            "text/event-stream",
+            [this, viewer, &ring](size_t, httplib::DataSink &sink) {
+                std::array<LiveEvent, kStreamBatch> batch;
+                uint64_t skipped = 0;
+                const size_t n = ring.read(viewer->cursor, batch, skipped);
+
+                const auto now = std::chrono::steady_clock::now();
+                if (n == 0 && skipped == 0) {
+                    if (now - viewer->last_write < kKeepAlive) {
+                        std::this_thread::sleep_for(kStreamPoll);
+                        return true;
+                    }
+                    // a comment line, so a dead connection is noticed even when nobody plays
+                    viewer->last_write = now;
+                    return sink.write(":\n\n", 3);
+                }
+
+                std::string out;
+                if (skipped > 0) {
+                    skipped_.fetch_add(skipped, std::memory_order_relaxed);
+                    fmt::format_to(
+                        std::back_inserter(out), "event: skipped\ndata: {}\n\n", skipped);
+                }
+
+                // the id is the ring sequence number of the last event, where a reconnect resumes
+                const TimeBase &time_base = recorder_.time_base();
+                for (size_t i = 0; i < n; i++) {
+                    const LiveEvent &ev = batch[i];
+                    if (i + 1 == n) {
+                        fmt::format_to(std::back_inserter(out), "id: {}\n", viewer->cursor - 1);
+                    }
+                    fmt::format_to(std::back_inserter(out),
+                        "data: {{\"t\": {:.6f}, \"track\": {}, \"device\": \"{}\", \"bytes\": [",
+                        time_base.seconds(ev.tick), ev.track, recorder_.track_device(ev.track));
+                    for (uint8_t j = 0; j < ev.midi.len; j++) {
+                        fmt::format_to(
+                            std::back_inserter(out), "{}{}", j ? ", " : "", ev.midi.bytes[j]);
+                    }
+                    out += "]}\n\n";
+                }
+
+                viewer->last_write = now;
+                return sink.write(out.data(), out.size());
+            },
+            [this](bool) { viewers_.fetch_sub(1, std::memory_order_relaxed); });
+    });
+}
+
+std::string LiveStream::render_metrics(void) const {
+    PrometheusWriter page;
+    page.gauge("piano_recorder_live_viewers", "Open /live/events streams",
+        static_cast<double>(viewers_.load(std::memory_order_relaxed)));
+    page.counter("piano_recorder_live_skipped_total",
+        "Events live viewers missed because they fell a whole ring behind",
+        skipped_.load(std::memory_order_relaxed));
+    page.counter("piano_recorder_live_refused_total",
+        "/live/events streams refused because too many were open",
+        refused_.load(std::memory_order_relaxed));
+    return page.str();
+}
+
+} // namespace pr::midi
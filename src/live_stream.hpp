@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace httplib {
+class Server;
+}
+
+namespace pr::midi {
+
+class MidiRecorder;
+
+// Live view of the capture over Server-Sent Events.
+//
+// GET /live/events streams every captured event as it happens; GET /live is a small piano roll
+// page that consumes it. Each viewer reads the recorder's broadcast ring with its own cursor on
+// an HTTP worker thread, so capture does the same O(1) publish whether anybody is watching or
+// not. A viewer that falls a whole ring behind skips ahead and is sent a "skipped" event; one that
+// stops reading is dropped when the socket write times out. Past kMaxViewers open streams a new
+// one gets a 503, so the other routes always have workers left.
+class LiveStream {
+public:
+    static constexpr uint64_t kMaxViewers = 32;
+
+    explicit LiveStream(const MidiRecorder &recorder) : recorder_(recorder) {}
+
+    LiveStream(const LiveStream &) = delete;
+    LiveStream &operator=(const LiveStream &) = delete;
+
+    void attach(httplib::Server &router);
+
+    // Prometheus text, appended to the recorder's page
+    std::string render_metrics(void) const;
+
+private:
+    const MidiRecorder &recorder_;
+    std::atomic<uint64_t> viewers_{0};
+    std::atomic<uint64_t> skipped_{0};
+    std::atomic<uint64_t> refused_{0};
+};
+
+} // namespace pr::midi
@@ -1,8 +1,29 @@
+#include "alsa_sequencer.hpp"
+#include "analytics.hpp"
+#include "archive.hpp"
+#include "catalog.hpp"
+#include "download_store.hpp"
+#include "http_server.hpp"
+#include "live_stream.hpp"
+#include "metrics.hpp"
 #include "midi_device.hpp"
+#include "midi_player.hpp"
 #include "midi_recorder.hpp"
-
+#include "phrase_index.hpp"
+#include "realtime.hpp"
+#include "replay_source.hpp"
+#include "roll_store.hpp"
+#include "synthetic_source.hpp"
+#include "take_summary.hpp"
+#include "time_base.hpp"
+#include "trace.hpp"
+#include "wav_renderer.hpp"
+
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <cxxopts.hpp>
+#include <functional>
 #include <stdlib.h>
 #include <signal.h>
 #include <httplib.h>
@@ -24,6 +45,10 @@
 
 static std::atomic<bool> g_stop_requested = false;
 const std::string kAppName = "piano-recorder";
+constexpr auto kPracticeLogInterval = std::chrono::minutes(5);
+// --play-selftest without a file: ten seconds of notes, 200 events a second
+constexpr auto kSelfTestLength = std::chrono::seconds(10);
+constexpr double kSelfTestNoteRate = 100.0;
 
 extern "C" void signal_handler(int) {
     static bool s_stop_attempted = false;
@@ -36,6 +61,12 @@ extern "C" void signal_handler(int) {
     s_stop_attempted = true;
 }
 
+static std::atomic<bool> g_trace_dump_requested = false;
+
+extern "C" void trace_dump_handler(int) {
+    g_trace_dump_requested.store(true, std::memory_order_relaxed);
+}
+
 spdlog::level::level_enum parse_log_level(const std::string &s) {
     static const std::unordered_map<std::string, spdlog::level::level_enum> map{
         {"trace", spdlog::level::trace},
@@ -55,6 +86,19 @@ spdlog::level::level_enum parse_log_level(const std::string &s) {
     return it->second;
 }
 
+pr::midi::TimestampMode parse_timestamp_mode(const std::string &s) {
+    static const std::unordered_map<std::string, pr::midi::TimestampMode> map{
+        {"dequeue", pr::midi::TimestampMode::DEQUEUE},
+        {"kernel", pr::midi::TimestampMode::KERNEL},
+    };
+
+    auto it = map.find(s);
+    if (it == map.end()) {
+        throw std::runtime_error("invalid timestamp mode: " + s);
+    }
+    return it->second;
+}
+
 std::filesystem::path get_user_dir(void) {
     return std::filesystem::path(sago::getDataHome()) / kAppName;
 }
@@ -89,6 +133,201 @@ void init_logging(const std::string &log_level_str) {
     spdlog::set_default_logger(logger);
 }
 
+// where the takes go: next to --output, or the default recording directory
+std::filesystem::path recording_dir_for(const cxxopts::ParseResult &args) {
+    if (args.count("output")) {
+        const std::filesystem::path dir =
+            std::filesystem::path(args["output"].as<std::string>()).parent_path();
+        return dir.empty() ? std::filesystem::path(".") : dir;
+    }
+    return get_user_recording_dir();
+}
+
+// one block character per density slice
+std::string sparkline(const std::array<uint8_t, pr::midi::TakeSummary::kDensitySlices> &density) {
+    static constexpr const char *kBars[] = {
+        " ", "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
+    std::string out;
+    for (const uint8_t slice : density) {
+        out += kBars[(slice * 8 + 254) / 255];
+    }
+    return out;
+}
+
+int list_library(const cxxopts::ParseResult &args) {
+    std::error_code ec;
+    const std::filesystem::path dir = recording_dir_for(args);
+    std::filesystem::create_directories(dir, ec);
+
+    pr::midi::Catalog catalog(dir);
+    if (args["rebuild-catalog"].as<bool>()) {
+        catalog.rebuild();
+    } else {
+        catalog.sync();
+    }
+
+    for (const pr::midi::CatalogEntry &entry : catalog.list(INT64_MIN, INT64_MAX, SIZE_MAX)) {
+        const time_t started = static_cast<time_t>(entry.started_ns / 1'000'000'000);
+        struct tm local {};
+        localtime_r(&started, &local);
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &local);
+
+        std::cout << fmt::format("{}  {:>8.1f}s  {:>6} notes  {:>3}-{:<3}  {:<3}  {}  {:<20}  {}",
+                         when, static_cast<double>(entry.duration_ns) / 1e9, entry.notes,
+                         entry.min_pitch, entry.max_pitch, pr::midi::dynamics_name(entry.dynamics),
+                         sparkline(entry.density), entry.device, entry.file)
+                  << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
+
+int backfill_library(const cxxopts::ParseResult &args) {
+    const std::filesystem::path dir = recording_dir_for(args);
+    const auto start = std::chrono::steady_clock::now();
+    const size_t written = pr::midi::backfill_summaries(dir);
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    spdlog::info("Wrote {} summaries in {} in {:.2f}s", written, dir.string(), elapsed.count());
+    return EXIT_SUCCESS;
+}
+
+int render_wav(const cxxopts::ParseResult &args) {
+    const std::filesystem::path midi_path = args["render"].as<std::string>();
+    std::filesystem::path wav_path = midi_path;
+    if (args.count("wav")) {
+        wav_path = args["wav"].as<std::string>();
+    } else {
+        wav_path.replace_extension(".wav");
+    }
+
+    pr::midi::RenderOptions options;
+    options.sample_rate = args["sample-rate"].as<int>();
+    options.threads = args["render-threads"].as<unsigned>();
+
+    try {
+        const pr::midi::RenderStats stats =
+            pr::midi::render_midi_to_wav(midi_path, wav_path, options);
+        const double audio_s = static_cast<double>(stats.frames) / options.sample_rate;
+        spdlog::info("Rendered {} notes, {:.1f}s of audio to {} in {:.2f}s ({:.0f}x real time, "
+                     "{} threads)",
+            stats.notes, audio_s, wav_path.string(), stats.elapsed.count(),
+            audio_s / stats.elapsed.count(), stats.threads);
+        if (stats.clipped > 0) {
+            spdlog::warn("{} samples clipped", stats.clipped);
+        }
+    } catch (const std::exception &e) {
+        spdlog::error("Render failed: {}", e.what());
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int play_midi(const cxxopts::ParseResult &args) {
+    pr::midi::PlayOptions options;
+    if (args.count("play-to")) {
+        options.destinations = args["play-to"].as<std::vector<std::string>>();
+    }
+    options.lookahead = std::chrono::milliseconds(args["lookahead"].as<int>());
+    options.loopback = args["play-selftest"].as<bool>();
+
+    try {
+        std::vector<pr::midi::TimedMidi> events;
+        if (args.count("play")) {
+            events = pr::midi::read_timed_midi(
+                args["play"].as<std::string>(), args["speed"].as<double>());
+        } else {
+            events = pr::midi::jitter_test_pattern(kSelfTestLength, kSelfTestNoteRate);
+        }
+        if (options.destinations.empty() && !options.loopback) {
+            spdlog::warn("No --play-to ports, playing only to whatever connects to us");
+        }
+
+        pr::midi::MidiPlayer player(kAppName, options);
+        spdlog::info("Playing {} events", events.size());
+        const pr::midi::PlayStats stats = player.play(events, g_stop_requested);
+
+        spdlog::info("Played {} events in {:.2f}s, {} scheduled late", stats.events,
+            stats.elapsed.count(), stats.late);
+        if (options.loopback) {
+            using us = std::chrono::duration<double, std::micro>;
+            spdlog::info("Jitter over {} events: p50 {:.0f}us, p99 {:.0f}us, p99.9 {:.0f}us, "
+                         "max {:.0f}us",
+                stats.received, us(stats.jitter_p50).count(), us(stats.jitter_p99).count(),
+                us(stats.jitter_p999).count(), us(stats.jitter_max).count());
+            if (stats.received < stats.events) {
+                spdlog::warn("{} events never came back", stats.events - stats.received);
+            }
+        }
+    } catch (const std::exception &e) {
+        spdlog::error("Playback failed: {}", e.what());
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+pr::midi::PhraseQuery phrase_query(const std::string &notes, const std::string &rhythm) {
+    pr::midi::PhraseQuery query;
+    query.pitches = pr::midi::parse_pitches(notes);
+    if (!rhythm.empty()) {
+        query.rhythm = pr::midi::parse_rhythm(rhythm);
+    }
+    return query;
+}
+
+int search_phrase(const cxxopts::ParseResult &args) {
+    std::error_code ec;
+    const std::filesystem::path dir = recording_dir_for(args);
+    std::filesystem::create_directories(dir, ec);
+
+    pr::midi::PhraseIndex phrases(dir);
+    phrases.sync();
+
+    std::vector<pr::midi::PhraseMatch> matches;
+    try {
+        pr::midi::PhraseQuery query = phrase_query(args["search"].as<std::string>(),
+            args.count("rhythm") ? args["rhythm"].as<std::string>() : std::string{});
+        query.mismatches = args["mismatches"].as<size_t>();
+        matches = phrases.search(query);
+    } catch (const std::invalid_argument &e) {
+        spdlog::error("Bad query: {}", e.what());
+        return EXIT_FAILURE;
+    }
+
+    for (const pr::midi::PhraseMatch &match : matches) {
+        const uint32_t secs = match.onset_ms / 1000;
+        std::cout << fmt::format("{:.3f}  {:>3}:{:02}:{:02}.{:03}  {:+3} st  {} wrong  {}",
+                         match.score, secs / 3600, secs / 60 % 60, secs % 60, match.onset_ms % 1000,
+                         match.transpose, match.mismatches, match.file)
+                  << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
+
+int export_midi(const cxxopts::ParseResult &args) {
+    const std::filesystem::path archive_path = args["export-mid"].as<std::string>();
+    std::filesystem::path midi_path = archive_path;
+    if (args.count("export-to")) {
+        midi_path = args["export-to"].as<std::string>();
+    } else {
+        midi_path.replace_extension(".mid");
+        // next to a recording that still has its .mid, that is the original
+        if (std::error_code ec; std::filesystem::exists(midi_path, ec)) {
+            spdlog::error("{} already exists, choose another name with --export-to",
+                midi_path.string());
+            return EXIT_FAILURE;
+        }
+    }
+
+    try {
+        pr::midi::export_archive_to_midi(archive_path, midi_path);
+    } catch (const std::exception &e) {
+        spdlog::error("Export failed: {}", e.what());
+        return EXIT_FAILURE;
+    }
+    spdlog::info("Exported {} to {}", archive_path.string(), midi_path.string());
+    return EXIT_SUCCESS;
+}
+
 void list_devices(void) {
     auto devices = pr::midi::enumerate_midi_sources();
     for (const auto &device : devices) {
@@ -96,6 +335,67 @@ void list_devices(void) {
     }
 }
 
+// Events handed out by the software source so far, for the load-test report
+using GeneratedCounter = std::function<uint64_t(void)>;
+
+std::unique_ptr<pr::midi::EventSource> make_source(
+    const cxxopts::ParseResult &args, GeneratedCounter &generated) {
+    const std::string kind = args["source"].as<std::string>();
+
+    if (kind == "alsa") {
+        const pr::midi::TimestampMode timestamps =
+            parse_timestamp_mode(args["timestamps"].as<std::string>());
+        return std::make_unique<pr::midi::AlsaSequencer>(
+            "piano-recorder", "Recorder In", timestamps == pr::midi::TimestampMode::KERNEL);
+    }
+
+    if (kind == "synthetic") {
+        pr::midi::SyntheticConfig config;
+        config.note_rate = args["note-rate"].as<double>();
+        config.cc_rate = args["cc-rate"].as<double>();
+        auto source = std::make_unique<pr::midi::SyntheticSource>(config);
+        generated = [src = source.get()]() { return src->generated(); };
+        return source;
+    }
+
+    if (kind == "replay") {
+        if (!args.count("replay")) {
+            throw std::runtime_error("--source replay needs --replay <file.mid>");
+        }
+        auto source = std::make_unique<pr::midi::ReplaySource>(
+            args["replay"].as<std::string>(), args["speed"].as<double>());
+        spdlog::info("Replaying {} events", source->size());
+        generated = [src = source.get()]() { return src->generated(); };
+        return source;
+    }
+
+    throw std::runtime_error("invalid source: " + kind);
+}
+
+void report_load_test(const pr::midi::RecorderMetrics &metrics, uint64_t generated,
+    std::chrono::duration<double> elapsed) {
+    const uint64_t captured = metrics.events_captured.value();
+    const uint64_t dropped = metrics.events_dropped.value();
+    const uint64_t written = metrics.events_written.value();
+
+    spdlog::info("Load test: {:.2f}s, {} generated, {} captured, {} written, {} dropped, {} lost",
+        elapsed.count(), generated, captured, written, dropped,
+        generated > written ? generated - written : 0);
+    spdlog::info("Load test: {:.0f} events/s sustained",
+        static_cast<double>(written) / elapsed.count());
+
+    const auto report = [](const char *name, const pr::midi::LatencyHistogram &hist) {
+        using us = std::chrono::duration<double, std::micro>;
+        spdlog::info("Load test: {:<16} p50 <= {:.0f}us, p99 <= {:.0f}us, p99.9 <= {:.0f}us",
+            name, us(hist.quantile(0.5)).count(), us(hist.quantile(0.99)).count(),
+            us(hist.quantile(0.999)).count());
+    };
+    report("stamp->dequeue", metrics.stamp_to_dequeue);
+    report("dequeue->append", metrics.dequeue_to_append);
+    report("save", metrics.save_duration);
+    report("fsync", metrics.fsync_duration);
+}
+
 void print_version(const std::string &prog_name) {
     spdlog::info("{}, using the following libs:", prog_name);
     spdlog::info("    spdlog: {}.{}.{}", SPDLOG_VER_MAJOR, SPDLOG_VER_MINOR, SPDLOG_VER_PATCH);
@@ -103,48 +403,238 @@ void print_version(const std::string &prog_name) {
     spdlog::info("    alsa: {}", SND_LIB_VERSION_STR);
 }
 
+void log_practice(const pr::midi::MidiRecorder &recorder) {
+    pr::midi::AnalyticsSnapshot snapshot;
+    if (!recorder.analytics().snapshot(snapshot) || snapshot.notes == 0) {
+        return;
+    }
+    spdlog::info("Practice: {} notes in {:.0f}s, {:.1f} notes/s (peak {}), pedal down {:.0f}%, "
+                 "polyphony {:.1f} avg {} peak",
+        snapshot.notes, snapshot.session_s, snapshot.notes_per_second,
+        snapshot.peak_notes_per_second, snapshot.sustain_duty * 100.0,
+        snapshot.average_polyphony, snapshot.peak_polyphony);
+}
+
+void dump_trace(const std::filesystem::path &dir) {
+    if (!pr::midi::trace::enabled()) {
+        spdlog::warn("Tracing is off, start with --trace to get a dump");
+        return;
+    }
+    const auto now = std::chrono::system_clock::now().time_since_epoch();
+    pr::midi::trace::write_dump(dir /
+        fmt::format("trace-{}{}", std::chrono::duration_cast<std::chrono::seconds>(now).count(),
+            pr::midi::trace::kDumpExtension));
+}
+
 int run_application(const cxxopts::ParseResult &args) {
-    pr::midi::MidiPortHandle handle;
+    std::vector<pr::midi::MidiPortHandle> handles;
     std::string output_path;
 
+    const std::filesystem::path recording_dir = recording_dir_for(args);
+    std::error_code ec;
+    std::filesystem::create_directories(recording_dir, ec);
+    if (ec) {
+        spdlog::error(
+            "Could not create {} - exiting (rc={})", recording_dir.string(), ec.message());
+        return EXIT_FAILURE;
+    }
+
     if (args.count("output")) {
         output_path = args["output"].as<std::string>();
     } else {
-        std::error_code ec;
-        std::filesystem::path recording_dir = get_user_recording_dir();
-        std::filesystem::create_directories(recording_dir, ec);
-        if (ec) {
-            spdlog::error("Could not create {} - exiting (rc={})", recording_dir.string(), ec.message());
-            return EXIT_FAILURE;
-        }
-
         output_path = (recording_dir / "default.mid").string();
     }
     spdlog::info("Use output path: {}", output_path);
 
-    if (args.count("port")) {
-        std::string chosen_port = args["port"].as<std::string>();
+    pr::midi::Catalog catalog(recording_dir);
+    if (args["rebuild-catalog"].as<bool>()) {
+        catalog.rebuild();
+    } else {
+        catalog.sync();
+    }
+    catalog.watch();
+
+    pr::midi::PhraseIndex phrases(recording_dir);
+    phrases.sync();
+
+    // before the recorder, which uses both until it is destroyed
+    pr::midi::RollStore rolls{recording_dir};
+    pr::midi::DownloadStore downloads{recording_dir};
 
+    if (args.count("port")) {
         auto devices = pr::midi::enumerate_midi_sources();
-        for (const auto &device : devices) {
-            std::string possible_port = fmt::format("{}:{}", device.client_id, device.port_id);
-            if (chosen_port == possible_port) {
-                spdlog::info("Selected {}", device.to_expanded_str());
-                handle = device;
-                break;
+        for (const std::string &chosen_port : args["port"].as<std::vector<std::string>>()) {
+            for (const auto &device : devices) {
+                std::string possible_port = fmt::format("{}:{}", device.client_id, device.port_id);
+                if (chosen_port == possible_port) {
+                    spdlog::info("Selected {}", device.to_expanded_str());
+                    handles.push_back(device);
+                    break;
+                }
+            }
+        }
+    }
+
+    GeneratedCounter generated = []() { return uint64_t{0}; };
+    std::unique_ptr<pr::midi::EventSource> source = make_source(args, generated);
+    const pr::midi::EventSource &source_ref = *source;
+
+    const auto split_after = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::duration<double>(args["split-silence"].as<double>()));
+    pr::midi::MidiRecorder recorder{std::move(source), handles, output_path, split_after};
+    recorder.set_time_base(pr::midi::parse_time_base(args["time-base"].as<std::string>()));
+    recorder.follow_tempo(!args["fixed-tempo"].as<bool>());
+    recorder.write_archives(args["archive"].as<bool>());
+    // after the recorder, so its rings are locked even without MCL_FUTURE
+    if (args["realtime"].as<bool>()) {
+        pr::midi::lock_memory();
+        recorder.set_realtime(pr::midi::RealtimeConfig{
+            .priority = args["rt-priority"].as<int>(), .cpu = args["rt-cpu"].as<int>()});
+    }
+    pr::midi::trace::set_enabled(args["trace"].as<bool>());
+    recorder.serve_rolls(rolls);
+    recorder.on_take_finalized(
+        [&](const std::filesystem::path &path, const pr::midi::TakeInfo &info) {
+            catalog.add(path, info.started, info.device);
+            phrases.add(path);
+            downloads.precompress(path);
+            rolls.retire(path.filename().string() + std::string(pr::midi::kPartialSuffix));
+        });
+
+    pr::midi::LiveStream live{recorder};
+    std::unique_ptr<pr::midi::HttpServer> http;
+    if (const int http_port = args["http-port"].as<int>(); http_port > 0) {
+        const std::string http_bind = args["http-bind"].as<std::string>();
+        http = std::make_unique<pr::midi::HttpServer>(http_bind, http_port);
+
+        const std::string metrics_type{pr::midi::PrometheusWriter::kContentType};
+        http->router().Get("/metrics", [&](const httplib::Request &, httplib::Response &res) {
+            res.set_content(recorder.render_metrics() + live.render_metrics(), metrics_type);
+        });
+        live.attach(http->router());
+        rolls.attach(http->router());
+        downloads.attach(http->router());
+        // ?from=&to= in unix seconds, newest first, at most ?limit= entries
+        http->router().Get("/recordings", [&](const httplib::Request &req, httplib::Response &res) {
+            // a finite number and nothing else, or the fallback if there is none
+            const auto param = [&](const char *name, double fallback, double &value) {
+                value = fallback;
+                if (!req.has_param(name)) {
+                    return true;
+                }
+                const std::string text = req.get_param_value(name);
+                size_t used = 0;
+                try {
+                    value = std::stod(text, &used);
+                } catch (const std::exception &) {
+                    return false;
+                }
+                return used == text.size() && std::isfinite(value);
+            };
+
+            double from_s = 0;
+            double to_s = 0;
+            double limit = 0;
+            if (!param("from", -9e9, from_s) || !param("to", 9e9, to_s) ||
+                !param("limit", 1000, limit) || limit < 0) {
+                res.status = 400;
+                return;
+            }
+            // clamped so the casts stay in range; nothing is recorded that far out anyway
+            const auto from = static_cast<int64_t>(std::clamp(from_s, -9e9, 9e9) * 1e9);
+            const auto to = static_cast<int64_t>(std::clamp(to_s, -9e9, 9e9) * 1e9);
+            const auto most = static_cast<size_t>(std::min(limit, 1e9));
+            res.set_content(pr::midi::render_catalog_json(catalog.list(from, to, most)),
+                "application/json");
+        });
+        http->router().Get("/analytics", [&](const httplib::Request &, httplib::Response &res) {
+            pr::midi::AnalyticsSnapshot snapshot;
+            if (!recorder.analytics().snapshot(snapshot)) {
+                res.status = 503;
+                return;
             }
+            res.set_content(pr::midi::render_analytics_json(snapshot), "application/json");
+        });
+        // ?notes=60,62,64,65 or C4,D4,E4,F4, optional &rhythm=1,1,2 &mismatches= &limit=
+        http->router().Get("/search", [&](const httplib::Request &req, httplib::Response &res) {
+            try {
+                pr::midi::PhraseQuery query = phrase_query(
+                    req.get_param_value("notes"), req.get_param_value("rhythm"));
+                const auto count = [&req](const char *name, size_t &field) {
+                    uint32_t value = 0;
+                    if (!req.has_param(name)) {
+                        return;
+                    }
+                    if (!pr::midi::parse_u32(req.get_param_value(name), value)) {
+                        throw std::invalid_argument(
+                            fmt::format("{} must be a non-negative integer", name));
+                    }
+                    field = value;
+                };
+                count("mismatches", query.mismatches);
+                count("limit", query.limit);
+                const std::vector<pr::midi::PhraseMatch> matches = phrases.search(query);
+                res.set_content(pr::midi::render_phrase_matches_json(matches), "application/json");
+            } catch (const std::exception &e) {
+                res.status = 400;
+                res.set_content(std::string(e.what()) + "\n", "text/plain");
+            }
+        });
+        if (pr::midi::trace::enabled()) {
+            http->router().Get(
+                "/debug/trace", [](const httplib::Request &, httplib::Response &res) {
+                    res.set_content(pr::midi::trace::snapshot(), "application/octet-stream");
+                });
+        }
+        // a server that was asked for but can't listen is a setup error, like a bad option; the
+        // default one is a convenience, and a busy port shouldn't cost the take
+        if (!http->start()) {
+            if (args.count("http-port") || args.count("http-bind")) {
+                return EXIT_FAILURE;
+            }
+            spdlog::warn("Recording without the HTTP server; --http-port picks another port");
+            http.reset();
         }
     }
 
-    pr::midi::MidiRecorder recorder{handle, output_path};
+    // --load-test runs for a fixed time, or until a replayed file is through, then reports
+    const double load_test_s = args["load-test"].as<double>();
+    const auto start = std::chrono::steady_clock::now();
+    const auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                      std::chrono::duration<double>(load_test_s));
+
     recorder.start();
 
+    auto last_practice_log = start;
     while (!g_stop_requested.load(std::memory_order_relaxed)) {
+        if (load_test_s > 0 &&
+            (std::chrono::steady_clock::now() >= deadline || source_ref.finished())) {
+            break;
+        }
+        if (std::chrono::steady_clock::now() - last_practice_log >= kPracticeLogInterval) {
+            log_practice(recorder);
+            last_practice_log = std::chrono::steady_clock::now();
+        }
+        if (g_trace_dump_requested.exchange(false, std::memory_order_relaxed)) {
+            dump_trace(recording_dir);
+        }
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
 
+    if (http) {
+        http->stop();
+    }
     recorder.stop();
     spdlog::info("Recording finished.");
+    log_practice(recorder);
+    if (pr::midi::trace::enabled()) {
+        dump_trace(recording_dir);
+    }
+
+    if (load_test_s > 0) {
+        report_load_test(recorder.metrics(), generated(), elapsed);
+    }
 
     return EXIT_SUCCESS;
 }
@@ -154,10 +644,43 @@ int main(int argc, char **argv) {
     cxxopts::Options options("piano-recorder", "MIDI recorder prototype");
     options.add_options()
         ("l,list", "List ALSA sequencer clients/ports")
+        ("library", "List the recordings in the catalog, newest first")
+        ("search", "Find a phrase in every recording, as pitches or note names (e.g. \"C4 D4 E4 G4\"), in any key", cxxopts::value<std::string>())
+        ("rhythm", "Time from each note of --search to the next, in any unit, to rank by rhythm too", cxxopts::value<std::string>())
+        ("mismatches", "Intervals --search allows to differ; one wrong note changes two", cxxopts::value<size_t>()->default_value("2"))
+        ("rebuild-catalog", "Rescan every recording instead of only new or changed ones")
+        ("backfill-summaries", "Write the .sum summary of every recording that has none, on every core, and exit")
         ("L,log-level", "trace|debug|info|warn|error|critical|off", cxxopts::value<std::string>()->default_value("info"))
         ("V,version", "Print library versions")
-        ("p,port", "Select source port as client:port (e.g., 24:0)", cxxopts::value<std::string>())
-        ("o,output", "Select path to output .mid file", cxxopts::value<std::string>())
+        ("p,port", "Select source ports as client:port (e.g., 24:0,28:0); all hardware ports if omitted", cxxopts::value<std::vector<std::string>>())
+        ("o,output", "Select base path for output .mid files, one per device and take", cxxopts::value<std::string>())
+        ("split-silence", "Start a new take after this many seconds with nothing held down (0 never splits)", cxxopts::value<double>()->default_value("30"))
+        ("http-bind", "Address for the built-in HTTP server", cxxopts::value<std::string>()->default_value("127.0.0.1"))
+        ("http-port", "Port for the built-in HTTP server serving /metrics, /recordings and /live (0 disables it)", cxxopts::value<int>()->default_value("8420"))
+        ("realtime", "Lock memory and run the capture thread at SCHED_FIFO; reports worst-case wakeup latency")
+        ("rt-priority", "SCHED_FIFO priority of the capture thread with --realtime", cxxopts::value<int>()->default_value("80"))
+        ("rt-cpu", "Pin the capture thread to this CPU with --realtime (-1 leaves it unpinned)", cxxopts::value<int>()->default_value("-1"))
+        ("time-base", "midi|us|<ppq>@<bpm> - length of a capture tick: midi is 960 ppq at 120 bpm, us is a tick per microsecond", cxxopts::value<std::string>()->default_value("midi"))
+        ("fixed-tempo", "Write .mid files at the time base's tempo, every tick kept, instead of following the tempo played")
+        ("t,timestamps", "kernel|dequeue - stamp events on an ALSA queue or when read", cxxopts::value<std::string>()->default_value("kernel"))
+        ("s,source", "alsa|synthetic|replay - where events come from", cxxopts::value<std::string>()->default_value("alsa"))
+        ("replay", "File to replay with --source replay", cxxopts::value<std::string>())
+        ("speed", "Replay and --play speed factor", cxxopts::value<double>()->default_value("1.0"))
+        ("note-rate", "Synthetic note events per second", cxxopts::value<double>()->default_value("20"))
+        ("cc-rate", "Synthetic controller events per second", cxxopts::value<double>()->default_value("200"))
+        ("load-test", "Record for this many seconds (or until a replay ends), then report throughput and latency", cxxopts::value<double>()->default_value("0"))
+        ("archive", "Also write every take as a compact .prarc archive next to the .mid")
+        ("export-mid", "Convert a .prarc archive to a .mid and exit", cxxopts::value<std::string>())
+        ("export-to", "Output file for --export-mid (default: the input with a .mid extension)", cxxopts::value<std::string>())
+        ("render", "Render a .mid to a WAV file with the built-in piano and exit", cxxopts::value<std::string>())
+        ("wav", "Output file for --render (default: the input with a .wav extension)", cxxopts::value<std::string>())
+        ("sample-rate", "Sample rate for --render", cxxopts::value<int>()->default_value("48000"))
+        ("render-threads", "Threads for --render (0 uses every core)", cxxopts::value<unsigned>()->default_value("0"))
+        ("play", "Play a .mid out of a sequencer port, scheduled ahead on an ALSA queue, and exit", cxxopts::value<std::string>())
+        ("play-to", "Ports for --play as client:port or name:port (e.g., 128:0); others can connect with aconnect", cxxopts::value<std::vector<std::string>>())
+        ("play-selftest", "Play into a loopback port and report how late events arrive; plays --play's file, or a test pattern")
+        ("lookahead", "How many ms ahead of time --play hands events to the kernel", cxxopts::value<int>()->default_value("200"))
+        ("trace", "Record a binary trace of every event; dumped to the recording directory on SIGUSR1 and at exit, and served at /debug/trace")
         ("h,help", "Print help");
     // clang-format on
 
@@ -169,11 +692,24 @@ int main(int argc, char **argv) {
 
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    signal(SIGUSR1, trace_dump_handler);
 
     init_logging(result["log-level"].as<std::string>());
 
     if (result["list"].as<bool>()) {
         list_devices();
+    } else if (result["library"].as<bool>()) {
+        return list_library(result);
+    } else if (result.count("search")) {
+        return search_phrase(result);
+    } else if (result["backfill-summaries"].as<bool>()) {
+        return backfill_library(result);
+    } else if (result.count("play") || result["play-selftest"].as<bool>()) {
+        return play_midi(result);
+    } else if (result.count("export-mid")) {
+        return export_midi(result);
+    } else if (result.count("render")) {
+        return render_wav(result);
     } else if (result["version"].as<bool>()) {
         print_version(argv[0]);
     } else {
@@ -0,0 +1,46 @@
+#include "metrics.hpp"
+
+#include <iterator>
+
+#include <spdlog/spdlog.h>
+
+namespace pr::midi {
+
+void PrometheusWriter::header_(
+    std::string_view name, std::string_view help, std::string_view type) {
+    fmt::format_to(
+        std::back_inserter(out_), "# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+}
+
+void PrometheusWriter::counter(std::string_view name, std::string_view help, uint64_t value) {
+    header_(name, help, "counter");
+    fmt::format_to(std::back_inserter(out_), "{} {}\n", name, value);
+}
+
+void PrometheusWriter::gauge(std::string_view name, std::string_view help, double value) {
+    header_(name, help, "gauge");
+    fmt::format_to(std::back_inserter(out_), "{} {}\n", name, value);
+}
+
+void PrometheusWriter::histogram(
+    std::string_view name, std::string_view help, const LatencyHistogram &hist) {
+    header_(name, help, "histogram");
+
+    // buckets are read one by one while the recorder keeps adding, so derive the count from them
+    // to keep +Inf and _count consistent
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i + 1 < LatencyHistogram::kBuckets; i++) {
+        cumulative += hist.bucket_count(i);
+        const double le = static_cast<double>(LatencyHistogram::upper_bound_ns(i)) / 1e9;
+        fmt::format_to(std::back_inserter(out_), "{}_bucket{{le=\"{:.9g}\"}} {}\n", name, le,
+            cumulative);
+    }
+    cumulative += hist.bucket_count(LatencyHistogram::kBuckets - 1);
+
+    fmt::format_to(std::back_inserter(out_), "{}_bucket{{le=\"+Inf\"}} {}\n", name, cumulative);
+    fmt::format_to(std::back_inserter(out_), "{}_sum {:.9f}\n", name,
+        static_cast<double>(hist.sum_ns()) / 1e9);
+    fmt::format_to(std::back_inserter(out_), "{}_count {}\n", name, cumulative);
+}
+
+} // namespace pr::midi
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace pr::midi {
+
+// Fixed power-of-two latency buckets from ~1us to ~17s. record() is a couple of relaxed atomic
+// adds, so it is safe to call from the capture thread: no locks, no allocation.
+class LatencyHistogram {
+public:
+    static constexpr size_t kBuckets = 25;
+    static constexpr unsigned kFirstBucketLog2 = 10; // 1024ns
+
+    void record(std::chrono::nanoseconds latency) noexcept {
+        const uint64_t ns = latency.count() > 0 ? static_cast<uint64_t>(latency.count()) : 0;
+        buckets_[bucket_for(ns)].fetch_add(1, std::memory_order_relaxed);
+        sum_ns_.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    // inclusive upper bound of a bucket; the last one also catches everything above it
+    static constexpr uint64_t upper_bound_ns(size_t bucket) noexcept {
+        return uint64_t{1} << (kFirstBucketLog2 + bucket);
+    }
+
+    uint64_t bucket_count(size_t bucket) const noexcept {
+        return buckets_[bucket].load(std::memory_order_relaxed);
+    }
+
+    uint64_t sum_ns(void) const noexcept {
+        return sum_ns_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t count(void) const noexcept {
+        uint64_t total = 0;
+        for (const std::atomic<uint64_t> &bucket : buckets_) {
+            total += bucket.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    // upper bound of the bucket holding quantile q (0..1), or 0 if nothing was recorded
+    std::chrono::nanoseconds quantile(double q) const noexcept {
+        const uint64_t total = count();
+        if (total == 0) {
+            return std::chrono::nanoseconds{0};
+        }
+
+        const auto rank = static_cast<uint64_t>(q * static_cast<double>(total - 1)) + 1;
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < kBuckets; i++) {
+            cumulative += bucket_count(i);
+            if (cumulative >= rank) {
+                return std::chrono::nanoseconds(upper_bound_ns(i));
+            }
+        }
+        return std::chrono::nanoseconds(upper_bound_ns(kBuckets - 1));
+    }
+
+private:
+    static constexpr size_t bucket_for(uint64_t ns) noexcept {
+        if (ns <= upper_bound_ns(0)) {
+            return 0;
+        }
+        const size_t log2_ceil = static_cast<size_t>(std::bit_width(ns - 1));
+        return std::min(log2_ceil - kFirstBucketLog2, kBuckets - 1);
+    }
+
+    std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+    std::atomic<uint64_t> sum_ns_{0};
+};
+
+class Counter {
+public:
+    void add(uint64_t n = 1) noexcept {
+        value_.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value(void) const noexcept {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+// Builds a Prometheus text exposition (format 0.0.4) page
+class PrometheusWriter {
+public:
+    static constexpr std::string_view kContentType = "text/plain; version=0.0.4; charset=utf-8";
+
+    void counter(std::string_view name, std::string_view help, uint64_t value);
+    void gauge(std::string_view name, std::string_view help, double value);
+    void histogram(std::string_view name, std::string_view help, const LatencyHistogram &hist);
+
+    const std::string &str(void) const noexcept {
+        return out_;
+    }
+
+private:
+    void header_(std::string_view name, std::string_view help, std::string_view type);
+
+    std::string out_;
+};
+
+} // namespace pr::midi
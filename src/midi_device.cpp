@@ -9,14 +9,9 @@
 
 namespace pr::midi {
 
-std::vector<MidiPortHandle> enumerate_midi_sources(void) {
+std::vector<MidiPortHandle> query_ports(snd_seq_t *seq) {
     std::vector<MidiPortHandle> out;
 
-    snd_seq_t *seq = nullptr;
-    if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, 0) < 0) {
-        return out;
-    }
-
     snd_seq_client_info_t *cinfo;
     snd_seq_port_info_t *pinfo;
     snd_seq_client_info_alloca(&cinfo);
@@ -33,14 +28,24 @@ std::vector<MidiPortHandle> enumerate_midi_sources(void) {
             int port_id = snd_seq_port_info_get_port(pinfo);
 
             MidiPortHandle handle = MidiPortHandle{client, port_id};
-            handle.expand_from_seq(seq);
-            if (handle.is_subscribable_source()) {
-                out.push_back(std::move(handle));
-            }
+            handle.expand_from_info(cinfo, pinfo);
+            out.push_back(std::move(handle));
         }
     }
 
+    return out;
+}
+
+std::vector<MidiPortHandle> enumerate_midi_sources(void) {
+    snd_seq_t *seq = nullptr;
+    if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, 0) < 0) {
+        return {};
+    }
+
+    std::vector<MidiPortHandle> out = query_ports(seq);
     snd_seq_close(seq);
+
+    std::erase_if(out, [](MidiPortHandle &h) { return !h.is_subscribable_source(); });
     return out;
 }
 
@@ -23,8 +23,7 @@ public:
 
         int rc = 0;
         if ((rc = snd_seq_get_any_client_info(seq, client_id, cinfo)) == 0) {
-            client_name = snd_seq_client_info_get_name(cinfo);
-            is_kernel = snd_seq_client_info_get_type(cinfo) == SND_SEQ_CLIENT_SYSTEM;
+            set_client_info_(cinfo);
         } else {
             spdlog::error("snd_seq_get_client_info - {}", rc);
         }
@@ -32,9 +31,7 @@ public:
         snd_seq_port_info_t *pinfo = nullptr;
         snd_seq_port_info_alloca(&pinfo);
         if ((rc = snd_seq_get_any_port_info(seq, client_id, port_id, pinfo)) == 0) {
-            port_name = snd_seq_port_info_get_name(pinfo);
-            capabilities = snd_seq_port_info_get_capability(pinfo);
-            type = snd_seq_port_info_get_type(pinfo);
+            set_port_info_(pinfo);
         } else {
             spdlog::error("snd_seq_get_port_info - {}, {}", rc, snd_strerror(rc));
         }
@@ -42,10 +39,21 @@ public:
         compute_score_();
     }
 
+    // from query results already in hand, without asking the sequencer again
+    void expand_from_info(snd_seq_client_info_t *cinfo, snd_seq_port_info_t *pinfo) {
+        set_client_info_(cinfo);
+        set_port_info_(pinfo);
+        compute_score_();
+    }
+
     constexpr bool is_subscribable_source(void) {
         return (capabilities & SND_SEQ_PORT_CAP_SUBS_WRITE) != 0;
     }
 
+    constexpr bool is_hardware(void) const {
+        return (type & SND_SEQ_PORT_TYPE_HARDWARE) != 0;
+    }
+
     constexpr bool is_valid(void) const {
         return client_id >= 0 && port_id >= 0;
     }
@@ -73,8 +81,21 @@ public:
     const std::string to_expanded_str(void) const;
 
 private:
+    void set_client_info_(snd_seq_client_info_t *cinfo) {
+        client_name = snd_seq_client_info_get_name(cinfo);
+        card = snd_seq_client_info_get_card(cinfo);
+        is_kernel = snd_seq_client_info_get_type(cinfo) == SND_SEQ_CLIENT_SYSTEM;
+    }
+
+    void set_port_info_(snd_seq_port_info_t *pinfo) {
+        port_name = snd_seq_port_info_get_name(pinfo);
+        capabilities = snd_seq_port_info_get_capability(pinfo);
+        type = snd_seq_port_info_get_type(pinfo);
+    }
+
     void compute_score_(void) {
         int32_t score = 0;
+        score_reason.clear();
 
         if (is_kernel) {
             score += 1000;
@@ -95,6 +116,8 @@ public:
 
     std::string client_name = "UNKNOWN";
     std::string port_name = "UNKNOWN";
+    // sound card of a kernel client, -1 for everything else
+    int card = -1;
 
     uint32_t capabilities = 0;
     uint32_t type = 0;
@@ -106,6 +129,9 @@ private:
     std::string score_reason;
 };
 
+// every port of every client, walked with an existing sequencer handle
+std::vector<MidiPortHandle> query_ports(snd_seq_t *seq);
+// opens a sequencer client of its own for the walk, so keep it out of anything that repeats
 std::vector<MidiPortHandle> enumerate_midi_sources(void);
 std::ostream &operator<<(std::ostream &os, const MidiPortHandle &h);
 bool operator==(const snd_seq_addr_t &lhs, const snd_seq_addr_t &rhs);
@@ -0,0 +1,298 @@
+#include "midi_player.hpp"
+#include "alsa_sequencer.hpp"
+
+#include <poll.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <stdexcept>
+#include <thread>
+
+#include <spdlog/spdlog.h>
+
+namespace pr::midi {
+
+// loopback events still missing this long after the last one was due are counted as lost
+static constexpr std::chrono::milliseconds kLoopbackGrace{500};
+
+static void check_alsa(const char *what, int rc) {
+    if (rc < 0) {
+        throw std::runtime_error(std::string(what) + ": " + snd_strerror(rc));
+    }
+}
+
+static snd_seq_real_time_t to_real_time(std::chrono::nanoseconds t) {
+    return snd_seq_real_time_t{.tv_sec = static_cast<unsigned>(t.count() / 1'000'000'000),
+        .tv_nsec = static_cast<unsigned>(t.count() % 1'000'000'000)};
+}
+
+static std::chrono::nanoseconds to_nanoseconds(const snd_seq_real_time_t &t) {
+    return std::chrono::seconds(t.tv_sec) + std::chrono::nanoseconds(t.tv_nsec);
+}
+
+static std::chrono::nanoseconds quantile(
+    const std::vector<std::chrono::nanoseconds> &sorted, double q) {
+    if (sorted.empty()) {
+        return std::chrono::nanoseconds{0};
+    }
+    return sorted[static_cast<size_t>(q * static_cast<double>(sorted.size() - 1))];
+}
+
+MidiPlayer::MidiPlayer(const std::string &client_name, const PlayOptions &options)
+    : lookahead_(options.lookahead) {
+    check_alsa("snd_seq_open", snd_seq_open(&seq_, "default", SND_SEQ_OPEN_DUPLEX, 0));
+    snd_seq_nonblock(seq_, 1);
+    snd_seq_set_client_name(seq_, client_name.c_str());
+
+    out_port_ = snd_seq_create_simple_port(seq_, "Player Out",
+        SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+        SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    check_alsa("snd_seq_create_simple_port", out_port_);
+
+    queue_ = snd_seq_alloc_named_queue(seq_, client_name.c_str());
+    check_alsa("snd_seq_alloc_named_queue", queue_);
+    use_hrtimer_();
+
+    // room for a whole window in the kernel and in the buffer in front of it
+    check_alsa("snd_seq_set_client_pool_output", snd_seq_set_client_pool_output(seq_, kPoolEvents));
+    check_alsa("snd_seq_set_output_buffer_size",
+        snd_seq_set_output_buffer_size(seq_, kPoolEvents * sizeof(snd_seq_event_t)));
+
+    for (const std::string &destination : options.destinations) {
+        snd_seq_addr_t addr{};
+        if (snd_seq_parse_address(seq_, &addr, destination.c_str()) < 0) {
+            throw std::runtime_error("no such port: " + destination);
+        }
+        check_alsa(("connect to " + destination).c_str(),
+            snd_seq_connect_to(seq_, out_port_, addr.client, addr.port));
+        spdlog::info("Playing to {}:{}", addr.client, addr.port);
+    }
+
+    if (options.loopback) {
+        connect_loopback_();
+    }
+}
+
+MidiPlayer::~MidiPlayer(void) {
+    if (!seq_) {
+        return;
+    }
+
+    if (queue_ >= 0) {
+        (void)snd_seq_free_queue(seq_, queue_);
+    }
+    snd_seq_close(seq_);
+    seq_ = nullptr;
+}
+
+void MidiPlayer::use_hrtimer_(void) {
+    snd_timer_id_t *id = nullptr;
+    snd_timer_id_alloca(&id);
+    snd_timer_id_set_class(id, SND_TIMER_CLASS_GLOBAL);
+    snd_timer_id_set_sclass(id, SND_TIMER_SCLASS_NONE);
+    snd_timer_id_set_card(id, -1);
+    snd_timer_id_set_device(id, SND_TIMER_GLOBAL_HRTIMER);
+    snd_timer_id_set_subdevice(id, 0);
+
+    snd_seq_queue_timer_t *timer = nullptr;
+    snd_seq_queue_timer_alloca(&timer);
+    int rc = snd_seq_get_queue_timer(seq_, queue_, timer);
+    if (rc >= 0) {
+        snd_seq_queue_timer_set_type(timer, SND_SEQ_TIMER_ALSA);
+        snd_seq_queue_timer_set_id(timer, id);
+        snd_seq_queue_timer_set_resolution(timer, kQueueTimerHz);
+        rc = snd_seq_set_queue_timer(seq_, queue_, timer);
+    }
+
+    if (rc < 0) {
+        spdlog::warn("Could not put the queue on the high-resolution timer ({}), so events go out "
+                     "on the system tick; loading snd-hrtimer fixes that",
+            snd_strerror(rc));
+    } else {
+        spdlog::info("Playing on the high-resolution timer at {} Hz", kQueueTimerHz);
+    }
+}
+
+void MidiPlayer::connect_loopback_(void) {
+    loopback_port_ = snd_seq_create_simple_port(seq_, "Player Loopback",
+        SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT,
+        SND_SEQ_PORT_TYPE_APPLICATION);
+    check_alsa("snd_seq_create_simple_port", loopback_port_);
+    check_alsa("snd_seq_set_client_pool_input", snd_seq_set_client_pool_input(seq_, kPoolEvents));
+
+    const int client = snd_seq_client_id(seq_);
+    const snd_seq_addr_t sender{.client = static_cast<unsigned char>(client),
+        .port = static_cast<unsigned char>(out_port_)};
+    const snd_seq_addr_t dest{.client = static_cast<unsigned char>(client),
+        .port = static_cast<unsigned char>(loopback_port_)};
+
+    // stamped with the queue's time as they are delivered, which is what the jitter is measured on
+    snd_seq_port_subscribe_t *sub = nullptr;
+    snd_seq_port_subscribe_alloca(&sub);
+    snd_seq_port_subscribe_set_sender(sub, &sender);
+    snd_seq_port_subscribe_set_dest(sub, &dest);
+    snd_seq_port_subscribe_set_queue(sub, queue_);
+    snd_seq_port_subscribe_set_time_update(sub, 1);
+    snd_seq_port_subscribe_set_time_real(sub, 1);
+    check_alsa("snd_seq_subscribe_port", snd_seq_subscribe_port(seq_, sub));
+}
+
+std::chrono::nanoseconds MidiPlayer::queue_time_(void) {
+    snd_seq_queue_status_t *status = nullptr;
+    snd_seq_queue_status_alloca(&status);
+    check_alsa("snd_seq_get_queue_status", snd_seq_get_queue_status(seq_, queue_, status));
+    return to_nanoseconds(*snd_seq_queue_status_get_real_time(status));
+}
+
+bool MidiPlayer::schedule_(const SeqMidi &midi, std::chrono::nanoseconds at) {
+    // read_timed_midi() only hands out channel messages, which all convert
+    snd_seq_event_t ev;
+    snd_seq_ev_clear(&ev);
+    (void)AlsaSequencer::from_midi_bytes(midi, ev);
+
+    snd_seq_ev_set_source(&ev, out_port_);
+    snd_seq_ev_set_subs(&ev);
+    const snd_seq_real_time_t time = to_real_time(at);
+    snd_seq_ev_schedule_real(&ev, queue_, 0, &time);
+
+    const int rc = snd_seq_event_output(seq_, &ev);
+    if (rc == -EAGAIN) {
+        return false;
+    }
+    check_alsa("snd_seq_event_output", rc);
+    return true;
+}
+
+void MidiPlayer::read_loopback_(const std::vector<std::chrono::nanoseconds> &scheduled,
+    std::vector<std::chrono::nanoseconds> &jitter) {
+    snd_seq_event_t *ev = nullptr;
+    while (snd_seq_event_input(seq_, &ev) >= 0 && ev != nullptr) {
+        if (ev->dest.port != loopback_port_ || jitter.size() >= scheduled.size()) {
+            continue;
+        }
+        // one source, one destination and one queue, so they arrive in the order they were sent
+        const std::chrono::nanoseconds late =
+            to_nanoseconds(ev->time.time) - scheduled[jitter.size()];
+        jitter.push_back(std::max(late, std::chrono::nanoseconds{0}));
+    }
+}
+
+PlayStats MidiPlayer::play(const std::vector<TimedMidi> &events, const std::atomic<bool> &stop) {
+    PlayStats stats;
+    std::vector<std::chrono::nanoseconds> scheduled;
+    std::vector<std::chrono::nanoseconds> jitter;
+    if (loopback_port_ >= 0) {
+        scheduled.reserve(events.size());
+        jitter.reserve(events.size());
+    }
+
+    std::vector<struct pollfd> fds;
+    if (loopback_port_ >= 0) {
+        fds.resize(static_cast<size_t>(snd_seq_poll_descriptors_count(seq_, POLLIN)));
+        snd_seq_poll_descriptors(seq_, fds.data(), static_cast<unsigned>(fds.size()), POLLIN);
+    }
+    const int wake_ms = static_cast<int>(std::max<int64_t>(lookahead_.count() / 4, 1));
+
+    check_alsa("snd_seq_start_queue", snd_seq_start_queue(seq_, queue_, nullptr));
+    check_alsa("snd_seq_drain_output", snd_seq_drain_output(seq_));
+    const auto started = std::chrono::steady_clock::now();
+    const std::chrono::nanoseconds end = (events.empty() ? std::chrono::nanoseconds{0}
+                                                         : events.back().due) +
+        kLeadIn;
+
+    size_t cursor = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+        const std::chrono::nanoseconds now = queue_time_();
+        while (cursor < events.size() && events[cursor].due + kLeadIn < now + lookahead_) {
+            const std::chrono::nanoseconds at = events[cursor].due + kLeadIn;
+            if (!schedule_(events[cursor].midi, at)) {
+                break;
+            }
+            if (loopback_port_ >= 0) {
+                scheduled.push_back(at);
+            }
+            stats.late += at < now;
+            cursor++;
+        }
+
+        // what the kernel pool can't take yet stays in the buffer for the next round
+        const int pending = snd_seq_drain_output(seq_);
+        if (pending < 0 && pending != -EAGAIN) {
+            check_alsa("snd_seq_drain_output", pending);
+        }
+        if (loopback_port_ >= 0) {
+            read_loopback_(scheduled, jitter);
+        }
+
+        if (cursor == events.size() && pending == 0 && now >= end &&
+            (jitter.size() == scheduled.size() || now >= end + kLoopbackGrace)) {
+            break;
+        }
+
+        if (fds.empty()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(wake_ms));
+        } else {
+            (void)poll(fds.data(), static_cast<nfds_t>(fds.size()), wake_ms);
+        }
+    }
+
+    if (stop.load(std::memory_order_relaxed)) {
+        silence_();
+    }
+    (void)snd_seq_stop_queue(seq_, queue_, nullptr);
+    (void)snd_seq_drain_output(seq_);
+
+    stats.events = cursor;
+    stats.elapsed = std::chrono::steady_clock::now() - started;
+    stats.received = jitter.size();
+    std::sort(jitter.begin(), jitter.end());
+    stats.jitter_p50 = quantile(jitter, 0.5);
+    stats.jitter_p99 = quantile(jitter, 0.99);
+    stats.jitter_p999 = quantile(jitter, 0.999);
+    stats.jitter_max = jitter.empty() ? std::chrono::nanoseconds{0} : jitter.back();
+    return stats;
+}
+
+void MidiPlayer::silence_(void) {
+    (void)snd_seq_drop_output(seq_);
+
+    snd_seq_remove_events_t *remove = nullptr;
+    snd_seq_remove_events_alloca(&remove);
+    snd_seq_remove_events_set_condition(remove, SND_SEQ_REMOVE_OUTPUT);
+    snd_seq_remove_events_set_queue(remove, queue_);
+    (void)snd_seq_remove_events(seq_, remove);
+
+    // pedal up and all notes off on every channel, straight to the subscribers
+    for (unsigned char channel = 0; channel < 16; channel++) {
+        for (const int param : {64, 123}) {
+            snd_seq_event_t ev;
+            snd_seq_ev_clear(&ev);
+            snd_seq_ev_set_controller(&ev, channel, param, 0);
+            snd_seq_ev_set_source(&ev, out_port_);
+            snd_seq_ev_set_subs(&ev);
+            snd_seq_ev_set_direct(&ev);
+            (void)snd_seq_event_output(seq_, &ev);
+        }
+    }
+    spdlog::info("Playback stopped");
+}
+
+std::vector<TimedMidi> jitter_test_pattern(
+    std::chrono::duration<double> length, double notes_per_second) {
+    std::vector<TimedMidi> events;
+    const auto notes = static_cast<size_t>(length.count() * notes_per_second);
+    const double period_ns = 1e9 / notes_per_second;
+    events.reserve(2 * notes);
+
+    for (size_t i = 0; i < notes; i++) {
+        const auto on = std::chrono::nanoseconds(std::llround(static_cast<double>(i) * period_ns));
+        const auto off = on + std::chrono::nanoseconds(std::llround(period_ns / 2));
+        const auto pitch = static_cast<uint8_t>(48 + i % 24);
+        events.push_back(TimedMidi{.due = on, .track = 0, .midi = {3, {0x90, pitch, 64}}});
+        events.push_back(TimedMidi{.due = off, .track = 0, .midi = {3, {0x80, pitch, 0}}});
+    }
+    return events;
+}
+
+} // namespace pr::midi
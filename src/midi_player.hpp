@@ -0,0 +1,85 @@
+#pragma once
+
+#include <alsa/asoundlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "replay_source.hpp"
+
+namespace pr::midi {
+
+struct PlayOptions {
+    // ports to play to, as anything snd_seq_parse_address() takes ("24:0", "FLUID Synth:0")
+    std::vector<std::string> destinations;
+    // how far ahead of the queue events are handed to the kernel
+    std::chrono::milliseconds lookahead{200};
+    // also play into a port of our own and measure when every event arrives there
+    bool loopback = false;
+};
+
+struct PlayStats {
+    uint64_t events = 0;
+    // events handed to the kernel after they were due, because the loop fell behind the window
+    uint64_t late = 0;
+    std::chrono::duration<double> elapsed{0};
+    // loopback only: how long after its scheduled time each event arrived
+    uint64_t received = 0;
+    std::chrono::nanoseconds jitter_p50{0};
+    std::chrono::nanoseconds jitter_p99{0};
+    std::chrono::nanoseconds jitter_p999{0};
+    std::chrono::nanoseconds jitter_max{0};
+};
+
+// Plays channel messages out of a sequencer port, on a queue of its own.
+//
+// Every event is scheduled at an absolute real time on the queue, at most a lookahead ahead of it,
+// and the kernel's timer sends it. The loop feeding the window only has to wake often enough to
+// keep it full, so how late that loop runs on a loaded machine never shows in the output; the
+// queue runs on the high-resolution timer when snd-hrtimer is loaded, since the system timer only
+// ticks at HZ.
+class MidiPlayer {
+public:
+    // queue timer rate on the high-resolution timer; events go out on one of its ticks
+    static constexpr unsigned kQueueTimerHz = 5000;
+    // the queue starts this far ahead of the first event, so the first window is already in place
+    static constexpr std::chrono::milliseconds kLeadIn{100};
+    // events in flight: the kernel's limit for one client's pool
+    static constexpr size_t kPoolEvents = 2000;
+
+    MidiPlayer(const std::string &client_name, const PlayOptions &options);
+    ~MidiPlayer(void);
+
+    MidiPlayer(const MidiPlayer &) = delete;
+    MidiPlayer &operator=(const MidiPlayer &) = delete;
+
+    // Blocks until the last event has gone out or stop is set, in which case whatever is still
+    // scheduled is dropped and every channel is silenced
+    PlayStats play(const std::vector<TimedMidi> &events, const std::atomic<bool> &stop);
+
+private:
+    void use_hrtimer_(void);
+    void connect_loopback_(void);
+    std::chrono::nanoseconds queue_time_(void);
+    // false if the output buffer is full; try again once the kernel has taken some of it
+    bool schedule_(const SeqMidi &midi, std::chrono::nanoseconds at);
+    void read_loopback_(const std::vector<std::chrono::nanoseconds> &scheduled,
+        std::vector<std::chrono::nanoseconds> &jitter);
+    void silence_(void);
+
+private:
+    snd_seq_t *seq_{nullptr};
+    int queue_{-1};
+    int out_port_{-1};
+    int loopback_port_{-1};
+    std::chrono::milliseconds lookahead_;
+};
+
+// A steady run of short notes, for measuring jitter without a file
+std::vector<TimedMidi> jitter_test_pattern(
+    std::chrono::duration<double> length, double notes_per_second);
+
+} // namespace pr::midi
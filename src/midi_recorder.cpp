@@ -10,23 +10,101 @@
 #include <poll.h>
 #include <stdexcept>
 #include <algorithm>
+#include <array>
+#include <cctype>
+#include <iterator>
+#include <span>
 #include <vector>
 #include <stdio.h>
 #include <string.h>
 #include <string>
-
-template<class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
-template<class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
+#include <time.h>
 
 namespace pr::midi {
 
-static std::string midi_bytes_hex(const std::vector<unsigned char> &bytes) {
-    std::string out;
-    out.reserve(bytes.size() * 3);
-    for (size_t i = 0; i < bytes.size(); ++i) {
-        out += fmt::format("{}{:02X}", i ? " " : "", bytes[i]);
+static size_t route_index(const snd_seq_addr_t &addr) {
+    return size_t{addr.client} << 8 | addr.port;
+}
+
+// stable across replugs, unlike the client id; identical devices share it
+static std::string device_name(const MidiPortHandle &src) {
+    std::string key = src.client_name;
+    if (src.port_id != 0) {
+        key += fmt::format("-{}", src.port_id);
+    }
+
+    std::replace_if(
+        key.begin(), key.end(), [](char c) { return !std::isalnum((unsigned char)c); }, '_');
+    return key;
+}
+
+static bool is_note_on(const SeqMidi &midi) {
+    return midi.len == 3 && (midi.bytes[0] & 0xF0) == 0x90 && midi.bytes[2] > 0;
+}
+
+// local time, e.g. 20240131-213000
+static std::string take_stamp(std::chrono::system_clock::time_point t) {
+    const time_t secs = std::chrono::system_clock::to_time_t(t);
+    struct tm local {};
+    localtime_r(&secs, &local);
+
+    char buf[32];
+    const size_t len = strftime(buf, sizeof(buf), "%Y%m%d-%H%M%S", &local);
+    return std::string(buf, len);
+}
+
+bool PerformanceState::observe(uint16_t track, const SeqMidi &midi) {
+    if (midi.len < 3) {
+        return false;
+    }
+
+    const size_t channel = midi.bytes[0] & 0x0F;
+    const size_t index = channel * 128 + midi.bytes[1];
+
+    switch (midi.bytes[0] & 0xF0) {
+        case 0x90:
+        case 0x80: {
+            const bool down = (midi.bytes[0] & 0xF0) == 0x90 && midi.bytes[2] > 0;
+            if (held_[track][index] != down) {
+                held_[track][index] = down;
+                down ? held_notes_++ : held_notes_--;
+            }
+            return true;
+        }
+        case 0xB0: {
+            controllers_[track][index] = midi.bytes[2];
+            if (midi.bytes[1] != 64) {
+                return false;
+            }
+
+            const bool down = midi.bytes[2] >= 64;
+            if (sustain_[track][channel] != down) {
+                sustain_[track][channel] = down;
+                down ? pedals_down_++ : pedals_down_--;
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static uint32_t tick_to_ms(const TimeBase &base, int64_t tick) {
+    return static_cast<uint32_t>(std::min<int64_t>(
+        std::llround(base.seconds(tick) * 1000.0), UINT32_MAX));
+}
+
+static void feed_roll(RollPyramid &roll, uint32_t ms, const SeqMidi &midi) {
+    if (midi.len != 3 || (midi.bytes[0] & 0xE0) != 0x80) {
+        return;
+    }
+
+    const auto channel = static_cast<uint8_t>(midi.bytes[0] & 0x0F);
+    if ((midi.bytes[0] & 0xF0) == 0x90 && midi.bytes[2] > 0) {
+        roll.note_on(ms, channel, midi.bytes[1], midi.bytes[2]);
+    } else {
+        roll.note_off(ms, channel, midi.bytes[1]);
     }
-    return out;
 }
 
 static void throw_sys(const char *what) {
@@ -34,12 +112,13 @@ static void throw_sys(const char *what) {
     throw std::runtime_error(std::string(what) + ": " + std::strerror(e));
 }
 
-MidiRecorder::MidiRecorder(MidiPortHandle src, const std::filesystem::path &out_path)
-    : preferred_src_(src), out_path_(out_path) {
-    midi_file_.absoluteTicks();
-    midi_file_.setTicksPerQuarterNote(kPpq);
-    midi_file_.addTempo(0, 0, kTempoBpm);
-
+MidiRecorder::MidiRecorder(std::unique_ptr<EventSource> source, std::vector<MidiPortHandle> srcs,
+    const std::filesystem::path &out_path, std::chrono::milliseconds split_after)
+    : preferred_srcs_(std::move(srcs)), source_(std::move(source)), out_path_(out_path),
+      routes_(1 << 16, kNoTrack), tracks_(std::make_unique<TrackInfo[]>(kMaxTracks)),
+      owners_(std::make_unique<TrackOwner[]>(kMaxTracks)),
+      split_after_(split_after), take_info_(kMaxTracks), writers_(kMaxTracks),
+      archives_(kMaxTracks), rolls_(kMaxTracks), writer_failed_(kMaxTracks, false) {
     do_resubscribe_();
 }
 
@@ -54,6 +133,8 @@ void MidiRecorder::start() {
         return;
     }
 
+    finalizer_.start();
+    persist_thread_ = std::thread([this]() { persist_loop_(); });
     thread_ = std::thread([this]() { record_loop_(); });
 }
 
@@ -70,68 +151,440 @@ void MidiRecorder::stop() {
         thread_.join();
     }
 
+    // capture is done, so the persistence thread can drain what is left and do the final save
+    persist_stop_requested_.store(true, std::memory_order_release);
+    if (persist_thread_.joinable()) {
+        persist_thread_.join();
+    }
+    finalizer_.stop();
+
+    persist_stop_requested_.store(false, std::memory_order_relaxed);
     stop_requested_.store(false, std::memory_order_relaxed);
     running_.store(false, std::memory_order_relaxed);
-
-    save_midi_();
 }
 
 void MidiRecorder::record_loop_(void) {
     std::vector<pollfd> fds = {{.fd = killswitch_fd_, .events = POLLIN, .revents = 0}};
-    std::vector<pollfd> sequencer_fds = sequencer_.get_poll_desc();
-    fds.insert(fds.end(), sequencer_fds.begin(), sequencer_fds.end());
+    std::vector<pollfd> source_fds = source_->get_poll_desc();
+    fds.insert(fds.end(), source_fds.begin(), source_fds.end());
+    trace::name_thread("capture");
+
+    if (realtime_) {
+        // the rings were value-initialized by the constructor, so their pages are already resident
+        // and locked; the stack is the only memory left that this loop would fault in
+        make_thread_realtime(*realtime_);
+        prefault_stack(kCaptureStackPrefault);
+    }
 
     spdlog::info("Logging events...");
 
-    TickClock tick_clock{};
+    std::array<SeqEvent, kDrainBatch> events;
+    TickClock tick_clock{.base = time_base_};
+    if (std::optional<std::chrono::nanoseconds> queue_now = source_->queue_time()) {
+        tick_clock.anchor_queue(*queue_now);
+    }
 
     while (!stop_requested_.load(std::memory_order_relaxed)) {
-        if (poll(fds.data(), (nfds_t)fds.size(), 50) < 0) {
+        const auto poll_start = std::chrono::steady_clock::now();
+        const int ready = poll(fds.data(), (nfds_t)fds.size(), kCapturePollMs);
+        if (ready < 0) {
             throw_sys("poll");
         }
+        if (ready == 0 && realtime_) {
+            const auto late = std::chrono::steady_clock::now() - poll_start -
+                std::chrono::milliseconds(kCapturePollMs);
+            metrics_.wakeup_latency.record(late);
+            const int64_t late_ns = std::chrono::nanoseconds(late).count();
+            int64_t worst = metrics_.worst_wakeup_ns.load(std::memory_order_relaxed);
+            while (late_ns > worst &&
+                !metrics_.worst_wakeup_ns.compare_exchange_weak(
+                    worst, late_ns, std::memory_order_relaxed)) {
+            }
+        }
+
+        size_t n_events = 0;
+        while ((n_events = source_->drain(events)) > 0) {
+            for (const SeqEvent &ev : std::span(events.data(), n_events)) {
+                switch (ev.type) {
+                    case SeqEventType::MIDI: {
+                        const auto dequeued = std::chrono::steady_clock::now();
+                        auto stamped = dequeued;
+                        int64_t skew_ns = -1;
+                        if (ev.stamped) {
+                            stamped = tick_clock.from_queue(ev.stamp);
+                            // nothing is dequeued before it was stamped, so the queue timer has
+                            // run ahead of steady_clock; pull the anchor back rather than stamp
+                            // the future
+                            if (stamped > dequeued) {
+                                tick_clock.queue_origin -= stamped - dequeued;
+                                stamped = dequeued;
+                            }
+                            skew_ns = (dequeued - stamped).count();
+                        }
+
+                        const int64_t now_tick = tick_clock.tick_at(stamped);
+
+                        uint16_t track = routes_[route_index(ev.source)];
+                        if (track == kNoTrack) {
+                            // connected to us from outside (e.g. aconnect) rather than by us
+                            MidiPortHandle src = MidiPortHandle::from_snd_addr(ev.source);
+                            source_->expand_midi_port(src);
+                            if ((track = route_source_(src)) == kNoTrack) {
+                                break;
+                            }
+                        }
+
+                        live_.publish(
+                            LiveEvent{.tick = now_tick, .track = track, .midi = ev.data.midi});
+
+                        // a full ring drops the event; the persistence thread reports overflows
+                        metrics_.events_captured.add();
+                        const bool pushed = ring_.try_push(CapturedEvent{.tick = now_tick,
+                            .track = track,
+                            .midi = ev.data.midi,
+                            .skew_ns = skew_ns,
+                            .dequeued_ns = dequeued.time_since_epoch().count()});
+                        if (!pushed) {
+                            metrics_.events_dropped.add();
+                        }
+                        trace::record(pushed ? trace::Kind::CAPTURED : trace::Kind::DROPPED,
+                            trace::CaptureTrace{.tick = now_tick,
+                                .track = track,
+                                .len = ev.data.midi.len,
+                                .bytes = {ev.data.midi.bytes[0], ev.data.midi.bytes[1],
+                                    ev.data.midi.bytes[2]},
+                                .skew_ns = skew_ns});
+                        break;
+                    }
+
+                    case SeqEventType::ANNOUNCE: {
+                        MidiPortHandle addr = MidiPortHandle::from_snd_addr(ev.data.announce.addr);
+                        source_->expand_midi_port(addr);
+                        spdlog::info("{} - {}", magic_enum::enum_name(ev.data.announce.type),
+                            fmt::streamed(addr));
+                        switch (ev.data.announce.type) {
+                            case AnnounceType::PORT_START:
+                                do_resubscribe_();
+                                break;
+                            case AnnounceType::PORT_EXIT:
+                                detach_source_(addr);
+                                break;
+                            case AnnounceType::CLIENT_EXIT: {
+                                std::vector<MidiPortHandle> sources = source_->sources();
+                                for (const MidiPortHandle &src : sources) {
+                                    if (src.client_id == addr.client_id) {
+                                        detach_source_(src);
+                                    }
+                                }
+                                break;
+                            }
+                            default:
+                                break;
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
 
-        std::optional<SequencerMsg> event = sequencer_.get_event();
-        while (event.has_value()) {
-            // Who in god's name thought this was clearer as a feature than the classic union with
-            // a type switch at the start???
-            std::visit(overloaded {
-                [&](MidiMsg msg) {
-                    int now_tick = tick_clock.now_tick();
-                    spdlog::trace("[{}] {}", now_tick, midi_bytes_hex(msg.data));
-                    midi_file_.addEvent(0, now_tick, msg.data);
-                    samples_last_saved_++;
-                },
-                [&](AnnounceMsg msg) {
-                    sequencer_.expand_midi_port(msg.addr);
-                    spdlog::info("{} - {}", magic_enum::enum_name(msg.type), fmt::streamed(msg.addr));
-                    if (msg.type == AnnounceType::PORT_START) {
-                        do_resubscribe_();
+void MidiRecorder::persist_loop_(void) {
+    std::array<CapturedEvent, kDrainBatch> batch;
+    trace::name_thread("persist");
+    time_last_analytics_ = std::chrono::steady_clock::now();
+    analytics_.reset(time_last_analytics_.time_since_epoch().count());
+
+    while (true) {
+        // read the flag before draining so nothing pushed before stop() is left behind
+        const bool stopping = persist_stop_requested_.load(std::memory_order_acquire);
+
+        size_t n_events = 0;
+        while ((n_events = ring_.pop_bulk(batch)) > 0) {
+            for (const CapturedEvent &ev : std::span(batch.data(), n_events)) {
+                if (is_note_on(ev.midi)) {
+                    beat_tracker_.onset(time_base_.seconds(ev.tick));
+                }
+
+                // a take starts with its first note; controllers before it are chased instead
+                if (!take_open_ && is_note_on(ev.midi)) {
+                    open_take_(ev.tick);
+                }
+
+                SmfWriter *writer = take_open_ ? writer_for_(ev.track) : nullptr;
+                if (writer) {
+                    // the archive and the roll stay on the capture clock
+                    const int64_t tick = std::max<int64_t>(ev.tick - take_origin_tick_, 0);
+                    writer->append(follow_tempo_(tick), ev.midi.bytes, ev.midi.len);
+                    if (archives_[ev.track]) {
+                        archives_[ev.track]->append(tick, ev.midi.bytes, ev.midi.len);
                     }
-                },
-            }, event.value());
-            event = sequencer_.get_event();
+                    take_last_tick_ = std::max(take_last_tick_, tick);
+                    take_info_[ev.track].events++;
+                    take_info_[ev.track].notes += is_note_on(ev.midi);
+                    metrics_.events_written.add();
+                    feed_roll(*rolls_[ev.track], tick_to_ms(time_base_, tick), ev.midi);
+                }
+
+                analytics_.observe(ev.dequeued_ns, ev.midi);
+                const std::chrono::nanoseconds dequeued{ev.dequeued_ns};
+                if (performance_.observe(ev.track, ev.midi)) {
+                    last_activity_ = std::chrono::steady_clock::time_point(
+                        std::chrono::duration_cast<std::chrono::steady_clock::duration>(dequeued));
+                }
+
+                const auto appended = std::chrono::steady_clock::now().time_since_epoch();
+                metrics_.dequeue_to_append.record(appended - dequeued);
+                if (ev.skew_ns >= 0) {
+                    metrics_.stamp_to_dequeue.record(std::chrono::nanoseconds(ev.skew_ns));
+                    skew_last_saved_.record(std::chrono::nanoseconds(ev.skew_ns));
+                }
+                samples_last_saved_++;
+            }
+        }
+
+        if (stopping) {
+            break;
+        }
+
+        if (take_open_ && split_after_.count() > 0 && performance_.idle() &&
+            std::chrono::steady_clock::now() - last_activity_ >= split_after_) {
+            close_take_();
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (now - time_last_analytics_ >= std::chrono::milliseconds(kAnalyticsPublishMs)) {
+            analytics_.publish(now.time_since_epoch().count());
+            time_last_analytics_ = now;
         }
 
         do_periodic_save_();
+        if (realtime_) {
+            report_realtime_();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(kPersistPollMs));
+    }
+
+    analytics_.publish(std::chrono::steady_clock::now().time_since_epoch().count());
+    if (take_open_) {
+        close_take_();
+    } else {
+        save_midi_();
     }
 }
 
-void MidiRecorder::do_resubscribe_(void) {
-    spdlog::info("Preferred: {}", fmt::streamed(preferred_src_));
-    if (preferred_src_.is_valid()) {
-        spdlog::info("Preferred resolution: subscribe to {}", fmt::streamed(preferred_src_));
-        sequencer_.subscribe(preferred_src_);
+void MidiRecorder::open_take_(int64_t tick) {
+    take_started_ = std::chrono::system_clock::now();
+    take_stamp_ = take_stamp(take_started_);
+    // takes closer together than a second would otherwise get the same name
+    if (take_stamp_ == last_take_stamp_) {
+        take_stamp_ += fmt::format("-{}", ++take_seq_);
     } else {
-        std::vector<MidiPortHandle> sources = enumerate_midi_sources();
-        if (sources.empty()) {
-            return;
+        last_take_stamp_ = take_stamp_;
+        take_seq_ = 0;
+    }
+
+    take_origin_tick_ = tick;
+    take_last_tick_ = 0;
+    // start at the tempo the session has settled on, if it has
+    const double bpm = follow_tempo_enabled_ && beat_tracker_.bpm() > 0.0 ? beat_tracker_.bpm()
+                                                                          : time_base_.bpm();
+    tempo_map_ = TempoMap(time_base_.bpm(), bpm);
+    take_tempo_.assign(1, {0, bpm});
+    take_open_ = true;
+    spdlog::info("Take {} started", take_stamp_);
+}
+
+void MidiRecorder::close_take_(void) {
+    save_midi_();
+
+    const double duration_s = time_base_.seconds(take_last_tick_);
+    for (size_t track = 0; track < writers_.size(); track++) {
+        if (writers_[track]) {
+            TakeInfo &info = take_info_[track];
+            info.started = take_started_;
+            info.duration_s = duration_s;
+            rolls_[track]->finish(tick_to_ms(time_base_, take_last_tick_));
+            info.roll = std::move(rolls_[track]);
+            finalizer_.submit(
+                std::move(writers_[track]), std::move(archives_[track]), std::move(info));
         }
+        take_info_[track] = TakeInfo{};
+        writer_failed_[track] = false;
+    }
+
+    take_open_ = false;
+    spdlog::info("Take {} closed after {:.1f}s", take_stamp_, duration_s);
+}
+
+SmfWriter *MidiRecorder::writer_for_(uint16_t track) {
+    if (writers_[track] || writer_failed_[track]) {
+        return writers_[track].get();
+    }
 
+    const TrackInfo &info = tracks_[track];
+    const std::filesystem::path path = out_path_.parent_path() /
+        fmt::format("{}-{}-{}{}{}", out_path_.stem().string(), take_stamp_, info.key,
+            out_path_.extension().string(), kPartialSuffix);
+    try {
+        writers_[track] = std::make_unique<SmfWriter>(
+            path, time_base_.ppq, take_tempo_.front().second);
+        spdlog::info("Recording {} to {}", info.key, path.string());
+    } catch (const std::exception &e) {
+        spdlog::error("Could not open track {}: {}", info.key, e.what());
+        writer_failed_[track] = true;
+        return nullptr;
+    }
+
+    if (archive_) {
+        // "<take>.mid.part" -> "<take>.prarc.part"
+        std::filesystem::path archive_path = path;
+        archive_path.replace_extension();
+        archive_path.replace_extension(fmt::format("{}{}", kArchiveExtension, kPartialSuffix));
+        try {
+            archives_[track] = std::make_unique<ArchiveWriter>(
+                archive_path, time_base_.ppq, time_base_.bpm());
+        } catch (const std::exception &e) {
+            spdlog::error("Could not open archive of track {}: {}", info.key, e.what());
+        }
+    }
+
+    // pick up the pedals and controllers where they were left
+    SmfWriter &writer = *writers_[track];
+    ArchiveWriter *archive = archives_[track].get();
+    performance_.chase(track, [&](const uint8_t *bytes, size_t len) {
+        writer.append(0, bytes, len);
+        if (archive) {
+            archive->append(0, bytes, len);
+        }
+    });
+    for (size_t i = 1; i < take_tempo_.size(); i++) {
+        writer.append_tempo(take_tempo_[i].first, take_tempo_[i].second);
+    }
+    take_info_[track].device = info.key;
+    take_info_[track].port = info.port;
+
+    rolls_[track] = std::make_shared<RollPyramid>();
+    if (roll_store_) {
+        roll_store_->publish(path.filename().string(), rolls_[track]);
+    }
+
+    return &writer;
+}
+
+// file tick of a take tick, moving the take to the beat tracker's tempo first if it has drifted
+int64_t MidiRecorder::follow_tempo_(int64_t tick) {
+    const int64_t file_tick = tempo_map_.to_file_tick(tick);
+    const double bpm = beat_tracker_.bpm();
+    if (!follow_tempo_enabled_ || bpm <= 0.0 ||
+        std::abs(bpm / tempo_map_.bpm() - 1.0) < kTempoChangeRatio ||
+        file_tick - tempo_map_.segment_start() < int64_t{kMinTempoSegmentBeats} * time_base_.ppq) {
+        return file_tick;
+    }
+
+    tempo_map_.change(tick, bpm);
+    take_tempo_.emplace_back(file_tick, bpm);
+    for (const std::unique_ptr<SmfWriter> &writer : writers_) {
+        if (writer) {
+            writer->append_tempo(file_tick, bpm);
+        }
+    }
+    spdlog::debug("Take {} now at {:.1f} bpm", take_stamp_, bpm);
+    return file_tick;
+}
+
+uint16_t MidiRecorder::route_source_(const MidiPortHandle &src) {
+    const std::string name = device_name(src);
+    uint16_t &route = routes_[route_index(src.to_snd_addr())];
+    if (route != kNoTrack) {
+        owners_[route].ports--;
+    }
+
+    // a replugged device picks its old track back up: one of that name with nothing attached,
+    // preferably on the same card. Identical devices plugged in together get a track each, the
+    // second and later ones keyed with an ordinal.
+    size_t track = track_count_;
+    size_t same_name = 0;
+    for (size_t t = 0; t < track_count_; t++) {
+        if (owners_[t].name != name) {
+            continue;
+        }
+        same_name++;
+        if (owners_[t].ports == 0 && (track == track_count_ || owners_[t].card == src.card)) {
+            track = t;
+        }
+    }
+
+    if (track == track_count_) {
+        if (track_count_ == kMaxTracks) {
+            spdlog::error("Out of tracks, not recording {}", fmt::streamed(src));
+            route = kNoTrack;
+            return kNoTrack;
+        }
+
+        const std::string key = same_name == 0 ? name : fmt::format("{}_{}", name, same_name + 1);
+        tracks_[track] = TrackInfo{.key = key, .port = src.to_expanded_str()};
+        owners_[track].name = name;
+        track_count_++;
+    }
+
+    owners_[track].card = src.card;
+    owners_[track].ports++;
+    route = static_cast<uint16_t>(track);
+    return route;
+}
+
+void MidiRecorder::attach_source_(const MidiPortHandle &src) {
+    if (source_->subscribe(src)) {
+        (void)route_source_(src);
+    }
+}
+
+void MidiRecorder::detach_source_(const MidiPortHandle &src) {
+    uint16_t &route = routes_[route_index(src.to_snd_addr())];
+    if (route != kNoTrack) {
+        spdlog::info("Track {} detached", tracks_[route].key);
+        owners_[route].ports--;
+        route = kNoTrack;
+    }
+
+    source_->unsubscribe(src);
+}
+
+void MidiRecorder::do_resubscribe_(void) {
+    if (!preferred_srcs_.empty()) {
+        for (const MidiPortHandle &src : preferred_srcs_) {
+            if (!source_->is_subscribed(src)) {
+                spdlog::info("Preferred resolution: subscribe to {}", fmt::streamed(src));
+                attach_source_(src);
+            }
+        }
+        return;
+    }
+
+    std::vector<MidiPortHandle> sources = source_->available_sources();
+    std::erase_if(sources, [&](const MidiPortHandle &h) {
+        return h.client_id == SND_SEQ_CLIENT_SYSTEM || h.client_id == source_->client_id();
+    });
+    if (sources.empty()) {
+        return;
+    }
+
+    // every hardware port gets its own track; without any, fall back to the best ranked source
+    std::vector<MidiPortHandle> wanted;
+    std::copy_if(sources.begin(), sources.end(), std::back_inserter(wanted),
+        [](const MidiPortHandle &h) { return h.is_hardware(); });
+
+    if (wanted.empty()) {
         std::sort(sources.begin(), sources.end());
-        MidiPortHandle auto_resub = sources.back();
+        wanted.push_back(sources.back());
+    }
 
-        spdlog::info("Auto resolution: subscribe to {}", fmt::streamed(auto_resub));
-        sequencer_.subscribe(auto_resub);
+    for (const MidiPortHandle &src : wanted) {
+        if (!source_->is_subscribed(src)) {
+            spdlog::info("Auto resolution: subscribe to {}", fmt::streamed(src));
+            attach_source_(src);
+        }
     }
 }
 
@@ -145,31 +598,119 @@ void MidiRecorder::do_periodic_save_(void) {
     }
 }
 
-void MidiRecorder::save_midi_(void) {
-    std::filesystem::path tmp_path{out_path_.string() + ".tmp"};
-
-    // copy the midi file before writing it
-    smf::MidiFile midi_file = midi_file_;
-    midi_file.sortTracks();
-    midi_file.deltaTicks();
-
-    if (!midi_file.write(tmp_path.string())) {
-        spdlog::warn("Could not write to {}", tmp_path.string());
+void MidiRecorder::report_realtime_(void) {
+    const auto now = std::chrono::steady_clock::now();
+    if (now - time_last_realtime_report_ < std::chrono::seconds(kRealtimeReportS)) {
         return;
     }
+    time_last_realtime_report_ = now;
+
+    using usec = std::chrono::duration<double, std::micro>;
+    const int64_t worst_ns = metrics_.worst_wakeup_ns.exchange(0, std::memory_order_relaxed);
+    worst_wakeup_ever_ns_ = std::max(worst_wakeup_ever_ns_, worst_ns);
+    spdlog::info("Realtime: worst capture wakeup latency {:.0f}us in the last {}s, {:.0f}us since "
+                 "start (p99 <= {:.0f}us)",
+        usec(std::chrono::nanoseconds(worst_ns)).count(), kRealtimeReportS,
+        usec(std::chrono::nanoseconds(worst_wakeup_ever_ns_)).count(),
+        usec(metrics_.wakeup_latency.quantile(0.99)).count());
+}
 
-    int fd = open(tmp_path.c_str(), O_RDONLY | O_CLOEXEC);
-    if (fd > 0) {
-        (void)fdatasync(fd);
-        close(fd);
+void MidiRecorder::save_midi_(void) {
+    // only the events since the last save are written; the rest of each file is left untouched
+    const auto save_start = std::chrono::steady_clock::now();
+
+    size_t n_tracks = 0;
+    for (const std::unique_ptr<SmfWriter> &writer : writers_) {
+        if (writer) {
+            const bool had_pending = writer->pending_events() > 0;
+            if (writer->flush() && had_pending) {
+                metrics_.fsync_duration.record(writer->last_sync_time());
+            }
+            n_tracks++;
+        }
     }
+    for (const std::unique_ptr<ArchiveWriter> &archive : archives_) {
+        if (archive && !archive->flush()) {
+            spdlog::warn("Could not flush {}", archive->path().string());
+        }
+    }
+
+    const auto save_end = std::chrono::steady_clock::now();
+    metrics_.save_duration.record(save_end - save_start);
+    trace::record(trace::Kind::SAVE,
+        trace::SaveTrace{.duration_ns = std::chrono::nanoseconds(save_end - save_start).count(),
+            .tracks = static_cast<uint32_t>(n_tracks),
+            .events = static_cast<uint32_t>(samples_last_saved_)});
+
+    const std::chrono::duration<double> rate_window = save_end - time_last_rate_;
+    if (rate_window.count() > 0.0) {
+        metrics_.events_per_second.store(
+            static_cast<double>(samples_last_saved_) / rate_window.count(),
+            std::memory_order_relaxed);
+    }
+    time_last_rate_ = save_end;
 
-    rename(tmp_path.c_str(), out_path_.c_str());
+    const uint64_t overflows = ring_.overflows();
+    if (overflows != overflows_reported_) {
+        spdlog::warn("Capture ring overflowed - {} events dropped ({} total)",
+            overflows - overflows_reported_, overflows);
+        overflows_reported_ = overflows;
+    }
 
-    if (samples_last_saved_ > 0) {
-        spdlog::info("{} - wrote {} samples", out_path_.string(), samples_last_saved_);
+    if (samples_last_saved_ > 0 && skew_last_saved_.count > 0) {
+        using usec = std::chrono::microseconds;
+        const auto avg = skew_last_saved_.total / static_cast<int64_t>(skew_last_saved_.count);
+        spdlog::info("Wrote {} samples to {} tracks, ring peak {}/{}, stamp skew avg {}us max {}us",
+            samples_last_saved_, n_tracks, ring_.high_water(), ring_.capacity(),
+            std::chrono::duration_cast<usec>(avg).count(),
+            std::chrono::duration_cast<usec>(skew_last_saved_.max).count());
+    } else if (samples_last_saved_ > 0) {
+        spdlog::info("Wrote {} samples to {} tracks, ring peak {}/{}", samples_last_saved_,
+            n_tracks, ring_.high_water(), ring_.capacity());
     }
     samples_last_saved_ = 0;
+    skew_last_saved_ = StampSkew{};
+}
+
+std::string MidiRecorder::render_metrics(void) const {
+    PrometheusWriter page;
+
+    page.histogram("piano_recorder_stamp_to_dequeue_seconds",
+        "Time between the kernel stamping an event and the capture thread reading it",
+        metrics_.stamp_to_dequeue);
+    page.histogram("piano_recorder_dequeue_to_append_seconds",
+        "Time between reading an event and appending it to its track", metrics_.dequeue_to_append);
+    page.histogram("piano_recorder_save_duration_seconds", "Wall time of each periodic save",
+        metrics_.save_duration);
+    page.histogram("piano_recorder_fsync_duration_seconds",
+        "Time spent in fdatasync per track save", metrics_.fsync_duration);
+
+    page.counter("piano_recorder_events_total", "MIDI events captured",
+        metrics_.events_captured.value());
+    page.counter("piano_recorder_events_written_total", "MIDI events appended to a track",
+        metrics_.events_written.value());
+    page.counter("piano_recorder_events_dropped_total",
+        "MIDI events dropped on a full capture ring", metrics_.events_dropped.value());
+    page.histogram("piano_recorder_finalize_duration_seconds",
+        "Time to close, rename and describe a finished take", metrics_.finalize_duration);
+    page.counter("piano_recorder_takes_finalized_total", "Takes closed on silence or at exit",
+        metrics_.takes_finalized.value());
+    if (realtime_) {
+        page.histogram("piano_recorder_capture_wakeup_latency_seconds",
+            "How late the realtime capture thread woke from an idle poll",
+            metrics_.wakeup_latency);
+    }
+    page.counter("piano_recorder_sequencer_overruns_total",
+        "ALSA client input pool overflows (events lost in the kernel)",
+        source_->input_overruns());
+    page.gauge("piano_recorder_events_per_second", "Event rate over the last save interval",
+        metrics_.events_per_second.load(std::memory_order_relaxed));
+    page.gauge("piano_recorder_ring_high_water", "Most events ever queued between the threads",
+        static_cast<double>(ring_.high_water()));
+    page.gauge("piano_recorder_ring_capacity", "Capacity of the capture ring",
+        static_cast<double>(ring_.capacity()));
+
+    return page.str();
 }
 
 } // namespace pr::midi
@@ -3,54 +3,192 @@
 #include <alsa/asoundlib.h>
 
 #include <algorithm>
+#include <array>
 #include <atomic>
+#include <bitset>
 #include <chrono>
 #include <filesystem>
 #include <iosfwd>
+#include <memory>
+#include <optional>
 #include <string>
 #include <thread>
 #include <vector>
 
 #include <math.h>
 
-#include <MidiFile.h>
 #include <magic_enum/magic_enum.hpp>
 
 #include "alsa_sequencer.hpp"
+#include "analytics.hpp"
+#include "archive.hpp"
+#include "beat_tracker.hpp"
+#include "broadcast_ring.hpp"
+#include "event_source.hpp"
+#include "metrics.hpp"
 #include "midi_device.hpp"
+#include "realtime.hpp"
+#include "roll_store.hpp"
+#include "smf_writer.hpp"
+#include "spsc_ring.hpp"
+#include "take_finalizer.hpp"
+#include "time_base.hpp"
+#include "trace.hpp"
 
 // has to be in global namespace or else fmt::streamed() can't see it
 std::ostream &operator<<(std::ostream &os, const snd_seq_event_t &ev);
 
-static constexpr int kPpq = 960;
 static constexpr int64_t kAutoSaveMs = 500;
-static constexpr double kTempoBpm = 120.0;
+static constexpr size_t kDrainBatch = 64;
+static constexpr size_t kCaptureRingSize = 1 << 16;
+static constexpr size_t kLiveRingSize = 1 << 14;
+static constexpr int64_t kPersistPollMs = 10;
+static constexpr int64_t kCapturePollMs = 50;
+static constexpr int64_t kRealtimeReportS = 60;
+static constexpr int64_t kAnalyticsPublishMs = 100;
+// a take's tempo changes once the estimate is this far off, and at most every so many beats
+static constexpr double kTempoChangeRatio = 0.02;
+static constexpr int kMinTempoSegmentBeats = 8;
+static constexpr size_t kCaptureStackPrefault = 256 * 1024;
+static constexpr size_t kMaxTracks = 64;
+static constexpr uint16_t kNoTrack = UINT16_MAX;
 
 namespace pr::midi {
 
+enum class TimestampMode { DEQUEUE, KERNEL };
+
 struct TickClock {
+    TimeBase base;
     std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
-    int last_tick = 0;
-
-    int now_tick() {
-        using dsec = std::chrono::duration<double>;
+    // steady_clock time at which the sequencer queue read zero
+    std::chrono::steady_clock::time_point queue_origin = t0;
+    int64_t last_tick = 0;
 
-        const auto now = std::chrono::steady_clock::now();
-        const double secs = std::chrono::duration_cast<dsec>(now - t0).count();
-        const double ticks_per_sec = kPpq * (kTempoBpm / 60.0);
+    int64_t now_tick() {
+        return tick_at(std::chrono::steady_clock::now());
+    }
 
-        int tick = (secs <= 0.0) ? 0 : int(std::llround(secs * ticks_per_sec));
+    int64_t tick_at(std::chrono::steady_clock::time_point t) {
+        int64_t tick = t > t0 ? base.ticks(t - t0) : 0;
 
         tick = std::max(tick, last_tick);
         last_tick = tick;
 
         return tick;
     }
+
+    void anchor_queue(std::chrono::nanoseconds queue_now) {
+        queue_origin = std::chrono::steady_clock::now() - queue_now;
+    }
+
+    std::chrono::steady_clock::time_point from_queue(std::chrono::nanoseconds stamp) const {
+        return queue_origin + stamp;
+    }
+};
+
+// How long events sat between the kernel stamping them and the recorder dequeuing them
+struct StampSkew {
+    uint64_t count = 0;
+    std::chrono::nanoseconds total{0};
+    std::chrono::nanoseconds max{0};
+
+    void record(std::chrono::nanoseconds skew) {
+        count++;
+        total += skew;
+        max = std::max(max, skew);
+    }
+};
+
+// One output file per recorded device and take. Filled in by the capture thread before the first
+// event routed to it is pushed and never modified afterwards, so the ring publishes it to the
+// persistence thread.
+struct TrackInfo {
+    std::string key;
+    std::string port;
+};
+
+// What is held down on every track, so the session can be split into takes on silence, plus the
+// last value of every controller so a new take starts with the pedals where they are.
+class PerformanceState {
+public:
+    static constexpr uint8_t kUnset = 0xFF;
+
+    explicit PerformanceState(size_t tracks)
+        : held_(tracks), sustain_(tracks), controllers_(tracks) {
+        for (auto &values : controllers_) {
+            values.fill(kUnset);
+        }
+    }
+
+    // true for events that count as playing: notes and sustain pedal changes
+    bool observe(uint16_t track, const SeqMidi &midi);
+
+    bool idle(void) const noexcept {
+        return held_notes_ == 0 && pedals_down_ == 0;
+    }
+
+    // calls fn(bytes, len) for every controller seen on the track so far
+    template <class Fn>
+    void chase(uint16_t track, Fn &&fn) const {
+        const auto &values = controllers_[track];
+        for (size_t i = 0; i < values.size(); i++) {
+            if (values[i] != kUnset) {
+                const uint8_t bytes[3] = {static_cast<uint8_t>(0xB0 | (i >> 7)),
+                    static_cast<uint8_t>(i & 0x7F), values[i]};
+                fn(bytes, sizeof(bytes));
+            }
+        }
+    }
+
+private:
+    // indexed by channel * 128 + note / controller
+    std::vector<std::bitset<16 * 128>> held_;
+    std::vector<std::bitset<16>> sustain_;
+    std::vector<std::array<uint8_t, 16 * 128>> controllers_;
+    size_t held_notes_{0};
+    size_t pedals_down_{0};
+};
+
+// What the capture thread hands to the persistence thread
+struct CapturedEvent {
+    int64_t tick;
+    uint16_t track;
+    SeqMidi midi;
+    // dequeue minus kernel stamp, or -1 if the event had no stamp
+    int64_t skew_ns;
+    // steady_clock time the capture thread read the event
+    int64_t dequeued_ns;
+};
+
+// What the capture thread publishes for live viewers
+struct LiveEvent {
+    int64_t tick;
+    uint16_t track;
+    SeqMidi midi;
+};
+
+// Capture health, updated lock-free from the recorder threads and read by /metrics
+struct RecorderMetrics {
+    LatencyHistogram stamp_to_dequeue;
+    LatencyHistogram dequeue_to_append;
+    LatencyHistogram save_duration;
+    LatencyHistogram fsync_duration;
+    Counter events_captured;
+    Counter events_written;
+    Counter events_dropped;
+    LatencyHistogram finalize_duration;
+    Counter takes_finalized;
+    // how late the capture thread woke from an idle poll; only measured in realtime mode
+    LatencyHistogram wakeup_latency;
+    std::atomic<int64_t> worst_wakeup_ns{0};
+    std::atomic<double> events_per_second{0.0};
 };
 
 class MidiRecorder {
 public:
-    explicit MidiRecorder(MidiPortHandle src, const std::filesystem::path &out_path);
+    // split_after: close the take once nothing has sounded for this long (zero never splits)
+    MidiRecorder(std::unique_ptr<EventSource> source, std::vector<MidiPortHandle> srcs,
+        const std::filesystem::path &out_path, std::chrono::milliseconds split_after = {});
     ~MidiRecorder(void);
 
     MidiRecorder(const MidiRecorder &) = delete;
@@ -66,26 +204,150 @@ public:
         return stop_requested_.load(std::memory_order_relaxed);
     }
 
+    // Prometheus text page; safe to call from any thread
+    std::string render_metrics(void) const;
+
+    const RecorderMetrics &metrics(void) const noexcept {
+        return metrics_;
+    }
+
+    // every captured event, for any number of readers that must never hold up capture
+    const BroadcastRing<LiveEvent> &live(void) const noexcept {
+        return live_;
+    }
+
+    // running practice statistics of the session, published every kAnalyticsPublishMs
+    const LiveAnalytics &analytics(void) const noexcept {
+        return analytics_;
+    }
+
+    // key of a track that has appeared in a LiveEvent; the ring publishes it along with the event
+    const std::string &track_device(uint16_t track) const noexcept {
+        return tracks_[track].key;
+    }
+
+    // publishes a piano roll of every track of the take being recorded; set before start()
+    void serve_rolls(RollStore &store) noexcept {
+        roll_store_ = &store;
+    }
+
+    // run the capture thread at SCHED_FIFO, pinned, with its stack prefaulted; set before start()
+    void set_realtime(const RealtimeConfig &config) noexcept {
+        realtime_ = config;
+    }
+
+    // length of a capture tick, which the .mid files and archives are written in;
+    // set before start()
+    void set_time_base(const TimeBase &base) noexcept {
+        time_base_ = base;
+        tempo_map_ = TempoMap(base.bpm(), base.bpm());
+    }
+
+    const TimeBase &time_base(void) const noexcept {
+        return time_base_;
+    }
+
+    // write .mid files on the time base's tempo rather than the one played; set before start()
+    void follow_tempo(bool enabled) noexcept {
+        follow_tempo_enabled_ = enabled;
+    }
+
+    // also write every track of every take as a "<take>.prarc" archive; set before start()
+    void write_archives(bool enabled) noexcept {
+        archive_ = enabled;
+    }
+
+    // set before start()
+    void on_take_finalized(TakeFinalizer::Listener listener) {
+        finalizer_.set_listener(std::move(listener));
+    }
+
 private:
     void record_loop_(void);
+    void persist_loop_(void);
     void do_periodic_save_(void);
     void do_resubscribe_(void);
+    void attach_source_(const MidiPortHandle &src);
+    void detach_source_(const MidiPortHandle &src);
+    uint16_t route_source_(const MidiPortHandle &src);
+    SmfWriter *writer_for_(uint16_t track);
+    int64_t follow_tempo_(int64_t tick);
+    void open_take_(int64_t tick);
+    void close_take_(void);
     void save_midi_(void);
+    void report_realtime_(void);
 
 private:
     int killswitch_fd_{-1};
 
-    smf::MidiFile midi_file_;
-    MidiPortHandle preferred_src_;
+    std::vector<MidiPortHandle> preferred_srcs_;
 
-    AlsaSequencer sequencer_{"piano-recorder", "Recorder In"};
+    std::unique_ptr<EventSource> source_;
 
     std::atomic<bool> stop_requested_{false};
     std::atomic<bool> running_{false};
     std::thread thread_{};
+    std::optional<RealtimeConfig> realtime_;
+
+    SpscRing<CapturedEvent> ring_{kCaptureRingSize};
+    BroadcastRing<LiveEvent> live_{kLiveRingSize};
+    std::atomic<bool> persist_stop_requested_{false};
+    std::thread persist_thread_{};
+    uint64_t overflows_reported_{0};
+
+    RecorderMetrics metrics_{};
+    std::chrono::steady_clock::time_point time_last_rate_{std::chrono::steady_clock::now()};
+
     size_t samples_last_saved_{0};
+    StampSkew skew_last_saved_{};
     std::filesystem::path out_path_;
+
+    // capture thread: source address -> track, and the tracks handed out so far
+    std::vector<uint16_t> routes_;
+    std::unique_ptr<TrackInfo[]> tracks_;
+    size_t track_count_{0};
+    // capture thread: the device behind each track, so a replugged one gets its own track back
+    struct TrackOwner {
+        std::string name;
+        int card = -1;
+        uint16_t ports = 0;
+    };
+    std::unique_ptr<TrackOwner[]> owners_;
+
+    // persistence thread: the current take, with one writer per track opened on its first event
+    std::chrono::milliseconds split_after_;
+    PerformanceState performance_{kMaxTracks};
+    LiveAnalytics analytics_;
+    std::chrono::steady_clock::time_point time_last_analytics_{};
+    bool take_open_{false};
+    int64_t take_origin_tick_{0};
+    int64_t take_last_tick_{0};
+    // the capture clock runs at the time base's tempo; the take's .mid files follow the beat
+    // tracker unless follow_tempo(false)
+    TimeBase time_base_;
+    bool follow_tempo_enabled_{true};
+    BeatTracker beat_tracker_;
+    TempoMap tempo_map_{time_base_.bpm(), time_base_.bpm()};
+    // (file tick, bpm) of every tempo of the take, for tracks that join it late
+    std::vector<std::pair<int64_t, double>> take_tempo_;
+    std::string take_stamp_;
+    std::string last_take_stamp_;
+    int take_seq_{0};
+    std::chrono::system_clock::time_point take_started_{};
+    std::chrono::steady_clock::time_point last_activity_{};
+    std::vector<TakeInfo> take_info_;
+    std::vector<std::unique_ptr<SmfWriter>> writers_;
+    bool archive_{false};
+    std::vector<std::unique_ptr<ArchiveWriter>> archives_;
+    std::vector<std::shared_ptr<RollPyramid>> rolls_;
+    RollStore *roll_store_{nullptr};
+    std::vector<bool> writer_failed_;
     std::chrono::steady_clock::time_point time_last_saved_{std::chrono::steady_clock::now()};
+    std::chrono::steady_clock::time_point time_last_realtime_report_{
+        std::chrono::steady_clock::now()};
+    int64_t worst_wakeup_ever_ns_{0};
+
+    TakeFinalizer finalizer_{metrics_.finalize_duration, metrics_.takes_finalized};
 };
 
 } // namespace pr::midi
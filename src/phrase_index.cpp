@@ -0,0 +1,522 @@
+#include "phrase_index.hpp"
+#include "file_io.hpp"
+#include "json_escape.hpp"
+#include "smf_reader.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_set>
+
+#include <spdlog/spdlog.h>
+
+namespace pr::midi {
+
+// journal records: [u8 kind][name], and for an upsert the file's size, mtime and melody
+static constexpr char kMagic[8] = {'P', 'R', 'P', 'H', 'R', '0', '1', '\n'};
+static constexpr uint8_t kUpsert = 1;
+static constexpr uint8_t kRemove = 2;
+
+static size_t interval_code(int interval) {
+    return static_cast<size_t>(
+        std::clamp(interval, -PhraseIndex::kMaxInterval, PhraseIndex::kMaxInterval) +
+        PhraseIndex::kMaxInterval);
+}
+
+static int interval_at(const std::vector<MelodyNote> &melody, size_t i) {
+    return melody[i + 1].pitch - melody[i].pitch;
+}
+
+std::optional<std::vector<MelodyNote>> read_melody(const std::filesystem::path &path) {
+    std::vector<MelodyNote> notes;
+    try {
+        const SmfReader reader(path);
+        const SmfTempoMap tempo(reader);
+        for (const SmfTrack &track : reader.tracks()) {
+            for (const SmfEvent &ev : track) {
+                if (ev.is_note_on()) {
+                    notes.push_back(MelodyNote{
+                        .onset_ms =
+                            static_cast<uint32_t>(std::llround(tempo.seconds(ev.tick) * 1000.0)),
+                        .pitch = ev.data[0]});
+                }
+            }
+        }
+    } catch (const std::exception &) {
+        return std::nullopt;
+    }
+    std::stable_sort(notes.begin(), notes.end(),
+        [](const MelodyNote &a, const MelodyNote &b) { return a.onset_ms < b.onset_ms; });
+
+    // the top note of each chord carries the tune more often than not
+    std::vector<MelodyNote> melody;
+    for (const MelodyNote &note : notes) {
+        if (!melody.empty() && note.onset_ms - melody.back().onset_ms <= PhraseIndex::kChordMs) {
+            melody.back().pitch = std::max(melody.back().pitch, note.pitch);
+        } else {
+            melody.push_back(note);
+        }
+    }
+    return melody;
+}
+
+PhraseIndex::PhraseIndex(std::filesystem::path dir)
+    : dir_(std::move(dir)), postings_(kGrams), journal_("Phrases", kMagic) {
+    load_();
+}
+
+static RecordWriter encode_upsert(const std::string &name, uint64_t size, int64_t mtime_ns,
+    const std::vector<MelodyNote> &melody) {
+    RecordWriter w;
+    w.put(kUpsert);
+    w.put_str(name);
+    w.put(size);
+    w.put(mtime_ns);
+    w.put(static_cast<uint32_t>(melody.size()));
+    for (const MelodyNote &note : melody) {
+        w.put(note.onset_ms);
+        w.put(note.pitch);
+    }
+    return w;
+}
+
+static RecordWriter encode_removal(const std::string &name) {
+    RecordWriter w;
+    w.put(kRemove);
+    w.put_str(name);
+    return w;
+}
+
+void PhraseIndex::load_(void) {
+    journal_.open(dir_ / kIndexName, [this](RecordReader &r) {
+        uint8_t kind = 0;
+        IndexedFile file;
+        if (!r.get(kind) || !r.get_str(file.name)) {
+            return false;
+        }
+        if (kind != kUpsert) {
+            (void)erase_(file.name);
+            return true;
+        }
+
+        uint32_t count = 0;
+        if (!r.get(file.size) || !r.get(file.mtime_ns) || !r.get(count)) {
+            return false;
+        }
+        file.melody.resize(count);
+        for (MelodyNote &note : file.melody) {
+            if (!r.get(note.onset_ms) || !r.get(note.pitch)) {
+                return false;
+            }
+        }
+        insert_(std::move(file));
+        return true;
+    });
+
+    rebuild_postings_();
+    if (journal_.bloated(by_name_.size())) {
+        compact_();
+    }
+    spdlog::info("Phrases: {} recordings indexed in {}", files_.size(), dir_.string());
+}
+
+void PhraseIndex::compact_(void) {
+    std::vector<RecordWriter> records;
+    records.reserve(by_name_.size());
+    for (const IndexedFile &file : files_) {
+        if (file.live) {
+            records.push_back(encode_upsert(file.name, file.size, file.mtime_ns, file.melody));
+        }
+    }
+    journal_.rewrite(records);
+}
+
+void PhraseIndex::append_(const RecordWriter &record) {
+    if (journal_.append(record) && journal_.bloated(by_name_.size())) {
+        compact_();
+    }
+}
+
+void PhraseIndex::insert_(IndexedFile file) {
+    (void)erase_(file.name);
+
+    const auto id = static_cast<uint32_t>(files_.size());
+    by_name_[file.name] = id;
+    const std::vector<MelodyNote> &melody = files_.emplace_back(std::move(file)).melody;
+    for (size_t i = 0; i + kGramIntervals < melody.size(); i++) {
+        const size_t gram = (interval_code(interval_at(melody, i)) * kIntervalCodes +
+                                interval_code(interval_at(melody, i + 1))) *
+                kIntervalCodes +
+            interval_code(interval_at(melody, i + 2));
+        postings_[gram].push_back(Posting{.file = id, .note = static_cast<uint32_t>(i)});
+    }
+}
+
+bool PhraseIndex::erase_(const std::string &name) {
+    auto found = by_name_.find(name);
+    if (found == by_name_.end()) {
+        return false;
+    }
+
+    // its postings are skipped until the next rebuild drops them
+    IndexedFile &file = files_[found->second];
+    file.live = false;
+    file.melody = {};
+    by_name_.erase(found);
+    if (++dead_files_ > files_.size() / 2 + 16) {
+        rebuild_postings_();
+    }
+    return true;
+}
+
+void PhraseIndex::rebuild_postings_(void) {
+    std::vector<IndexedFile> files = std::move(files_);
+    files_.clear();
+    by_name_.clear();
+    dead_files_ = 0;
+    for (std::vector<Posting> &list : postings_) {
+        list.clear();
+    }
+
+    for (IndexedFile &file : files) {
+        if (file.live) {
+            insert_(std::move(file));
+        }
+    }
+}
+
+void PhraseIndex::sync(unsigned threads) {
+    const auto start = std::chrono::steady_clock::now();
+
+    struct Stale {
+        std::filesystem::path path;
+        uint64_t size;
+        int64_t mtime_ns;
+    };
+    std::vector<Stale> stale;
+    std::vector<std::string> missing;
+    {
+        std::shared_lock lock(mutex_);
+        std::unordered_set<std::string> seen;
+
+        std::error_code ec;
+        for (const auto &dirent : std::filesystem::directory_iterator(dir_, ec)) {
+            const std::filesystem::path &path = dirent.path();
+            uint64_t size = 0;
+            int64_t mtime_ns = 0;
+            if (path.extension() != ".mid" || !stat_file(path, size, mtime_ns)) {
+                continue;
+            }
+
+            const std::string name = path.filename().string();
+            seen.insert(name);
+            auto found = by_name_.find(name);
+            if (found == by_name_.end() || files_[found->second].size != size ||
+                files_[found->second].mtime_ns != mtime_ns) {
+                stale.push_back(Stale{.path = path, .size = size, .mtime_ns = mtime_ns});
+            }
+        }
+
+        for (const auto &[name, id] : by_name_) {
+            if (!seen.contains(name)) {
+                missing.push_back(name);
+            }
+        }
+    }
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned>(std::min<size_t>(threads, stale.size()));
+
+    std::vector<std::optional<std::vector<MelodyNote>>> melodies(stale.size());
+    std::atomic<size_t> next{0};
+    const auto worker = [&]() {
+        for (size_t i = next++; i < stale.size(); i = next++) {
+            melodies[i] = read_melody(stale[i].path);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : pool) {
+        t.join();
+    }
+
+    std::unique_lock lock(mutex_);
+    for (const std::string &name : missing) {
+        if (erase_(name)) {
+            append_(encode_removal(name));
+        }
+    }
+    size_t indexed = 0;
+    for (size_t i = 0; i < stale.size(); i++) {
+        if (!melodies[i]) {
+            spdlog::warn("Phrases: could not parse {}", stale[i].path.string());
+            continue;
+        }
+        IndexedFile file{.name = stale[i].path.filename().string(),
+            .size = stale[i].size,
+            .mtime_ns = stale[i].mtime_ns,
+            .melody = std::move(*melodies[i])};
+        append_(encode_upsert(file.name, file.size, file.mtime_ns, file.melody));
+        insert_(std::move(file));
+        indexed++;
+    }
+
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    spdlog::info("Phrases: synced {} recordings ({} indexed, {} gone) in {:.1f}ms",
+        by_name_.size(), indexed, missing.size(), elapsed.count());
+}
+
+void PhraseIndex::add(const std::filesystem::path &file) {
+    const std::filesystem::path path = dir_ / file.filename();
+    const std::string name = path.filename().string();
+
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    if (path.extension() != ".mid" || !stat_file(path, size, mtime_ns)) {
+        return;
+    }
+    {
+        std::shared_lock lock(mutex_);
+        auto found = by_name_.find(name);
+        if (found != by_name_.end() && files_[found->second].size == size &&
+            files_[found->second].mtime_ns == mtime_ns) {
+            return;
+        }
+    }
+
+    std::optional<std::vector<MelodyNote>> melody = read_melody(path);
+    if (!melody) {
+        spdlog::warn("Phrases: could not parse {}", path.string());
+        return;
+    }
+
+    IndexedFile indexed{
+        .name = name, .size = size, .mtime_ns = mtime_ns, .melody = std::move(*melody)};
+    std::unique_lock lock(mutex_);
+    append_(encode_upsert(indexed.name, indexed.size, indexed.mtime_ns, indexed.melody));
+    insert_(std::move(indexed));
+}
+
+std::vector<PhraseMatch> PhraseIndex::search(const PhraseQuery &query) const {
+    const size_t notes = query.pitches.size();
+    if (notes < kGramIntervals + 1) {
+        throw std::invalid_argument(
+            fmt::format("a phrase needs at least {} notes", kGramIntervals + 1));
+    }
+    if (!query.rhythm.empty() && query.rhythm.size() != notes - 1) {
+        throw std::invalid_argument("the rhythm needs one duration per note but the last");
+    }
+
+    std::vector<int> intervals(notes - 1);
+    for (size_t i = 0; i + 1 < notes; i++) {
+        intervals[i] = query.pitches[i + 1] - query.pitches[i];
+    }
+
+    // a wrong interval breaks at most kGramIntervals grams, so a match with at most `mismatches`
+    // of them still has one of any mismatches * kGramIntervals + 1 grams intact. A query too short
+    // for that has no gram every match must share, and is checked at every note instead.
+    const size_t grams = intervals.size() - kGramIntervals + 1;
+    const size_t mismatches = std::min(query.mismatches, intervals.size());
+    const size_t seeds = mismatches * kGramIntervals + 1;
+    const bool seeded = seeds <= grams;
+
+    // rhythm as each gap's share of the whole phrase
+    std::vector<double> rhythm;
+    if (!query.rhythm.empty()) {
+        double total = 0.0;
+        for (double gap : query.rhythm) {
+            total += gap;
+        }
+        for (double gap : query.rhythm) {
+            rhythm.push_back(total > 0.0 ? gap / total : 0.0);
+        }
+    }
+
+    std::shared_lock lock(mutex_);
+
+    std::vector<PhraseMatch> matches;
+    const auto check = [&](const IndexedFile &file, uint32_t first) {
+        if (first + notes > file.melody.size()) {
+            return;
+        }
+
+        size_t wrong = 0;
+        for (size_t i = 0; i < intervals.size() && wrong <= mismatches; i++) {
+            wrong += interval_at(file.melody, first + i) != intervals[i];
+        }
+        if (wrong > mismatches) {
+            return;
+        }
+
+        double score = 1.0 - static_cast<double>(wrong) / static_cast<double>(intervals.size());
+        if (!rhythm.empty()) {
+            const double played = file.melody[first + notes - 1].onset_ms -
+                static_cast<double>(file.melody[first].onset_ms);
+            // one minus the total variation distance between the two rhythms
+            double distance = 0.0;
+            for (size_t i = 0; i < rhythm.size(); i++) {
+                const double gap = file.melody[first + i + 1].onset_ms -
+                    static_cast<double>(file.melody[first + i].onset_ms);
+                distance += std::abs((played > 0.0 ? gap / played : 0.0) - rhythm[i]);
+            }
+            score *= 1.0 - 0.5 * distance;
+        }
+
+        matches.push_back(PhraseMatch{.file = file.name,
+            .note = first,
+            .onset_ms = file.melody[first].onset_ms,
+            .transpose = file.melody[first].pitch - query.pitches[0],
+            .mismatches = wrong,
+            .score = score});
+    };
+
+    if (seeded) {
+        std::vector<std::pair<size_t, size_t>> by_rarity;
+        for (size_t g = 0; g < grams; g++) {
+            const size_t gram = (interval_code(intervals[g]) * kIntervalCodes +
+                                    interval_code(intervals[g + 1])) *
+                    kIntervalCodes +
+                interval_code(intervals[g + 2]);
+            by_rarity.emplace_back(gram, g);
+        }
+        std::sort(by_rarity.begin(), by_rarity.end(), [&](const auto &a, const auto &b) {
+            return postings_[a.first].size() < postings_[b.first].size();
+        });
+
+        std::unordered_set<uint64_t> candidates;
+        for (size_t s = 0; s < seeds; s++) {
+            const auto &[gram, offset] = by_rarity[s];
+            for (const Posting &posting : postings_[gram]) {
+                if (posting.note >= offset && files_[posting.file].live) {
+                    candidates.insert(uint64_t{posting.file} << 32 | (posting.note - offset));
+                }
+            }
+        }
+        for (const uint64_t candidate : candidates) {
+            check(files_[candidate >> 32], static_cast<uint32_t>(candidate));
+        }
+    } else {
+        for (const IndexedFile &file : files_) {
+            for (size_t first = 0; file.live && first + notes <= file.melody.size(); first++) {
+                check(file, static_cast<uint32_t>(first));
+            }
+        }
+    }
+
+    const auto by_rank = [](const PhraseMatch &a, const PhraseMatch &b) {
+        if (a.score != b.score) {
+            return a.score > b.score;
+        }
+        return a.file != b.file ? a.file > b.file : a.note < b.note;
+    };
+    if (matches.size() > query.limit) {
+        std::partial_sort(matches.begin(), matches.begin() + static_cast<ptrdiff_t>(query.limit),
+            matches.end(), by_rank);
+        matches.resize(query.limit);
+    } else {
+        std::sort(matches.begin(), matches.end(), by_rank);
+    }
+    return matches;
+}
+
+size_t PhraseIndex::files(void) const {
+    std::shared_lock lock(mutex_);
+    return by_name_.size();
+}
+
+static std::vector<std::string> split_list(const std::string &text) {
+    std::vector<std::string> tokens;
+    std::string token;
+    for (char c : text) {
+        if (std::isspace(static_cast<unsigned char>(c)) || c == ',') {
+            if (!token.empty()) {
+                tokens.push_back(std::move(token));
+                token.clear();
+            }
+        } else {
+            token += c;
+        }
+    }
+    if (!token.empty()) {
+        tokens.push_back(std::move(token));
+    }
+    return tokens;
+}
+
+std::vector<uint8_t> parse_pitches(const std::string &text) {
+    static constexpr int kSemitones[] = {9, 11, 0, 2, 4, 5, 7};
+
+    std::vector<uint8_t> pitches;
+    for (const std::string &token : split_list(text)) {
+        int pitch = -1;
+        size_t pos = 0;
+        const char letter = static_cast<char>(std::toupper(static_cast<unsigned char>(token[0])));
+        try {
+            if (letter >= 'A' && letter <= 'G') {
+                // scientific pitch notation, C4 = 60
+                pitch = kSemitones[letter - 'A'];
+                pos = 1;
+                while (pos < token.size() && (token[pos] == '#' || token[pos] == 'b')) {
+                    pitch += token[pos++] == '#' ? 1 : -1;
+                }
+                size_t digits = 0;
+                pitch += (std::stoi(token.substr(pos), &digits) + 1) * 12;
+                pos += digits;
+            } else {
+                pitch = std::stoi(token, &pos);
+            }
+        } catch (const std::exception &) {
+            pos = 0;
+        }
+
+        if (pos != token.size() || pitch < 0 || pitch > 127) {
+            throw std::invalid_argument("not a note: " + token);
+        }
+        pitches.push_back(static_cast<uint8_t>(pitch));
+    }
+    return pitches;
+}
+
+std::vector<double> parse_rhythm(const std::string &text) {
+    std::vector<double> rhythm;
+    for (const std::string &token : split_list(text)) {
+        size_t pos = 0;
+        double gap = 0.0;
+        try {
+            gap = std::stod(token, &pos);
+        } catch (const std::exception &) {
+            pos = 0;
+        }
+        if (pos != token.size() || !(gap > 0.0)) {
+            throw std::invalid_argument("not a duration: " + token);
+        }
+        rhythm.push_back(gap);
+    }
+    return rhythm;
+}
+
+std::string render_phrase_matches_json(const std::vector<PhraseMatch> &matches) {
+    std::string out = "[";
+    for (const PhraseMatch &match : matches) {
+        fmt::format_to(std::back_inserter(out),
+            "{}\n{{\"file\": \"{}\", \"note\": {}, \"onset_ms\": {}, \"transpose\": {}, "
+            "\"mismatches\": {}, \"score\": {:.3f}}}",
+            out.size() > 1 ? "," : "", json_escape(match.file), match.note, match.onset_ms,
+            match.transpose, match.mismatches, match.score);
+    }
+    out += "\n]\n";
+    return out;
+}
+
+} // namespace pr::midi
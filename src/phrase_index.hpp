@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "record_io.hpp"
+
+namespace pr::midi {
+
+// One note of a recording's melody: the top note of every chord, in onset order
+struct MelodyNote {
+    uint32_t onset_ms;
+    uint8_t pitch;
+};
+
+struct PhraseQuery {
+    // MIDI pitches; only the intervals between them matter
+    std::vector<uint8_t> pitches;
+    // optional time from each note to the next, in any unit; pitches.size() - 1 of them
+    std::vector<double> rhythm;
+    // intervals allowed to differ from the query; one wrong note changes two
+    size_t mismatches = 2;
+    size_t limit = 50;
+};
+
+struct PhraseMatch {
+    std::string file;
+    // index into the file's melody, and where that note starts
+    uint32_t note;
+    uint32_t onset_ms;
+    // semitones from the query to what was played
+    int transpose;
+    size_t mismatches;
+    // 1 for the exact intervals (and rhythm, if the query had one)
+    double score;
+};
+
+// Inverted index of the melodies of every .mid in one directory, for finding a phrase wherever it
+// was played in whatever key.
+//
+// A melody is indexed by every run of kGramIntervals consecutive pitch intervals, which fits in a
+// key small enough to index the posting lists directly. A query looks up the rarest of its own
+// grams, enough of them that a match with the allowed number of wrong notes must hit at least
+// one, and checks each candidate against the melody itself, so ranking never rests on the grams.
+//
+// Melodies are kept in a journal ("phrases.idx") like the catalog's, replayed on load; the posting
+// lists are rebuilt from them in memory.
+class PhraseIndex {
+public:
+    static constexpr const char *kIndexName = "phrases.idx";
+    static constexpr size_t kGramIntervals = 3;
+    static constexpr int kMaxInterval = 24;
+    // onsets this close together are one chord
+    static constexpr uint32_t kChordMs = 30;
+
+    explicit PhraseIndex(std::filesystem::path dir);
+
+    PhraseIndex(const PhraseIndex &) = delete;
+    PhraseIndex &operator=(const PhraseIndex &) = delete;
+
+    // indexes new or changed recordings and forgets deleted ones; threads = 0 uses every core
+    void sync(unsigned threads = 0);
+    // (re)indexes one file
+    void add(const std::filesystem::path &file);
+
+    // best matches first; throws std::invalid_argument if the query is too short
+    std::vector<PhraseMatch> search(const PhraseQuery &query) const;
+
+    size_t files(void) const;
+
+private:
+    static constexpr size_t kIntervalCodes = 2 * kMaxInterval + 1;
+    static constexpr size_t kGrams = kIntervalCodes * kIntervalCodes * kIntervalCodes;
+
+    struct Posting {
+        uint32_t file;
+        uint32_t note;
+    };
+
+    struct IndexedFile {
+        std::string name;
+        uint64_t size = 0;
+        int64_t mtime_ns = 0;
+        std::vector<MelodyNote> melody;
+        bool live = true;
+    };
+
+    void load_(void);
+    void compact_(void);
+    void append_(const RecordWriter &record);
+    void insert_(IndexedFile file);
+    bool erase_(const std::string &name);
+    void rebuild_postings_(void);
+
+private:
+    std::filesystem::path dir_;
+
+    mutable std::shared_mutex mutex_;
+    // ids are positions; replaced and removed files stay behind as dead entries until a rebuild
+    std::vector<IndexedFile> files_;
+    std::unordered_map<std::string, uint32_t> by_name_;
+    size_t dead_files_{0};
+    std::vector<std::vector<Posting>> postings_;
+    Journal journal_;
+};
+
+// Reads the melody of a .mid; nullopt if it can't be parsed
+std::optional<std::vector<MelodyNote>> read_melody(const std::filesystem::path &path);
+
+// "60 62 64", "60,62,64" or note names such as "C4 D4 E4" / "Eb3 F#3";
+// throws std::invalid_argument
+std::vector<uint8_t> parse_pitches(const std::string &text);
+std::vector<double> parse_rhythm(const std::string &text);
+
+// JSON array of matches, as served by /search
+std::string render_phrase_matches_json(const std::vector<PhraseMatch> &matches);
+
+} // namespace pr::midi
@@ -0,0 +1,127 @@
+#include "realtime.hpp"
+
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include <spdlog/spdlog.h>
+
+namespace pr::midi {
+
+static std::string soft_limit(int resource, uint64_t unit) {
+    rlimit limit{};
+    if (getrlimit(resource, &limit) != 0) {
+        return "unknown";
+    }
+    return limit.rlim_cur == RLIM_INFINITY ? "unlimited" : std::to_string(limit.rlim_cur / unit);
+}
+
+// CAP_IPC_LOCK or an unlimited memlock limit; otherwise every later mapping (a thread stack, say)
+// would count against the limit in full under MCL_FUTURE, and thread creation would start failing
+static bool unbounded_lock(void) {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur == RLIM_INFINITY) {
+        return true;
+    }
+
+    std::ifstream status("/proc/self/status");
+    for (std::string line; std::getline(status, line);) {
+        if (line.rfind("CapEff:", 0) == 0) {
+            constexpr unsigned kCapIpcLock = 14;
+            return (std::stoull(line.substr(7), nullptr, 16) >> kCapIpcLock) & 1;
+        }
+    }
+    return false;
+}
+
+bool lock_memory(void) {
+    // freed memory stays mapped, and big blocks come from the (locked) heap instead of fresh mmaps
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+
+    int flags = MCL_CURRENT;
+#ifdef MCL_ONFAULT
+    if (unbounded_lock()) {
+        flags |= MCL_FUTURE | MCL_ONFAULT;
+    }
+#endif
+    if (mlockall(flags) == 0) {
+        spdlog::info("Realtime: memory locked{}",
+            flags & MCL_FUTURE ? "" : " (only what is mapped now; memlock limit is bounded)");
+        return true;
+    }
+
+    spdlog::warn("Realtime: mlockall failed ({}) - needs CAP_IPC_LOCK or a higher memlock limit "
+                 "(currently {} KiB; `ulimit -l`, LimitMEMLOCK= under systemd); pages can still be "
+                 "swapped out",
+        std::strerror(errno), soft_limit(RLIMIT_MEMLOCK, 1024));
+    return false;
+}
+
+bool make_thread_realtime(const RealtimeConfig &config) {
+    bool ok = true;
+
+    const int priority = std::clamp(
+        config.priority, sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+    const sched_param param{.sched_priority = priority};
+    if (const int rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param); rc != 0) {
+        spdlog::warn("Realtime: could not switch the capture thread to SCHED_FIFO {} ({}) - needs "
+                     "CAP_SYS_NICE or an rtprio limit of at least {} (currently {}; LimitRTPRIO= "
+                     "under systemd or rtprio in /etc/security/limits.conf)",
+            priority, std::strerror(rc), priority, soft_limit(RLIMIT_RTPRIO, 1));
+        ok = false;
+    } else {
+        spdlog::info("Realtime: capture thread running at SCHED_FIFO {}", priority);
+    }
+
+    if (config.cpu >= 0) {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        (void)sched_getaffinity(0, sizeof(allowed), &allowed);
+
+        const auto cpu = static_cast<size_t>(config.cpu);
+        if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) {
+            spdlog::warn("Realtime: CPU {} is not available to this process ({} allowed)",
+                config.cpu, CPU_COUNT(&allowed));
+            return false;
+        }
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (const int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set); rc != 0) {
+            spdlog::warn("Realtime: could not pin the capture thread to CPU {} ({})", config.cpu,
+                std::strerror(rc));
+            ok = false;
+        } else {
+            spdlog::info("Realtime: capture thread pinned to CPU {}", config.cpu);
+        }
+    }
+
+    return ok;
+}
+
+__attribute__((noinline)) void prefault_stack(size_t bytes) {
+    constexpr size_t kMaxBytes = 512 * 1024;
+    volatile unsigned char stack[kMaxBytes];
+
+    // the stack grows down, so start at the end next to the caller's frame
+    const auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    for (size_t i = kMaxBytes - std::min(bytes, kMaxBytes); i < kMaxBytes; i += page) {
+        stack[i] = 0;
+    }
+    // in case it was created after mlockall(MCL_CURRENT); failure was reported by lock_memory
+    const size_t locked = std::min(bytes, kMaxBytes);
+    (void)mlock(const_cast<unsigned char *>(stack) + kMaxBytes - locked, locked);
+}
+
+} // namespace pr::midi
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+
+namespace pr::midi {
+
+struct RealtimeConfig {
+    // SCHED_FIFO priority of the capture thread
+    int priority = 80;
+    // core to pin it to, or -1 to leave it where the scheduler puts it
+    int cpu = -1;
+};
+
+// Locks the process's memory with mlockall() and stops malloc from handing memory back to the
+// kernel. Later mappings are only locked too (as they are first touched, so the HTTP pool's stacks
+// don't pin megabytes each) when the memlock limit is unbounded; otherwise call this once the
+// buffers that matter exist. Logs what is missing and returns false if it can't.
+bool lock_memory(void);
+
+// Moves the calling thread to SCHED_FIFO and pins it, logging which privilege is missing for any
+// step that fails. Returns true if everything asked for was applied.
+bool make_thread_realtime(const RealtimeConfig &config);
+
+// Touches and locks the next bytes of the calling thread's stack so later calls don't page-fault
+void prefault_stack(size_t bytes);
+
+} // namespace pr::midi
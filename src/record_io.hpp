@@ -0,0 +1,106 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace pr::midi {
+
+// Byte order: the files of our own formats (journals, sidecars, summaries, archives, trace dumps)
+// hold plain values as they are in memory, in host byte order, and are read back by the machine
+// that wrote them. A .mid is big-endian as the standard asks; .wav is little-endian, and only
+// written on little-endian hosts.
+
+// Builds one journal record of plain values and length-prefixed strings, host byte order
+class RecordWriter {
+public:
+    template <class T>
+    void put(T value) {
+        const auto *p = reinterpret_cast<const uint8_t *>(&value);
+        bytes_.insert(bytes_.end(), p, p + sizeof(T));
+    }
+
+    void put_str(const std::string &s) {
+        const auto len = static_cast<uint16_t>(std::min<size_t>(s.size(), UINT16_MAX));
+        put(len);
+        bytes_.insert(bytes_.end(), s.begin(), s.begin() + len);
+    }
+
+    const std::vector<uint8_t> &bytes(void) const noexcept {
+        return bytes_;
+    }
+
+private:
+    std::vector<uint8_t> bytes_;
+};
+
+// Reads back what RecordWriter wrote; every get fails once the record runs out
+class RecordReader {
+public:
+    RecordReader(const uint8_t *data, size_t len) : data_(data), len_(len) {}
+
+    template <class T>
+    bool get(T &value) {
+        if (len_ - pos_ < sizeof(T)) {
+            return false;
+        }
+        std::memcpy(&value, data_ + pos_, sizeof(T));
+        pos_ += sizeof(T);
+        return true;
+    }
+
+    bool get_str(std::string &s) {
+        uint16_t len = 0;
+        if (!get(len) || len_ - pos_ < len) {
+            return false;
+        }
+        s.assign(reinterpret_cast<const char *>(data_ + pos_), len);
+        pos_ += len;
+        return true;
+    }
+
+private:
+    const uint8_t *data_;
+    size_t len_;
+    size_t pos_{0};
+};
+
+// An append-only file of records after an 8-byte magic, each [u32 payload length][payload], host
+// byte order. What it holds can always be rebuilt from the recordings, so appends are not synced.
+// The owner serializes access.
+class Journal {
+public:
+    // log_name prefixes the warnings ("Catalog: ...")
+    Journal(const char *log_name, const char (&magic)[8]);
+    ~Journal(void);
+
+    Journal(const Journal &) = delete;
+    Journal &operator=(const Journal &) = delete;
+
+    // opens path, creating it, and replays every record through apply, which returns false for one
+    // it can't read; that record, or one cut short by a crash, ends the journal. A file without
+    // the magic is started over. Throws std::runtime_error if path can't be opened.
+    void open(const std::filesystem::path &path, const std::function<bool(RecordReader &)> &apply);
+    // false, with a warning, if the record couldn't be written
+    bool append(const RecordWriter &record);
+    // true once the journal holds more than twice the `live` records it would after a rewrite
+    bool bloated(size_t live) const noexcept {
+        return records_ > 2 * live + 64;
+    }
+    // replaces the journal with just these records, through a synced copy
+    void rewrite(const std::vector<RecordWriter> &records);
+
+private:
+    std::string log_name_;
+    std::string magic_;
+    std::filesystem::path path_;
+    int fd_{-1};
+    size_t records_{0};
+};
+
+} // namespace pr::midi
@@ -0,0 +1,79 @@
+#include "replay_source.hpp"
+#include "smf_reader.hpp"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace pr::midi {
+
+static constexpr auto kTimerPeriod = std::chrono::milliseconds(1);
+
+std::vector<TimedMidi> read_timed_midi(const std::filesystem::path &path, double speed) {
+    if (speed <= 0.0) {
+        throw std::runtime_error("replay speed must be positive");
+    }
+
+    std::vector<TimedMidi> events;
+    const SmfReader reader(path);
+    const SmfTempoMap tempo(reader);
+
+    for (size_t track = 0; track < reader.tracks().size() && track < 256; track++) {
+        for (const SmfEvent &ev : reader.tracks()[track]) {
+            // only channel messages, which is all the recorder captures anyway
+            if (!ev.is_channel()) {
+                continue;
+            }
+
+            events.push_back(TimedMidi{
+                .due = std::chrono::nanoseconds(std::llround(tempo.seconds(ev.tick) * 1e9 / speed)),
+                .track = static_cast<uint8_t>(track),
+                .midi = SeqMidi{.len = static_cast<uint8_t>(ev.data_len + 1),
+                    .bytes = {ev.status, ev.data[0], ev.data[1]}},
+            });
+        }
+    }
+
+    std::stable_sort(events.begin(), events.end(),
+        [](const TimedMidi &a, const TimedMidi &b) { return a.due < b.due; });
+    return events;
+}
+
+ReplaySource::ReplaySource(const std::filesystem::path &path, double speed)
+    : name_(path.filename().string()), timer_(kTimerPeriod),
+      events_(read_timed_midi(path, speed)) {
+    spdlog::info("Replaying {} events from {} at {}x", events_.size(), path.string(), speed);
+    start_ = std::chrono::steady_clock::now();
+}
+
+void ReplaySource::expand_midi_port(MidiPortHandle &handle) {
+    handle.client_name = "Replay " + name_;
+    handle.port_name = fmt::format("Track {}", handle.port_id);
+    handle.type = SND_SEQ_PORT_TYPE_SOFTWARE;
+}
+
+size_t ReplaySource::drain(std::span<SeqEvent> out) {
+    timer_.acknowledge();
+
+    const std::chrono::nanoseconds now = std::chrono::steady_clock::now() - start_;
+
+    size_t cursor = cursor_.load(std::memory_order_relaxed);
+    size_t n = 0;
+    while (n < out.size() && cursor < events_.size() && events_[cursor].due <= now) {
+        const TimedMidi &replay = events_[cursor++];
+
+        SeqEvent &ev = out[n++];
+        ev.type = SeqEventType::MIDI;
+        ev.source = snd_seq_addr_t{.client = kVirtualClient, .port = replay.track};
+        ev.stamped = true;
+        ev.stamp = replay.due;
+        ev.data.midi = replay.midi;
+    }
+    cursor_.store(cursor, std::memory_order_release);
+
+    return n;
+}
+
+} // namespace pr::midi
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "event_source.hpp"
+
+namespace pr::midi {
+
+// A channel message of a .mid and when it is due, from the start of the file
+struct TimedMidi {
+    std::chrono::nanoseconds due;
+    uint8_t track;
+    SeqMidi midi;
+};
+
+// The channel messages of every track (up to 256) of a .mid in time order, with the times divided
+// by speed; throws std::runtime_error if the file can't be read
+std::vector<TimedMidi> read_timed_midi(const std::filesystem::path &path, double speed);
+
+// Streams the channel messages of an existing .mid file back at real time, or speed times faster.
+// Every track of the file appears as its own port, so a multi-track file replays into one
+// recorder track per original track.
+class ReplaySource : public EventSource {
+public:
+    ReplaySource(const std::filesystem::path &path, double speed);
+
+    std::vector<struct pollfd> get_poll_desc(void) override {
+        return {timer_.poll_desc()};
+    }
+
+    size_t drain(std::span<SeqEvent> out) override;
+
+    std::optional<std::chrono::nanoseconds> queue_time(void) override {
+        return std::chrono::steady_clock::now() - start_;
+    }
+
+    void expand_midi_port(MidiPortHandle &handle) override;
+
+    // safe to call from any thread
+    bool finished(void) const override {
+        return cursor_.load(std::memory_order_acquire) == events_.size();
+    }
+
+    uint64_t generated(void) const noexcept {
+        return cursor_.load(std::memory_order_acquire);
+    }
+
+    size_t size(void) const noexcept {
+        return events_.size();
+    }
+
+private:
+    std::string name_;
+    TimerFd timer_;
+    std::vector<TimedMidi> events_;
+    // advanced by the capture thread only
+    std::atomic<size_t> cursor_{0};
+    std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace pr::midi
@@ -0,0 +1,302 @@
+#include "roll_pyramid.hpp"
+#include "file_io.hpp"
+#include "smf_reader.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+
+#include <spdlog/spdlog.h>
+
+namespace pr::midi {
+
+// file: magic, u32 base bin ms, u32 tile bins, u32 duration ms, u32 level count, then every level
+// as u64 bin count + bins, then u64 note count + notes; host byte order
+static constexpr char kMagic[8] = {'P', 'R', 'R', 'O', 'L', 'L', '0', '1'};
+// 2^32 ms in kBaseBinMs bins halves down to one tile in 19 levels; anything past this is damage
+static constexpr uint32_t kMaxLevels = 32;
+
+static void merge_bin(RollBin &into, const RollBin &from) {
+    into.onsets += from.onsets;
+    into.max_velocity = std::max(into.max_velocity, from.max_velocity);
+    into.occupancy[0] |= from.occupancy[0];
+    into.occupancy[1] |= from.occupancy[1];
+}
+
+void RollPyramid::note_on(uint32_t ms, uint8_t channel, uint8_t key, uint8_t velocity) {
+    const size_t index = size_t{channel & 0x0Fu} * 128 + (key & 0x7F);
+    if (held_on_[index] != 0) {
+        note_off(ms, channel, key);
+    }
+    held_on_[index] = ms + 1;
+    held_velocity_[index] = velocity;
+}
+
+void RollPyramid::note_off(uint32_t ms, uint8_t channel, uint8_t key) {
+    const size_t index = size_t{channel & 0x0Fu} * 128 + (key & 0x7F);
+    if (held_on_[index] == 0) {
+        return;
+    }
+
+    const uint32_t on_ms = held_on_[index] - 1;
+    held_on_[index] = 0;
+
+    std::unique_lock lock(mutex_);
+    add_note_(RollNote{
+        .on_ms = on_ms,
+        .off_ms = std::max(ms, on_ms),
+        .key = static_cast<uint8_t>(key & 0x7F),
+        .velocity = held_velocity_[index],
+        .channel = static_cast<uint8_t>(channel & 0x0F),
+        .reserved = 0,
+    });
+}
+
+void RollPyramid::finish(uint32_t ms) {
+    for (size_t index = 0; index < held_on_.size(); index++) {
+        if (held_on_[index] != 0) {
+            note_off(ms, static_cast<uint8_t>(index / 128), static_cast<uint8_t>(index % 128));
+        }
+    }
+
+    std::unique_lock lock(mutex_);
+    duration_ms_ = std::max(duration_ms_, ms);
+}
+
+void RollPyramid::add_note_(const RollNote &note) {
+    notes_.push_back(note);
+    longest_note_ms_ = std::max(longest_note_ms_, note.off_ms - note.on_ms);
+    duration_ms_ = std::max(duration_ms_, note.off_ms);
+
+    const uint64_t bit = uint64_t{1} << (note.key & 63);
+    const size_t word = note.key >> 6;
+
+    size_t first = note.on_ms / kBaseBinMs;
+    size_t last = note.off_ms / kBaseBinMs;
+    for (std::vector<RollBin> &level : levels_) {
+        if (level.size() <= last) {
+            level.resize(last + 1, RollBin{});
+        }
+
+        level[first].onsets++;
+        level[first].max_velocity = std::max<uint32_t>(level[first].max_velocity, note.velocity);
+        for (size_t b = first; b <= last; b++) {
+            level[b].occupancy[word] |= bit;
+        }
+
+        first >>= 1;
+        last >>= 1;
+    }
+
+    grow_levels_();
+}
+
+void RollPyramid::grow_levels_(void) {
+    while (levels_.back().size() > kTileBins) {
+        const std::vector<RollBin> &below = levels_.back();
+        std::vector<RollBin> above((below.size() + 1) / 2, RollBin{});
+        for (size_t b = 0; b < below.size(); b++) {
+            merge_bin(above[b / 2], below[b]);
+        }
+        levels_.push_back(std::move(above));
+    }
+}
+
+size_t RollPyramid::levels(void) const {
+    std::shared_lock lock(mutex_);
+    return levels_.size();
+}
+
+uint32_t RollPyramid::duration_ms(void) const {
+    std::shared_lock lock(mutex_);
+    return duration_ms_;
+}
+
+size_t RollPyramid::note_count(void) const {
+    std::shared_lock lock(mutex_);
+    return notes_.size();
+}
+
+size_t RollPyramid::tile_count(size_t level) const {
+    std::shared_lock lock(mutex_);
+    if (level >= levels_.size()) {
+        return 0;
+    }
+    return std::max<size_t>((levels_[level].size() + kTileBins - 1) / kTileBins, 1);
+}
+
+std::vector<RollBin> RollPyramid::tile(size_t level, size_t tile) const {
+    std::shared_lock lock(mutex_);
+    if (level >= levels_.size()) {
+        return {};
+    }
+
+    const std::vector<RollBin> &bins = levels_[level];
+    const size_t first = std::min(tile * kTileBins, bins.size());
+    const size_t last = std::min(first + kTileBins, bins.size());
+    return std::vector<RollBin>(bins.begin() + static_cast<ptrdiff_t>(first),
+        bins.begin() + static_cast<ptrdiff_t>(last));
+}
+
+std::vector<RollNote> RollPyramid::notes(uint32_t from_ms, uint32_t to_ms, size_t limit) const {
+    std::shared_lock lock(mutex_);
+
+    // sorted by end, so everything sounding in the window ended in [from, to + longest note)
+    const uint64_t scan_end = uint64_t{to_ms} + longest_note_ms_;
+    auto it = std::lower_bound(notes_.begin(), notes_.end(), from_ms,
+        [](const RollNote &n, uint32_t t) { return n.off_ms < t; });
+
+    std::vector<RollNote> out;
+    for (; it != notes_.end() && it->off_ms <= scan_end && out.size() < limit; ++it) {
+        if (it->on_ms < to_ms) {
+            out.push_back(*it);
+        }
+    }
+    return out;
+}
+
+bool RollPyramid::save(const std::filesystem::path &path) const {
+    const std::filesystem::path tmp = path.string() + ".tmp";
+    const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = true;
+    {
+        const auto put = [&](const void *data, size_t len) {
+            ok = ok && write_all(fd, data, len);
+        };
+
+        std::shared_lock lock(mutex_);
+        const uint32_t header[] = {kBaseBinMs, kTileBins, duration_ms_,
+            static_cast<uint32_t>(levels_.size())};
+        put(kMagic, sizeof(kMagic));
+        put(header, sizeof(header));
+        for (const std::vector<RollBin> &level : levels_) {
+            const uint64_t n = level.size();
+            put(&n, sizeof(n));
+            put(level.data(), n * sizeof(RollBin));
+        }
+        const uint64_t n_notes = notes_.size();
+        put(&n_notes, sizeof(n_notes));
+        put(notes_.data(), n_notes * sizeof(RollNote));
+    }
+
+    // synced before the rename, so a crash never leaves a short sidecar under the real name
+    ok = fdatasync(fd) == 0 && ok;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        (void)unlink(tmp.c_str());
+        return false;
+    }
+    sync_dir(path.parent_path());
+    return true;
+}
+
+std::unique_ptr<RollPyramid> RollPyramid::load(const std::filesystem::path &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return nullptr;
+    }
+    const std::vector<char> data{std::istreambuf_iterator<char>(in), {}};
+
+    size_t pos = 0;
+    const auto get = [&](void *out, size_t len) {
+        if (data.size() - pos < len) {
+            return false;
+        }
+        std::memcpy(out, data.data() + pos, len);
+        pos += len;
+        return true;
+    };
+
+    char magic[sizeof(kMagic)];
+    uint32_t header[4];
+    if (!get(magic, sizeof(magic)) || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0 ||
+        !get(header, sizeof(header)) || header[0] != kBaseBinMs || header[1] != kTileBins ||
+        header[3] > kMaxLevels) {
+        spdlog::warn("{} is not a piano roll index", path.string());
+        return nullptr;
+    }
+
+    auto roll = std::make_unique<RollPyramid>();
+    roll->duration_ms_ = header[2];
+    roll->levels_.assign(header[3], {});
+    for (std::vector<RollBin> &level : roll->levels_) {
+        uint64_t n = 0;
+        if (!get(&n, sizeof(n)) || n > (data.size() - pos) / sizeof(RollBin)) {
+            spdlog::warn("{} is damaged", path.string());
+            return nullptr;
+        }
+        level.resize(n);
+        (void)get(level.data(), n * sizeof(RollBin));
+    }
+
+    uint64_t n_notes = 0;
+    if (!get(&n_notes, sizeof(n_notes)) || n_notes > (data.size() - pos) / sizeof(RollNote) ||
+        n_notes * sizeof(RollNote) != data.size() - pos) {
+        spdlog::warn("{} is damaged", path.string());
+        return nullptr;
+    }
+    roll->notes_.resize(n_notes);
+    (void)get(roll->notes_.data(), n_notes * sizeof(RollNote));
+    for (const RollNote &note : roll->notes_) {
+        roll->longest_note_ms_ = std::max(roll->longest_note_ms_, note.off_ms - note.on_ms);
+    }
+
+    if (roll->levels_.empty()) {
+        roll->levels_.resize(1);
+    }
+    return roll;
+}
+
+std::unique_ptr<RollPyramid> RollPyramid::from_midi(const std::filesystem::path &path) {
+    struct Timed {
+        uint32_t ms;
+        uint8_t bytes[3];
+    };
+    std::vector<Timed> events;
+    double duration_s = 0.0;
+    try {
+        const SmfReader reader(path);
+        const SmfTempoMap tempo(reader);
+        uint64_t end_tick = 0;
+        for (const SmfTrack &track : reader.tracks()) {
+            for (const SmfEvent &ev : track) {
+                end_tick = std::max(end_tick, ev.tick);
+                if ((ev.status & 0xE0) == 0x80) {
+                    const auto ms = static_cast<uint32_t>(tempo.seconds(ev.tick) * 1000.0);
+                    events.push_back(
+                        Timed{.ms = ms, .bytes = {ev.status, ev.data[0], ev.data[1]}});
+                }
+            }
+        }
+        duration_s = tempo.seconds(end_tick);
+    } catch (const std::exception &) {
+        return nullptr;
+    }
+    std::stable_sort(events.begin(), events.end(),
+        [](const Timed &a, const Timed &b) { return a.ms < b.ms; });
+
+    auto roll = std::make_unique<RollPyramid>();
+    for (const Timed &ev : events) {
+        const auto channel = static_cast<uint8_t>(ev.bytes[0] & 0x0F);
+        if ((ev.bytes[0] & 0xF0) == 0x90 && ev.bytes[2] > 0) {
+            roll->note_on(ev.ms, channel, ev.bytes[1], ev.bytes[2]);
+        } else {
+            roll->note_off(ev.ms, channel, ev.bytes[1]);
+        }
+    }
+    roll->finish(static_cast<uint32_t>(duration_s * 1000.0));
+    return roll;
+}
+
+} // namespace pr::midi
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+namespace pr::midi {
+
+// One time bin of the piano roll: how many notes start in it and which pitches sound during it
+struct RollBin {
+    uint32_t onsets;
+    uint32_t max_velocity;
+    uint64_t occupancy[2];
+};
+
+static_assert(sizeof(RollBin) == 24);
+
+struct RollNote {
+    uint32_t on_ms;
+    uint32_t off_ms;
+    uint8_t key;
+    uint8_t velocity;
+    uint8_t channel;
+    uint8_t reserved;
+};
+
+static_assert(sizeof(RollNote) == 12);
+
+// Multi-resolution summary of one recording for zoomable piano-roll / waterfall views.
+//
+// Level 0 bins are kBaseBinMs wide and every level above halves the resolution, up to the level
+// where one tile covers the whole recording. A view asks for the level whose bins are about a
+// pixel wide and fetches only the tiles it shows, so any zoom touches O(visible pixels) of data;
+// below level 0 it asks for the notes themselves. Notes are added when they end, which updates
+// O(note length / bin width) bins summed over all levels (about twice the level-0 count).
+//
+// Written by one thread (the recorder's persistence thread or a loader), read by any number.
+class RollPyramid {
+public:
+    static constexpr uint32_t kBaseBinMs = 64;
+    static constexpr uint32_t kTileBins = 256;
+
+    void note_on(uint32_t ms, uint8_t channel, uint8_t key, uint8_t velocity);
+    void note_off(uint32_t ms, uint8_t channel, uint8_t key);
+    // ends every note still held, at the end of the recording
+    void finish(uint32_t ms);
+
+    size_t levels(void) const;
+    uint32_t duration_ms(void) const;
+    size_t note_count(void) const;
+
+    // tiles in a level, at least 1 (empty for an empty recording); 0 if there is no such level
+    size_t tile_count(size_t level) const;
+    // bins [tile * kTileBins, (tile + 1) * kTileBins) of a level, cut short at the end
+    std::vector<RollBin> tile(size_t level, size_t tile) const;
+    // notes sounding anywhere in [from_ms, to_ms), at most limit of them
+    std::vector<RollNote> notes(uint32_t from_ms, uint32_t to_ms, size_t limit) const;
+
+    bool save(const std::filesystem::path &path) const;
+    static std::unique_ptr<RollPyramid> load(const std::filesystem::path &path);
+    // for recordings made without one
+    static std::unique_ptr<RollPyramid> from_midi(const std::filesystem::path &path);
+
+private:
+    void add_note_(const RollNote &note);
+    void grow_levels_(void);
+
+private:
+    mutable std::shared_mutex mutex_;
+    std::vector<std::vector<RollBin>> levels_{1};
+    // in the order they ended
+    std::vector<RollNote> notes_;
+    uint32_t longest_note_ms_{0};
+    uint32_t duration_ms_{0};
+
+    // writer only: start time + 1 and velocity of held notes, by channel * 128 + key
+    std::array<uint32_t, 16 * 128> held_on_{};
+    std::array<uint8_t, 16 * 128> held_velocity_{};
+};
+
+} // namespace pr::midi
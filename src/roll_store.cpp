@@ -0,0 +1,177 @@
+#include "roll_store.hpp"
+
+#include "http_server.hpp"
+#include "json_escape.hpp"
+
+#include <httplib.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+
+namespace pr::midi {
+
+static constexpr size_t kMaxNotes = 20000;
+
+void RollStore::publish(const std::string &file, std::shared_ptr<RollPyramid> roll) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    live_[file] = std::move(roll);
+}
+
+void RollStore::retire(const std::string &file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    live_.erase(file);
+}
+
+std::shared_ptr<RollPyramid> RollStore::get(const std::string &file) {
+    std::promise<std::shared_ptr<RollPyramid>> loaded;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (auto it = live_.find(file); it != live_.end()) {
+            return it->second;
+        }
+
+        auto it = std::find_if(
+            cache_.begin(), cache_.end(), [&](const auto &entry) { return entry.first == file; });
+        if (it != cache_.end()) {
+            auto entry = std::move(*it);
+            cache_.erase(it);
+            cache_.push_back(std::move(entry));
+            return cache_.back().second;
+        }
+
+        if (auto pending = loading_.find(file); pending != loading_.end()) {
+            const std::shared_future<std::shared_ptr<RollPyramid>> result = pending->second;
+            lock.unlock();
+            return result.get();
+        }
+        loading_.emplace(file, loaded.get_future().share());
+    }
+
+    // whatever happens, the requests waiting on this load get an answer
+    std::shared_ptr<RollPyramid> roll;
+    try {
+        roll = load_(file);
+    } catch (const std::exception &e) {
+        spdlog::warn("Could not load the piano roll of {}: {}", file, e.what());
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        loading_.erase(file);
+        if (roll) {
+            cache_.emplace_back(file, roll);
+            if (cache_.size() > kCachedRolls) {
+                cache_.pop_front();
+            }
+        }
+    }
+    loaded.set_value(roll);
+    return roll;
+}
+
+std::shared_ptr<RollPyramid> RollStore::load_(const std::string &file) const {
+    // never leave the directory
+    const std::filesystem::path path = dir_ / std::filesystem::path(file).filename();
+    if (path.filename() != file || path.extension() != ".mid") {
+        return nullptr;
+    }
+
+    const std::filesystem::path sidecar = path.string() + kSidecarSuffix;
+    std::shared_ptr<RollPyramid> roll = RollPyramid::load(sidecar);
+    if (roll) {
+        return roll;
+    }
+
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(path, ec)) {
+        return nullptr;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    if (!(roll = RollPyramid::from_midi(path))) {
+        return nullptr;
+    }
+    if (!roll->save(sidecar)) {
+        spdlog::warn("Could not write {}", sidecar.string());
+    }
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    spdlog::info("Built piano roll for {} in {:.1f}ms", file, elapsed.count());
+    return roll;
+}
+
+void RollStore::attach(httplib::Server &router) {
+    router.Get(R"(/roll/([^/]+))", [this](const httplib::Request &req, httplib::Response &res) {
+        std::shared_ptr<RollPyramid> roll = get(req.matches[1].str());
+        if (!roll) {
+            res.status = 404;
+            return;
+        }
+
+        res.set_content(fmt::format("{{\"file\": \"{}\", \"levels\": {}, \"base_bin_ms\": {}, "
+                                    "\"tile_bins\": {}, \"bin_bytes\": {}, \"duration_ms\": {}, "
+                                    "\"notes\": {}}}\n",
+                            json_escape(req.matches[1].str()), roll->levels(),
+                            RollPyramid::kBaseBinMs, RollPyramid::kTileBins, sizeof(RollBin),
+                            roll->duration_ms(), roll->note_count()),
+            "application/json");
+    });
+
+    router.Get(R"(/roll/([^/]+)/tile/(\d+)/(\d+))",
+        [this](const httplib::Request &req, httplib::Response &res) {
+            std::shared_ptr<RollPyramid> roll = get(req.matches[1].str());
+            if (!roll) {
+                res.status = 404;
+                return;
+            }
+
+            uint32_t level = 0;
+            uint32_t tile = 0;
+            if (!parse_u32(req.matches[2].str(), level) || !parse_u32(req.matches[3].str(), tile)) {
+                res.status = 400;
+                return;
+            }
+            if (level >= roll->levels() || tile >= roll->tile_count(level)) {
+                res.status = 404;
+                return;
+            }
+
+            const std::vector<RollBin> bins = roll->tile(level, tile);
+            res.set_content(std::string(reinterpret_cast<const char *>(bins.data()),
+                                bins.size() * sizeof(RollBin)),
+                "application/octet-stream");
+        });
+
+    // [on_ms, off_ms, key, velocity, channel] per note
+    router.Get(
+        R"(/roll/([^/]+)/notes)", [this](const httplib::Request &req, httplib::Response &res) {
+            std::shared_ptr<RollPyramid> roll = get(req.matches[1].str());
+            if (!roll) {
+                res.status = 404;
+                return;
+            }
+
+            const auto param = [&](const char *name, uint32_t &value) {
+                return !req.has_param(name) || parse_u32(req.get_param_value(name), value);
+            };
+
+            uint32_t from = 0;
+            uint32_t to = UINT32_MAX;
+            if (!param("from", from) || !param("to", to)) {
+                res.status = 400;
+                return;
+            }
+            const std::vector<RollNote> notes = roll->notes(from, to, kMaxNotes);
+
+            std::string out = "[";
+            for (const RollNote &n : notes) {
+                fmt::format_to(std::back_inserter(out), "{}\n[{}, {}, {}, {}, {}]",
+                    out.size() > 1 ? "," : "", n.on_ms, n.off_ms, n.key, n.velocity, n.channel);
+            }
+            out += "\n]\n";
+            res.set_content(out, "application/json");
+        });
+}
+
+} // namespace pr::midi
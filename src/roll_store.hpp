@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "roll_pyramid.hpp"
+
+namespace httplib {
+class Server;
+}
+
+namespace pr::midi {
+
+// Piano-roll pyramids of the recordings in one directory, served as tiles.
+//
+// Takes being recorded are published live by the recorder. Finished ones are read from their
+// "<take>.mid.roll" sidecar, or built from the .mid (and the sidecar written) on first request;
+// a few of those are kept in memory. Requests for a file that is being loaded wait for that load
+// instead of starting their own.
+//
+//   GET /roll/<file>                      JSON: levels, bin width, tile size, duration
+//   GET /roll/<file>/tile/<level>/<n>     raw RollBin array of one tile
+//   GET /roll/<file>/notes?from=&to=      JSON notes in a window, times in ms
+class RollStore {
+public:
+    static constexpr const char *kSidecarSuffix = ".roll";
+
+    explicit RollStore(std::filesystem::path dir) : dir_(std::move(dir)) {}
+
+    RollStore(const RollStore &) = delete;
+    RollStore &operator=(const RollStore &) = delete;
+
+    void publish(const std::string &file, std::shared_ptr<RollPyramid> roll);
+    // a take was finalized under a new name; its sidecar is already written
+    void retire(const std::string &file);
+
+    std::shared_ptr<RollPyramid> get(const std::string &file);
+
+    void attach(httplib::Server &router);
+
+private:
+    static constexpr size_t kCachedRolls = 8;
+
+    // reads or builds a finished take's roll, without the lock
+    std::shared_ptr<RollPyramid> load_(const std::string &file) const;
+
+    std::filesystem::path dir_;
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::shared_ptr<RollPyramid>> live_;
+    // most recently used last
+    std::deque<std::pair<std::string, std::shared_ptr<RollPyramid>>> cache_;
+    // being loaded by one request
+    std::unordered_map<std::string, std::shared_future<std::shared_ptr<RollPyramid>>> loading_;
+};
+
+} // namespace pr::midi
@@ -0,0 +1,183 @@
+#include "smf_reader.hpp"
+#include "file_io.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+namespace pr::midi {
+
+static constexpr size_t kChunkHeaderSize = 8;
+static constexpr size_t kHeaderChunkSize = 6;
+static constexpr uint32_t kDefaultUsecPerQuarter = 500'000;
+
+static_assert(std::forward_iterator<SmfTrack::iterator>);
+static_assert(std::sentinel_for<std::default_sentinel_t, SmfTrack::iterator>);
+
+SmfTrack::iterator::iterator(const uint8_t *begin, const uint8_t *end) noexcept
+    : pos_(begin), end_(end), done_(false) {
+    next_();
+}
+
+bool SmfTrack::iterator::read_varlen_(uint32_t &value) noexcept {
+    value = 0;
+    for (int i = 0; i < 4 && pos_ < end_; i++) {
+        const uint8_t byte = *pos_++;
+        value = value << 7 | (byte & 0x7Fu);
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void SmfTrack::iterator::next_(void) noexcept {
+    uint32_t delta = 0;
+    if (last_ || pos_ >= end_ || !read_varlen_(delta) || pos_ >= end_) {
+        done_ = true;
+        return;
+    }
+    event_.tick += delta;
+    event_.data[0] = event_.data[1] = 0;
+    event_.data_len = 0;
+    event_.meta_type = 0;
+    event_.payload = {};
+
+    if (*pos_ & 0x80) {
+        event_.status = *pos_++;
+    } else if (running_status_ != 0) {
+        event_.status = running_status_;
+    } else {
+        done_ = true;
+        return;
+    }
+
+    const uint8_t status = event_.status;
+    if (status < 0xF0) {
+        running_status_ = status;
+        event_.data_len = (status & 0xE0) == 0xC0 ? 1 : 2;
+        if (end_ - pos_ < event_.data_len) {
+            done_ = true;
+            return;
+        }
+        event_.data[0] = pos_[0];
+        event_.data[1] = event_.data_len > 1 ? pos_[1] : 0;
+        pos_ += event_.data_len;
+        return;
+    }
+
+    if (status == 0xFF) {
+        if (pos_ >= end_) {
+            done_ = true;
+            return;
+        }
+        event_.meta_type = *pos_++;
+    } else if (status != 0xF0 && status != 0xF7) {
+        done_ = true;
+        return;
+    }
+
+    uint32_t len = 0;
+    if (!read_varlen_(len) || static_cast<size_t>(end_ - pos_) < len) {
+        done_ = true;
+        return;
+    }
+    event_.payload = std::span<const uint8_t>(pos_, len);
+    pos_ += len;
+    last_ = status == 0xFF && event_.meta_type == 0x2F;
+}
+
+SmfReader::SmfReader(const std::filesystem::path &path) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw_sys("open", path);
+    }
+
+    struct stat st {};
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw_sys("stat", path);
+    }
+    const auto size = static_cast<size_t>(st.st_size);
+    if (size < kChunkHeaderSize + kHeaderChunkSize) {
+        ::close(fd);
+        throw std::runtime_error(path.string() + " is not a .mid");
+    }
+
+    const bool mapped = map_.map(fd, size);
+    ::close(fd);
+    if (!mapped) {
+        throw_sys("mmap", path);
+    }
+    const uint8_t *const data = map_.data();
+
+    if (std::memcmp(data, "MThd", 4) != 0 || be32(data + 4) < kHeaderChunkSize) {
+        throw std::runtime_error(path.string() + " is not a .mid");
+    }
+    format_ = be16(data + 8);
+    const uint16_t track_count = be16(data + 10);
+    division_ = be16(data + 12);
+
+    // a chunk that claims more than is left is read up to the end of the file; anything but MTrk
+    // is skipped, as the standard asks
+    size_t pos = kChunkHeaderSize + be32(data + 4);
+    while (tracks_.size() < track_count && pos < size && size - pos >= kChunkHeaderSize) {
+        const size_t len = std::min<size_t>(be32(data + pos + 4), size - pos - kChunkHeaderSize);
+        if (std::memcmp(data + pos, "MTrk", 4) == 0) {
+            tracks_.emplace_back(std::span<const uint8_t>(data + pos + kChunkHeaderSize, len));
+        }
+        pos += kChunkHeaderSize + len;
+    }
+}
+
+SmfTempoMap::SmfTempoMap(const SmfReader &reader) {
+    const uint16_t division = reader.division();
+    if (division & 0x8000) {
+        // SMPTE: frames per second (stored negated) times ticks per frame, whatever the tempo
+        const int fps = -static_cast<int8_t>(division >> 8);
+        const int ticks_per_frame = division & 0xFF;
+        segments_.push_back(Segment{.tick = 0,
+            .seconds = 0.0,
+            .seconds_per_tick = 1.0 / std::max(fps * ticks_per_frame, 1)});
+        return;
+    }
+
+    const double ppq = std::max<int>(division, 1);
+    segments_.push_back(
+        Segment{.tick = 0, .seconds = 0.0, .seconds_per_tick = kDefaultUsecPerQuarter / 1e6 / ppq});
+    if (reader.tracks().empty()) {
+        return;
+    }
+
+    for (const SmfEvent &ev : reader.tracks().front()) {
+        if (!ev.is_tempo()) {
+            continue;
+        }
+        const Segment &last = segments_.back();
+        const double seconds = last.seconds + static_cast<double>(ev.tick - last.tick) *
+                                                  last.seconds_per_tick;
+        const double seconds_per_tick = ev.usec_per_quarter() / 1e6 / ppq;
+        if (ev.tick == last.tick) {
+            segments_.back().seconds_per_tick = seconds_per_tick;
+        } else {
+            segments_.push_back(Segment{
+                .tick = ev.tick, .seconds = seconds, .seconds_per_tick = seconds_per_tick});
+        }
+    }
+}
+
+double SmfTempoMap::seconds(uint64_t tick) const noexcept {
+    const auto it = std::upper_bound(segments_.begin(), segments_.end(), tick,
+        [](uint64_t t, const Segment &segment) { return t < segment.tick; });
+    const Segment &segment = *std::prev(it);
+    return segment.seconds + static_cast<double>(tick - segment.tick) * segment.seconds_per_tick;
+}
+
+} // namespace pr::midi
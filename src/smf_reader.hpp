@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <iterator>
+#include <span>
+#include <vector>
+
+#include "file_io.hpp"
+
+namespace pr::midi {
+
+// One event of a track, decoded in place. Meta and sysex payloads point into the reader's mapping
+// and stay valid as long as the SmfReader does.
+struct SmfEvent {
+    // absolute, from the start of the track
+    uint64_t tick = 0;
+    // with running status resolved; 0xFF for meta events, 0xF0 / 0xF7 for sysex
+    uint8_t status = 0;
+    // channel messages only
+    uint8_t data[2] = {0, 0};
+    uint8_t data_len = 0;
+    // meta events only
+    uint8_t meta_type = 0;
+    std::span<const uint8_t> payload;
+
+    bool is_channel(void) const noexcept {
+        return status >= 0x80 && status < 0xF0;
+    }
+
+    bool is_note_on(void) const noexcept {
+        return (status & 0xF0) == 0x90 && data[1] > 0;
+    }
+
+    bool is_note_off(void) const noexcept {
+        return (status & 0xF0) == 0x80 || ((status & 0xF0) == 0x90 && data[1] == 0);
+    }
+
+    bool is_tempo(void) const noexcept {
+        return status == 0xFF && meta_type == 0x51 && payload.size() == 3;
+    }
+
+    uint32_t usec_per_quarter(void) const noexcept {
+        return uint32_t{payload[0]} << 16 | uint32_t{payload[1]} << 8 | payload[2];
+    }
+};
+
+// The events of one MTrk chunk, decoded one at a time as the iterator moves. A walk ends after the
+// end-of-track event, or where the chunk runs out or stops making sense, which is how a .mid cut
+// short by a crash reads: up to the damage.
+class SmfTrack {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = SmfEvent;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const SmfEvent *;
+        using reference = const SmfEvent &;
+
+        iterator(void) = default;
+
+        reference operator*(void) const noexcept {
+            return event_;
+        }
+        pointer operator->(void) const noexcept {
+            return &event_;
+        }
+
+        iterator &operator++(void) noexcept {
+            next_();
+            return *this;
+        }
+        iterator operator++(int) noexcept {
+            iterator before = *this;
+            next_();
+            return before;
+        }
+
+        bool operator==(const iterator &other) const noexcept {
+            return done_ == other.done_ && (done_ || pos_ == other.pos_);
+        }
+        bool operator==(std::default_sentinel_t) const noexcept {
+            return done_;
+        }
+
+    private:
+        friend class SmfTrack;
+        iterator(const uint8_t *begin, const uint8_t *end) noexcept;
+        void next_(void) noexcept;
+        bool read_varlen_(uint32_t &value) noexcept;
+
+        const uint8_t *pos_{nullptr};
+        const uint8_t *end_{nullptr};
+        uint8_t running_status_{0};
+        bool last_{false};
+        bool done_{true};
+        SmfEvent event_{};
+    };
+
+    explicit SmfTrack(std::span<const uint8_t> bytes) noexcept : bytes_(bytes) {}
+
+    iterator begin(void) const noexcept {
+        return iterator(bytes_.data(), bytes_.data() + bytes_.size());
+    }
+    std::default_sentinel_t end(void) const noexcept {
+        return {};
+    }
+
+    size_t size_bytes(void) const noexcept {
+        return bytes_.size();
+    }
+
+private:
+    std::span<const uint8_t> bytes_;
+};
+
+// Read-only, memory-mapped Standard MIDI File.
+//
+// The constructor only maps the file and finds its track chunks; events are decoded as they are
+// walked, straight out of the mapping, without allocating. Nothing changes after construction, so
+// any number of threads can walk one reader (and its tracks) at once.
+class SmfReader {
+public:
+    // throws std::runtime_error if the file can't be mapped or isn't a .mid
+    explicit SmfReader(const std::filesystem::path &path);
+
+    SmfReader(const SmfReader &) = delete;
+    SmfReader &operator=(const SmfReader &) = delete;
+
+    int format(void) const noexcept {
+        return format_;
+    }
+
+    // raw division field: ticks per quarter note, or SMPTE frames and ticks if bit 15 is set
+    uint16_t division(void) const noexcept {
+        return division_;
+    }
+
+    const std::vector<SmfTrack> &tracks(void) const noexcept {
+        return tracks_;
+    }
+
+private:
+    FileMapping map_;
+    int format_{0};
+    uint16_t division_{0};
+    std::vector<SmfTrack> tracks_;
+};
+
+// Converts the ticks of a file to seconds, following its tempo changes: those of the first track,
+// which is where format 1 keeps them and the only track there is in format 0.
+class SmfTempoMap {
+public:
+    explicit SmfTempoMap(const SmfReader &reader);
+
+    double seconds(uint64_t tick) const noexcept;
+
+private:
+    struct Segment {
+        uint64_t tick;
+        double seconds;
+        double seconds_per_tick;
+    };
+
+    std::vector<Segment> segments_;
+};
+
+} // namespace pr::midi
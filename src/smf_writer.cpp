@@ -0,0 +1,306 @@
+#include "smf_writer.hpp"
+#include "file_io.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <spdlog/spdlog.h>
+
+namespace pr::midi {
+
+static constexpr uint32_t kMaxVarlen = 0x0FFFFFFF;
+static constexpr uint8_t kEndOfTrack[] = {0x00, 0xFF, 0x2F, 0x00};
+static constexpr uint8_t kEmptyText[] = {0xFF, 0x01, 0x00};
+// output buffered by finish() between writes
+static constexpr size_t kCompactChunk = 256 * 1024;
+
+static int timed_fdatasync(int fd, std::chrono::nanoseconds &elapsed) {
+    const auto start = std::chrono::steady_clock::now();
+    int rc = fdatasync(fd);
+    elapsed += std::chrono::steady_clock::now() - start;
+    return rc;
+}
+
+static void put_varlen(std::vector<uint8_t> &out, uint32_t value) {
+    uint8_t buf[4];
+    size_t n = 0;
+
+    buf[n++] = static_cast<uint8_t>(value & 0x7F);
+    while ((value >>= 7) != 0) {
+        buf[n++] = static_cast<uint8_t>(0x80 | (value & 0x7F));
+    }
+
+    while (n > 0) {
+        out.push_back(buf[--n]);
+    }
+}
+
+static bool get_varlen(const uint8_t *&p, const uint8_t *end, uint32_t &value) {
+    value = 0;
+    for (int i = 0; i < 4 && p < end; i++) {
+        value = (value << 7) | (*p & 0x7F);
+        if ((*p++ & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// bytes of the event at p, as append() writes them: never running status; 0 if it doesn't parse
+static size_t event_size(const uint8_t *p, const uint8_t *end) {
+    const uint8_t status = *p;
+    const uint8_t *body = p + 1;
+    uint32_t len = 0;
+    size_t size = 0;
+    if (status == 0xFF) {
+        body++;
+        size = body < end && get_varlen(body, end, len) ? static_cast<size_t>(body - p) + len : 0;
+    } else if (status == 0xF0 || status == 0xF7) {
+        size = get_varlen(body, end, len) ? static_cast<size_t>(body - p) + len : 0;
+    } else if (status < 0x80) {
+        size = 0;
+    } else if (status < 0xF0) {
+        size = (status & 0xE0) == 0xC0 ? 2 : 3;
+    } else {
+        size = status == 0xF2 ? 3 : status == 0xF1 || status == 0xF3 ? 2 : 1;
+    }
+    return size <= static_cast<size_t>(end - p) ? size : 0;
+}
+
+SmfWriter::SmfWriter(const std::filesystem::path &path, int ppq, double tempo_bpm) : path_(path) {
+    write_header_(ppq, tempo_bpm);
+}
+
+SmfWriter::~SmfWriter(void) {
+    if (fd_ < 0) {
+        return;
+    }
+
+    // also puts the end-of-track rewrite of the last flush on disk
+    if (!flush() || fdatasync(fd_) != 0) {
+        spdlog::warn("Could not sync {}: {}", path_.string(), std::strerror(errno));
+    }
+    close(fd_);
+    fd_ = -1;
+}
+
+void SmfWriter::write_header_(int ppq, double tempo_bpm) {
+    const auto usec_per_quarter = static_cast<uint32_t>(std::lround(60'000'000.0 / tempo_bpm));
+
+    // clang-format off
+    std::vector<uint8_t> header = {
+        'M', 'T', 'h', 'd', 0x00, 0x00, 0x00, 0x06,
+        0x00, 0x00,                             // format 0
+        0x00, 0x01,                             // one track
+        static_cast<uint8_t>((ppq >> 8) & 0x7F), static_cast<uint8_t>(ppq & 0xFF),
+        'M', 'T', 'r', 'k', 0x00, 0x00, 0x00, 0x00,
+        0x00, 0xFF, 0x51, 0x03,                 // tempo
+        static_cast<uint8_t>(usec_per_quarter >> 16),
+        static_cast<uint8_t>(usec_per_quarter >> 8),
+        static_cast<uint8_t>(usec_per_quarter),
+    };
+    // clang-format on
+
+    eot_offset_ = static_cast<off_t>(header.size());
+    header.insert(header.end(), std::begin(kEndOfTrack), std::end(kEndOfTrack));
+    track_len_ = static_cast<uint32_t>(header.size()) - kTrackDataOffset;
+    put_be32(header.data() + kTrackLengthOffset, track_len_);
+
+    // publish the empty take atomically so there is never a half-written header on disk
+    std::filesystem::path tmp_path{path_.string() + ".tmp"};
+    int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw_sys("open", tmp_path);
+    }
+
+    if (!pwrite_all(fd, header.data(), header.size(), 0) || fdatasync(fd) != 0) {
+        close(fd);
+        throw_sys("write", tmp_path);
+    }
+
+    if (rename(tmp_path.c_str(), path_.c_str()) != 0) {
+        close(fd);
+        throw_sys("rename", tmp_path);
+    }
+
+    fd_ = fd;
+}
+
+void SmfWriter::append(int64_t tick, const uint8_t *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+
+    // events are expected in order, but never let a late one produce a negative delta
+    uint64_t delta = tick > last_tick_ ? static_cast<uint64_t>(tick - last_tick_) : 0;
+    last_tick_ = std::max(tick, last_tick_);
+
+    // deltas wider than 28 bits are carried by empty text events: at a microsecond a tick, one
+    // per four and a half minutes of silence
+    while (delta > kMaxVarlen) {
+        put_varlen(pending_, kMaxVarlen);
+        pending_.insert(pending_.end(), std::begin(kEmptyText), std::end(kEmptyText));
+        delta -= kMaxVarlen;
+    }
+    put_varlen(pending_, static_cast<uint32_t>(delta));
+
+    if (data[0] == 0xF0) {
+        pending_.push_back(0xF0);
+        put_varlen(pending_, static_cast<uint32_t>(len - 1));
+        pending_.insert(pending_.end(), data + 1, data + len);
+    } else {
+        pending_.insert(pending_.end(), data, data + len);
+    }
+
+    pending_events_++;
+}
+
+void SmfWriter::append_tempo(int64_t tick, double tempo_bpm) {
+    const auto usec_per_quarter = static_cast<uint32_t>(std::lround(60'000'000.0 / tempo_bpm));
+    const uint8_t meta[] = {0xFF, 0x51, 0x03, static_cast<uint8_t>(usec_per_quarter >> 16),
+        static_cast<uint8_t>(usec_per_quarter >> 8), static_cast<uint8_t>(usec_per_quarter)};
+    append(tick, meta, sizeof(meta));
+}
+
+bool SmfWriter::flush(void) {
+    if (pending_.empty() || fd_ < 0) {
+        return true;
+    }
+
+    // every step below rewrites the same bytes at the same offsets, so a failed flush can simply be
+    // retried later with the pending buffer intact
+    const off_t append_at = eot_offset_ + static_cast<off_t>(kEndOfTrackSize);
+    const size_t pending_size = pending_.size();
+    last_sync_time_ = std::chrono::nanoseconds{0};
+
+    pending_.insert(pending_.end(), std::begin(kEndOfTrack), std::end(kEndOfTrack));
+    bool ok = pwrite_all(fd_, pending_.data(), pending_.size(), append_at);
+    pending_.resize(pending_size);
+
+    if (!ok || timed_fdatasync(fd_, last_sync_time_) != 0) {
+        spdlog::warn("Could not append to {}: {}", path_.string(), std::strerror(errno));
+        return false;
+    }
+
+    const uint32_t new_track_len =
+        track_len_ + static_cast<uint32_t>(pending_size + kEndOfTrackSize);
+
+    uint8_t len_be[4];
+    put_be32(len_be, new_track_len);
+    const uint8_t empty_text = 0x01;
+
+    // the length has to be on disk before the old end-of-track goes, or writeback could keep the
+    // rewrite without the length and leave the committed track with no end-of-track at all. The
+    // rewrite is synced by the next flush or on close; until then the early end is harmless.
+    if (!pwrite_all(fd_, len_be, sizeof(len_be), kTrackLengthOffset) ||
+        timed_fdatasync(fd_, last_sync_time_) != 0 ||
+        !pwrite_all(fd_, &empty_text, 1, eot_offset_ + 2)) {
+        spdlog::warn("Could not commit {}: {}", path_.string(), std::strerror(errno));
+        return false;
+    }
+
+    track_len_ = new_track_len;
+    eot_offset_ = append_at + static_cast<off_t>(pending_size);
+    pending_.clear();
+    pending_events_ = 0;
+
+    return true;
+}
+
+bool SmfWriter::finish(void) {
+    if (fd_ < 0) {
+        return true;
+    }
+    if (!flush()) {
+        return false;
+    }
+
+    if (!compact_()) {
+        spdlog::warn("Could not compact {}, keeping it as is", path_.string());
+        if (fdatasync(fd_) != 0) {
+            spdlog::warn("Could not sync {}: {}", path_.string(), std::strerror(errno));
+        }
+    }
+    close(fd_);
+    fd_ = -1;
+    return true;
+}
+
+bool SmfWriter::compact_(void) {
+    FileMapping track;
+    if (!track.map(fd_, static_cast<size_t>(eot_offset_) + kEndOfTrackSize)) {
+        return false;
+    }
+    const uint8_t *const data = track.data();
+    const uint8_t *const end = data + track.size();
+
+    // written next to the file and renamed over it, so a crash keeps one or the other
+    const std::filesystem::path tmp_path{path_.string() + ".tmp"};
+    int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    std::vector<uint8_t> out(data, data + kTrackDataOffset);
+    off_t written = 0;
+    bool ok = true;
+    bool ended = false;
+    uint64_t carry = 0;
+    for (const uint8_t *p = data + kTrackDataOffset; ok && p < end && !ended;) {
+        uint32_t delta = 0;
+        size_t len = 0;
+        if (!get_varlen(p, end, delta) || p == end || (len = event_size(p, end)) == 0) {
+            ok = false;
+            break;
+        }
+
+        uint64_t total = carry + delta;
+        const bool empty_text = len == sizeof(kEmptyText) && std::memcmp(p, kEmptyText, len) == 0;
+        if (empty_text) {
+            carry = total;
+            p += len;
+            continue;
+        }
+
+        while (total > kMaxVarlen) {
+            put_varlen(out, kMaxVarlen);
+            out.insert(out.end(), std::begin(kEmptyText), std::end(kEmptyText));
+            total -= kMaxVarlen;
+        }
+        put_varlen(out, static_cast<uint32_t>(total));
+        out.insert(out.end(), p, p + len);
+        carry = 0;
+        ended = len == kEndOfTrackSize - 1 && p[0] == 0xFF && p[1] == 0x2F;
+        p += len;
+
+        if (out.size() >= kCompactChunk) {
+            ok = pwrite_all(fd, out.data(), out.size(), written);
+            written += static_cast<off_t>(out.size());
+            out.clear();
+        }
+    }
+    ok = ok && ended && pwrite_all(fd, out.data(), out.size(), written);
+    written += static_cast<off_t>(out.size());
+
+    uint8_t len_be[4];
+    put_be32(len_be, static_cast<uint32_t>(written - kTrackDataOffset));
+    if (!ok || !pwrite_all(fd, len_be, sizeof(len_be), kTrackLengthOffset) || fdatasync(fd) != 0 ||
+        rename(tmp_path.c_str(), path_.c_str()) != 0) {
+        close(fd);
+        (void)unlink(tmp_path.c_str());
+        return false;
+    }
+
+    close(fd_);
+    fd_ = fd;
+    return true;
+}
+
+} // namespace pr::midi
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+namespace pr::midi {
+
+// Append-only single-track (format 0) Standard MIDI File writer.
+//
+// Events are buffered in memory until flush(), which appends only the new delta-time events and
+// patches the MTrk chunk length in place, so the cost of a flush depends on the number of new
+// events rather than on the length of the session.
+//
+// Commit order for each flush:
+//   1. new events + a fresh end-of-track are written past the committed end of the chunk and
+//      synced. Bytes past the last chunk are ignored by readers, so the file is still the old take.
+//   2. the MTrk length is bumped to cover the new bytes and synced.
+//   3. the previous end-of-track (FF 2F 00) is rewritten as an empty text event (FF 01 00); it
+//      reaches the disk with the sync of the next flush, or on close.
+// A crash after 2 but before 3 is on disk leaves an early end-of-track that readers stop at, which
+// is again the previous take, so the file on disk is a valid .mid at every point.
+//
+// Every flush leaves the end-of-track it replaced behind as an empty text event, and deltas wider
+// than 28 bits are carried by empty text events too. finish() rewrites the track once when the
+// file is done, folding the deltas of those events into the next one, so a closed file only keeps
+// the fillers a long silence really needs.
+class SmfWriter {
+public:
+    SmfWriter(const std::filesystem::path &path, int ppq, double tempo_bpm);
+    ~SmfWriter(void);
+
+    SmfWriter(const SmfWriter &) = delete;
+    SmfWriter &operator=(const SmfWriter &) = delete;
+
+    void append(int64_t tick, const uint8_t *data, size_t len);
+    void append(int64_t tick, const std::vector<uint8_t> &data) {
+        append(tick, data.data(), data.size());
+    }
+
+    // set tempo meta event
+    void append_tempo(int64_t tick, double tempo_bpm);
+
+    bool flush(void);
+    // flushes, drops the empty text events and closes the file; the writer takes no more events.
+    // False only if the flush failed: a track that can't be rewritten is left as it is.
+    bool finish(void);
+
+    size_t pending_events(void) const noexcept {
+        return pending_events_;
+    }
+
+    uint64_t committed_bytes(void) const noexcept {
+        return static_cast<uint64_t>(eot_offset_) + kEndOfTrackSize;
+    }
+
+    const std::filesystem::path &path(void) const noexcept {
+        return path_;
+    }
+
+    // time spent in fdatasync during the last flush that had something to write
+    std::chrono::nanoseconds last_sync_time(void) const noexcept {
+        return last_sync_time_;
+    }
+
+private:
+    static constexpr off_t kTrackLengthOffset = 18;
+    static constexpr off_t kTrackDataOffset = 22;
+    static constexpr size_t kEndOfTrackSize = 4;
+
+    void write_header_(int ppq, double tempo_bpm);
+    bool compact_(void);
+
+private:
+    int fd_{-1};
+    std::filesystem::path path_;
+
+    std::vector<uint8_t> pending_;
+    size_t pending_events_{0};
+    int64_t last_tick_{0};
+
+    std::chrono::nanoseconds last_sync_time_{0};
+
+    uint32_t track_len_{0};
+    off_t eot_offset_{0};
+};
+
+} // namespace pr::midi
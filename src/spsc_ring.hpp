@@ -0,0 +1,105 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <type_traits>
+
+namespace pr::midi {
+
+// Bounded lock-free single-producer/single-consumer ring.
+//
+// try_push() must only be called from one thread and try_pop()/pop_bulk() from one other thread.
+// Neither side ever blocks or allocates; a push into a full ring is dropped and counted.
+template <class T>
+class SpscRing {
+    static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+    explicit SpscRing(size_t capacity)
+        : capacity_(std::bit_ceil(std::max<size_t>(capacity, 2))), mask_(capacity_ - 1),
+          slots_(std::make_unique<T[]>(capacity_)) {}
+
+    SpscRing(const SpscRing &) = delete;
+    SpscRing &operator=(const SpscRing &) = delete;
+
+    bool try_push(const T &value) noexcept {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head - cached_tail_ >= capacity_) {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if (head - cached_tail_ >= capacity_) {
+                overflows_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+
+        slots_[head & mask_] = value;
+        head_.store(head + 1, std::memory_order_release);
+
+        const size_t used = head + 1 - tail_.load(std::memory_order_relaxed);
+        if (used > high_water_.load(std::memory_order_relaxed)) {
+            high_water_.store(used, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    bool try_pop(T &out) noexcept {
+        return pop_bulk(std::span<T>(&out, 1)) == 1;
+    }
+
+    size_t pop_bulk(std::span<T> out) noexcept {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (cached_head_ - tail < out.size()) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+        }
+
+        const size_t n = std::min(cached_head_ - tail, out.size());
+        for (size_t i = 0; i < n; i++) {
+            out[i] = slots_[(tail + i) & mask_];
+        }
+
+        if (n > 0) {
+            tail_.store(tail + n, std::memory_order_release);
+        }
+        return n;
+    }
+
+    size_t capacity(void) const noexcept {
+        return capacity_;
+    }
+
+    size_t size_approx(void) const noexcept {
+        return head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_relaxed);
+    }
+
+    size_t high_water(void) const noexcept {
+        return high_water_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t overflows(void) const noexcept {
+        return overflows_.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr size_t kCacheLine = 64;
+
+    const size_t capacity_;
+    const size_t mask_;
+    std::unique_ptr<T[]> slots_;
+
+    // producer side
+    alignas(kCacheLine) std::atomic<size_t> head_{0};
+    size_t cached_tail_{0};
+    std::atomic<size_t> high_water_{0};
+    std::atomic<uint64_t> overflows_{0};
+
+    // consumer side
+    alignas(kCacheLine) std::atomic<size_t> tail_{0};
+    size_t cached_head_{0};
+};
+
+} // namespace pr::midi
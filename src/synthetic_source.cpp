@@ -0,0 +1,69 @@
+#include "synthetic_source.hpp"
+
+#include <stdexcept>
+
+namespace pr::midi {
+
+static constexpr auto kTimerPeriod = std::chrono::milliseconds(1);
+
+SyntheticSource::SyntheticSource(const SyntheticConfig &config)
+    : config_(config), timer_(kTimerPeriod), rng_(config.seed) {
+    const double rate = config_.note_rate + config_.cc_rate;
+    if (rate <= 0.0) {
+        throw std::runtime_error("synthetic source needs a positive event rate");
+    }
+
+    interval_ = std::chrono::nanoseconds(static_cast<int64_t>(1e9 / rate));
+}
+
+void SyntheticSource::expand_midi_port(MidiPortHandle &handle) {
+    handle.client_name = "Synthetic";
+    handle.port_name = "Generator";
+    handle.type = SND_SEQ_PORT_TYPE_SOFTWARE;
+}
+
+size_t SyntheticSource::drain(std::span<SeqEvent> out) {
+    timer_.acknowledge();
+
+    const std::chrono::nanoseconds now = std::chrono::steady_clock::now() - start_;
+
+    size_t n = 0;
+    while (n < out.size() && next_due_ <= now) {
+        SeqEvent &ev = out[n++];
+        ev.type = SeqEventType::MIDI;
+        ev.source = snd_seq_addr_t{.client = kVirtualClient, .port = 0};
+        ev.stamped = true;
+        ev.stamp = next_due_;
+        fill_event_(ev);
+
+        next_due_ += interval_;
+        generated_++;
+    }
+
+    return n;
+}
+
+void SyntheticSource::fill_event_(SeqEvent &ev) {
+    const double p_note = config_.note_rate / (config_.note_rate + config_.cc_rate);
+    SeqMidi &midi = ev.data.midi;
+
+    if (std::uniform_real_distribution<double>(0.0, 1.0)(rng_) < p_note) {
+        // strictly alternate on/off so every note is closed
+        if (!note_held_) {
+            held_note_ = static_cast<uint8_t>(std::uniform_int_distribution<int>(21, 108)(rng_));
+            const auto velocity =
+                static_cast<uint8_t>(std::uniform_int_distribution<int>(1, 127)(rng_));
+            midi = SeqMidi{.len = 3, .bytes = {0x90, held_note_, velocity}};
+        } else {
+            midi = SeqMidi{.len = 3, .bytes = {0x80, held_note_, 0}};
+        }
+        note_held_ = !note_held_;
+    } else {
+        static constexpr uint8_t kControllers[] = {64, 1, 11};
+        const auto cc = kControllers[std::uniform_int_distribution<size_t>(0, 2)(rng_)];
+        const auto value = static_cast<uint8_t>(std::uniform_int_distribution<int>(0, 127)(rng_));
+        midi = SeqMidi{.len = 3, .bytes = {0xB0, cc, value}};
+    }
+}
+
+} // namespace pr::midi
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <random>
+
+#include "event_source.hpp"
+
+namespace pr::midi {
+
+struct SyntheticConfig {
+    // note-on + note-off events per second
+    double note_rate = 20.0;
+    // controller events per second
+    double cc_rate = 200.0;
+    uint32_t seed = 1;
+};
+
+// Generates a steady stream of notes and controllers at a fixed rate (up to ~100k events/s), for
+// load-testing the whole capture -> timestamp -> save pipeline without MIDI hardware. Each event is
+// stamped with the time it was due, so stamp-to-dequeue latency measures the recorder alone.
+class SyntheticSource : public EventSource {
+public:
+    explicit SyntheticSource(const SyntheticConfig &config);
+
+    std::vector<struct pollfd> get_poll_desc(void) override {
+        return {timer_.poll_desc()};
+    }
+
+    size_t drain(std::span<SeqEvent> out) override;
+
+    std::optional<std::chrono::nanoseconds> queue_time(void) override {
+        return std::chrono::steady_clock::now() - start_;
+    }
+
+    void expand_midi_port(MidiPortHandle &handle) override;
+
+    uint64_t generated(void) const noexcept {
+        return generated_;
+    }
+
+private:
+    void fill_event_(SeqEvent &ev);
+
+private:
+    SyntheticConfig config_;
+    TimerFd timer_;
+    std::mt19937 rng_;
+
+    std::chrono::steady_clock::time_point start_{std::chrono::steady_clock::now()};
+    std::chrono::nanoseconds interval_;
+    std::chrono::nanoseconds next_due_{0};
+
+    uint64_t generated_{0};
+    uint8_t held_note_{0};
+    bool note_held_{false};
+};
+
+} // namespace pr::midi
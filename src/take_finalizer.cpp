@@ -0,0 +1,162 @@
+#include "take_finalizer.hpp"
+#include "file_io.hpp"
+#include "json_escape.hpp"
+#include "take_summary.hpp"
+
+#include <time.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <system_error>
+
+#include <spdlog/spdlog.h>
+
+namespace pr::midi {
+
+static std::string iso_time(std::chrono::system_clock::time_point t) {
+    const time_t secs = std::chrono::system_clock::to_time_t(t);
+    struct tm local {};
+    localtime_r(&secs, &local);
+
+    char buf[32];
+    const size_t len = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S%z", &local);
+    return std::string(buf, len);
+}
+
+// "<name>.part" -> "<name>"; the final path, or empty if the rename failed
+static std::filesystem::path drop_partial_suffix(const std::filesystem::path &partial) {
+    std::filesystem::path final_path = partial;
+    if (final_path.extension() == kPartialSuffix) {
+        final_path.replace_extension();
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(partial, final_path, ec);
+    if (ec) {
+        spdlog::error("Could not rename {}: {}", partial.string(), ec.message());
+        return {};
+    }
+    return final_path;
+}
+
+TakeFinalizer::TakeFinalizer(LatencyHistogram &duration, Counter &finalized)
+    : duration_(duration), finalized_(finalized) {}
+
+TakeFinalizer::~TakeFinalizer(void) {
+    stop();
+}
+
+void TakeFinalizer::start(void) {
+    if (thread_.joinable()) {
+        return;
+    }
+
+    stopping_ = false;
+    thread_ = std::thread([this]() { run_(); });
+}
+
+void TakeFinalizer::stop(void) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void TakeFinalizer::submit(
+    std::unique_ptr<SmfWriter> writer, std::unique_ptr<ArchiveWriter> archive, TakeInfo info) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(Job{
+            .writer = std::move(writer), .archive = std::move(archive), .info = std::move(info)});
+    }
+    cv_.notify_one();
+}
+
+void TakeFinalizer::run_(void) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+        if (jobs_.empty()) {
+            break;
+        }
+
+        Job job = std::move(jobs_.front());
+        jobs_.pop_front();
+
+        lock.unlock();
+        finalize_(job);
+        lock.lock();
+    }
+}
+
+void TakeFinalizer::finalize_(Job &job) {
+    const auto start = std::chrono::steady_clock::now();
+
+    // events were appended in tick order, so the file needs no re-sort: finish, close and rename
+    const std::filesystem::path partial = job.writer->path();
+    if (!job.writer->finish()) {
+        spdlog::error("Could not flush {}, leaving it as is", partial.string());
+        return;
+    }
+    job.writer.reset();
+
+    // before the rename, so whoever notices the new .mid finds its summary already next to it
+    const TakeInfo &info = job.info;
+    if (info.roll) {
+        const TakeSummary summary = summarize(info.roll->notes(0, UINT32_MAX, SIZE_MAX),
+            static_cast<uint64_t>(std::llround(info.duration_s * 1e6)),
+            static_cast<uint32_t>(std::min<uint64_t>(info.events, UINT32_MAX)));
+        if (!save_summary(partial, summary)) {
+            spdlog::warn("Could not write the summary of {}", partial.string());
+        }
+    }
+
+    const std::filesystem::path final_path = drop_partial_suffix(partial);
+    if (final_path.empty()) {
+        return;
+    }
+
+    if (job.archive) {
+        const std::filesystem::path archive_partial = job.archive->path();
+        if (job.archive->close()) {
+            (void)drop_partial_suffix(archive_partial);
+        } else {
+            spdlog::error("Could not close {}, leaving it as is", archive_partial.string());
+        }
+        job.archive.reset();
+    }
+    sync_dir(final_path.parent_path());
+
+    const std::filesystem::path meta_path = final_path.string() + ".json";
+    const std::string meta = fmt::format(
+        "{{\"file\": \"{}\", \"device\": \"{}\", \"port\": \"{}\", \"started\": \"{}\", "
+        "\"duration_s\": {:.3f}, \"events\": {}, \"notes\": {}}}\n",
+        json_escape(final_path.filename().string()), json_escape(info.device),
+        json_escape(info.port), iso_time(info.started), info.duration_s, info.events, info.notes);
+    if (!write_file(meta_path, meta.data(), meta.size())) {
+        spdlog::warn("Could not write {}", meta_path.string());
+    }
+
+    if (info.roll && !info.roll->save(final_path.string() + ".roll")) {
+        spdlog::warn("Could not write the piano roll of {}", final_path.string());
+    }
+    // the sidecars were synced before their renames; this makes the renames stick
+    sync_dir(final_path.parent_path());
+
+    duration_.record(std::chrono::steady_clock::now() - start);
+    finalized_.add();
+    spdlog::info("Finalized take {} ({:.1f}s, {} notes)", final_path.string(), info.duration_s,
+        info.notes);
+
+    if (listener_) {
+        listener_(final_path, info);
+    }
+}
+
+} // namespace pr::midi
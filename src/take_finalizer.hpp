@@ -0,0 +1,88 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "archive.hpp"
+#include "metrics.hpp"
+#include "roll_pyramid.hpp"
+#include "smf_writer.hpp"
+
+namespace pr::midi {
+
+// Extension of a take that is still being recorded; dropped when it is finalized
+static constexpr std::string_view kPartialSuffix = ".part";
+
+// What gets written into the metadata sidecar of a finished take
+struct TakeInfo {
+    std::string device;
+    std::string port;
+    std::chrono::system_clock::time_point started;
+    double duration_s = 0.0;
+    uint64_t events = 0;
+    uint64_t notes = 0;
+    // saved as "<take>.mid.roll" if set
+    std::shared_ptr<RollPyramid> roll;
+};
+
+// Closes finished takes on its own thread, so the persistence thread only hands over the writer.
+// Finalizing a take means: flush and sync what is left, rewrite the track without the empty text
+// events of the flushes (SmfWriter::finish), write its "<take>.mid.sum" summary from the piano
+// roll, rename "<take>.mid.part" to "<take>.mid" (and the archive the same way, if there is one),
+// sync the directory, and write "<take>.mid.json" (and the piano roll) next to it, each synced
+// before its rename, then sync the directory again.
+class TakeFinalizer {
+public:
+    // called on the finalizer thread with the final path of every take
+    using Listener = std::function<void(const std::filesystem::path &, const TakeInfo &)>;
+
+    TakeFinalizer(LatencyHistogram &duration, Counter &finalized);
+    ~TakeFinalizer(void);
+
+    TakeFinalizer(const TakeFinalizer &) = delete;
+    TakeFinalizer &operator=(const TakeFinalizer &) = delete;
+
+    void start(void);
+    // finishes every take submitted so far before returning
+    void stop(void);
+
+    void submit(
+        std::unique_ptr<SmfWriter> writer, std::unique_ptr<ArchiveWriter> archive, TakeInfo info);
+
+    // set before start()
+    void set_listener(Listener listener) {
+        listener_ = std::move(listener);
+    }
+
+private:
+    struct Job {
+        std::unique_ptr<SmfWriter> writer;
+        std::unique_ptr<ArchiveWriter> archive;
+        TakeInfo info;
+    };
+
+    void run_(void);
+    void finalize_(Job &job);
+
+private:
+    LatencyHistogram &duration_;
+    Counter &finalized_;
+    Listener listener_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Job> jobs_;
+    bool stopping_{false};
+    std::thread thread_{};
+};
+
+} // namespace pr::midi
@@ -0,0 +1,192 @@
+#include "take_summary.hpp"
+#include "file_io.hpp"
+#include "smf_reader.hpp"
+#include "take_finalizer.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <system_error>
+#include <thread>
+
+#include <spdlog/spdlog.h>
+
+namespace pr::midi {
+
+static constexpr char kMagic[8] = {'P', 'R', 'S', 'U', 'M', '0', '1', '\n'};
+// ppp to fff, 16 velocities each
+static constexpr const char *kDynamics[] = {"ppp", "pp", "p", "mp", "mf", "f", "ff", "fff"};
+
+TakeSummary summarize(const std::vector<RollNote> &notes, uint64_t duration_us, uint32_t events) {
+    TakeSummary summary{};
+    std::memcpy(summary.magic, kMagic, sizeof(kMagic));
+    summary.duration_us = duration_us;
+    summary.notes = static_cast<uint32_t>(notes.size());
+    summary.events = events;
+    summary.min_pitch = 127;
+
+    std::array<uint32_t, 128> velocities{};
+    std::array<uint32_t, TakeSummary::kDensitySlices> onsets{};
+    const uint64_t duration_ms = std::max<uint64_t>(duration_us / 1000, 1);
+    for (const RollNote &note : notes) {
+        summary.min_pitch = std::min(summary.min_pitch, note.key);
+        summary.max_pitch = std::max(summary.max_pitch, note.key);
+        velocities[note.velocity & 0x7F]++;
+        onsets[std::min<size_t>(uint64_t{note.on_ms} * onsets.size() / duration_ms,
+            onsets.size() - 1)]++;
+    }
+
+    // notes are never played at velocity 0, so 0 is no median yet
+    std::array<uint32_t, std::size(kDynamics)> levels{};
+    uint64_t seen = 0;
+    for (size_t v = 0; v < velocities.size(); v++) {
+        levels[v / 16] += velocities[v];
+        seen += velocities[v];
+        if (summary.median_velocity == 0 && seen > 0 && 2 * seen >= summary.notes) {
+            summary.median_velocity = static_cast<uint8_t>(v);
+        }
+    }
+    summary.dynamics =
+        static_cast<uint8_t>(std::max_element(levels.begin(), levels.end()) - levels.begin());
+
+    // rounded up, so a slice with any notes at all still shows
+    const uint32_t peak = *std::max_element(onsets.begin(), onsets.end());
+    for (size_t i = 0; peak > 0 && i < onsets.size(); i++) {
+        summary.density[i] = static_cast<uint8_t>((uint64_t{onsets[i]} * 255 + peak - 1) / peak);
+    }
+    return summary;
+}
+
+std::optional<TakeSummary> summarize_file(const std::filesystem::path &file) {
+    std::vector<RollNote> notes;
+    uint32_t events = 0;
+    uint64_t duration_us = 0;
+    try {
+        const SmfReader reader(file);
+        const SmfTempoMap tempo(reader);
+        uint64_t end_tick = 0;
+        for (const SmfTrack &track : reader.tracks()) {
+            // the controllers a take starts with were chased, not played; the recorder doesn't
+            // count them either
+            bool chased = true;
+            for (const SmfEvent &ev : track) {
+                end_tick = std::max(end_tick, ev.tick);
+                if (!ev.is_channel()) {
+                    continue;
+                }
+                chased = chased && ev.tick == 0 && (ev.status & 0xF0) == 0xB0;
+                if (chased) {
+                    continue;
+                }
+
+                events++;
+                if (ev.is_note_on()) {
+                    notes.push_back(RollNote{
+                        .on_ms = static_cast<uint32_t>(tempo.seconds(ev.tick) * 1000.0),
+                        .off_ms = 0,
+                        .key = ev.data[0],
+                        .velocity = ev.data[1],
+                        .channel = static_cast<uint8_t>(ev.status & 0x0F),
+                        .reserved = 0});
+                }
+            }
+        }
+        duration_us = static_cast<uint64_t>(std::llround(tempo.seconds(end_tick) * 1e6));
+    } catch (const std::exception &e) {
+        spdlog::debug("Could not summarize {}: {}", file.string(), e.what());
+        return std::nullopt;
+    }
+    return summarize(notes, duration_us, events);
+}
+
+std::filesystem::path summary_path(const std::filesystem::path &file) {
+    std::filesystem::path take = file;
+    if (take.extension() == kPartialSuffix) {
+        take.replace_extension();
+    }
+    return take.string() + kSummarySuffix;
+}
+
+bool save_summary(const std::filesystem::path &file, TakeSummary summary) {
+    if (!stat_file(file, summary.source_size, summary.source_mtime_ns)) {
+        return false;
+    }
+
+    return write_file(summary_path(file), &summary, sizeof(summary));
+}
+
+std::optional<TakeSummary> load_summary(const std::filesystem::path &file) {
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    if (!stat_file(file, size, mtime_ns)) {
+        return std::nullopt;
+    }
+
+    const int fd = open(summary_path(file).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+    TakeSummary summary;
+    const ssize_t n = read(fd, &summary, sizeof(summary));
+    close(fd);
+
+    if (n != static_cast<ssize_t>(sizeof(summary)) ||
+        std::memcmp(summary.magic, kMagic, sizeof(kMagic)) != 0 || summary.source_size != size ||
+        summary.source_mtime_ns != mtime_ns || summary.dynamics >= std::size(kDynamics)) {
+        return std::nullopt;
+    }
+    return summary;
+}
+
+size_t backfill_summaries(const std::filesystem::path &dir, unsigned threads) {
+    std::vector<std::filesystem::path> files;
+    std::error_code ec;
+    for (const auto &dirent : std::filesystem::directory_iterator(dir, ec)) {
+        if (dirent.path().extension() == ".mid") {
+            files.push_back(dirent.path());
+        }
+    }
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned>(std::min<size_t>(threads, files.size()));
+
+    // checking a summary is one small read, so up-to-date files cost next to nothing
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> written{0};
+    const auto worker = [&]() {
+        for (size_t i = next++; i < files.size(); i = next++) {
+            if (load_summary(files[i])) {
+                continue;
+            }
+
+            const std::optional<TakeSummary> summary = summarize_file(files[i]);
+            if (!summary || !save_summary(files[i], *summary)) {
+                spdlog::warn("Could not summarize {}", files[i].string());
+                continue;
+            }
+            written++;
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : pool) {
+        t.join();
+    }
+    return written;
+}
+
+const char *dynamics_name(uint8_t dynamics) {
+    return kDynamics[std::min<size_t>(dynamics, std::size(kDynamics) - 1)];
+}
+
+} // namespace pr::midi
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+#include "roll_pyramid.hpp"
+
+namespace pr::midi {
+
+// What a library listing shows of one take, stored as "<take>.mid.sum" so browsing reads one
+// small fixed-size file instead of the .mid. The recorder writes it when a take is finalized,
+// from the piano roll it already holds; backfill_summaries() covers takes from before that.
+//
+// Written as is, in host byte order. The size and mtime of the .mid it was made from are kept in
+// it, so a file changed behind our back reads as stale.
+struct TakeSummary {
+    static constexpr size_t kDensitySlices = 32;
+
+    char magic[8];
+    uint64_t source_size;
+    int64_t source_mtime_ns;
+    uint64_t duration_us;
+    uint32_t notes;
+    uint32_t events;
+    // 127 / 0 if there are no notes
+    uint8_t min_pitch;
+    uint8_t max_pitch;
+    // ppp (0) to fff (7): the level most notes were played at
+    uint8_t dynamics;
+    uint8_t median_velocity;
+    uint32_t reserved;
+    // onsets in each of kDensitySlices equal slices of the take, 255 for the busiest one
+    std::array<uint8_t, kDensitySlices> density;
+};
+
+static_assert(sizeof(TakeSummary) == 80);
+
+static constexpr const char *kSummarySuffix = ".sum";
+
+// only the onset, key and velocity of the notes are looked at
+TakeSummary summarize(const std::vector<RollNote> &notes, uint64_t duration_us, uint32_t events);
+// parses the .mid; nullopt if it can't be. The controllers chased at the start of a take are not
+// counted as events.
+std::optional<TakeSummary> summarize_file(const std::filesystem::path &file);
+
+// "<take>.mid.sum", also for the "<take>.mid.part" it is written from before the rename
+std::filesystem::path summary_path(const std::filesystem::path &file);
+// stamps the summary with the size and mtime of file, which must not change any more
+bool save_summary(const std::filesystem::path &file, TakeSummary summary);
+// nullopt if there is none or it is stale
+std::optional<TakeSummary> load_summary(const std::filesystem::path &file);
+
+// writes the missing and stale summaries of every .mid in dir; threads = 0 uses every core.
+// Returns how many were written.
+size_t backfill_summaries(const std::filesystem::path &dir, unsigned threads = 0);
+
+// "ppp" to "fff"
+const char *dynamics_name(uint8_t dynamics);
+
+} // namespace pr::midi
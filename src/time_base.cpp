@@ -0,0 +1,55 @@
+#include "time_base.hpp"
+
+#include <cmath>
+#include <stdexcept>
+
+namespace pr::midi {
+
+// largest division a .mid header can hold as ticks per quarter note
+static constexpr int kMaxPpq = 0x7FFF;
+// largest tempo event
+static constexpr uint32_t kMaxUsecPerQuarter = 0xFFFFFF;
+
+TimeBase parse_time_base(const std::string &text) {
+    if (text == "midi") {
+        return TimeBase{};
+    }
+    // the finest division a .mid can carry, at the tempo that makes its ticks microseconds
+    if (text == "us") {
+        return TimeBase{.ppq = 25'000, .usec_per_quarter = 25'000};
+    }
+
+    const size_t at = text.find('@');
+    if (at == std::string::npos) {
+        throw std::invalid_argument("time base is not midi, us or <ppq>@<bpm>: " + text);
+    }
+
+    TimeBase base;
+    double bpm = 0.0;
+    try {
+        size_t used = 0;
+        base.ppq = std::stoi(text.substr(0, at), &used);
+        if (used != at) {
+            throw std::invalid_argument(text);
+        }
+        bpm = std::stod(text.substr(at + 1), &used);
+        if (used != text.size() - at - 1) {
+            throw std::invalid_argument(text);
+        }
+    } catch (const std::logic_error &) {
+        throw std::invalid_argument("time base is not midi, us or <ppq>@<bpm>: " + text);
+    }
+
+    const double usec_per_quarter = bpm > 0.0 ? std::round(60'000'000.0 / bpm) : 0.0;
+    if (base.ppq < 1 || base.ppq > kMaxPpq || usec_per_quarter < 1.0 ||
+        usec_per_quarter > kMaxUsecPerQuarter) {
+        throw std::invalid_argument("time base out of the range a .mid can carry: " + text);
+    }
+    base.usec_per_quarter = static_cast<uint32_t>(usec_per_quarter);
+    if (static_cast<uint32_t>(base.ppq) > base.usec_per_quarter) {
+        throw std::invalid_argument("time base ticks are shorter than a microsecond: " + text);
+    }
+    return base;
+}
+
+} // namespace pr::midi
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace pr::midi {
+
+// What a tick of the capture clock is worth: ppq ticks to a quarter note of usec_per_quarter
+// microseconds, the same two numbers a .mid header and its tempo event carry, so files written on
+// it keep every tick. Ticks are 64-bit and never wrap.
+struct TimeBase {
+    int ppq = 960;
+    uint32_t usec_per_quarter = 500'000;
+
+    double bpm(void) const noexcept {
+        return 60'000'000.0 / usec_per_quarter;
+    }
+
+    double ticks_per_second(void) const noexcept {
+        return ppq * 1e6 / usec_per_quarter;
+    }
+
+    double seconds(int64_t tick) const noexcept {
+        return static_cast<double>(tick) / ticks_per_second();
+    }
+
+    // nearest tick, in integers so the clock is as exact after a year as after a second
+    int64_t ticks(std::chrono::nanoseconds t) const noexcept {
+        const int64_t ns_per_quarter = int64_t{usec_per_quarter} * 1000;
+        const int64_t quarters = t.count() / ns_per_quarter;
+        const int64_t rest = t.count() % ns_per_quarter;
+        return quarters * ppq + (rest * ppq + ns_per_quarter / 2) / ns_per_quarter;
+    }
+};
+
+// "midi" (960 ppq at 120 bpm), "us" (a tick per microsecond) or "<ppq>@<bpm>"; ticks can't be
+// shorter than a microsecond. Throws std::invalid_argument.
+TimeBase parse_time_base(const std::string &text);
+
+} // namespace pr::midi
@@ -0,0 +1,202 @@
+#include "trace.hpp"
+#include "broadcast_ring.hpp"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <system_error>
+
+#include <spdlog/spdlog.h>
+
+namespace pr::midi::trace {
+
+namespace {
+
+struct ThreadRing {
+    explicit ThreadRing(std::string ring_name) : name(std::move(ring_name)) {}
+
+    std::string name;
+    // guarded by g_mutex
+    bool owned = true;
+    BroadcastRing<Record> ring{kRecordsPerThread};
+};
+
+std::mutex g_mutex;
+// never shrinks, so a dump still has the records of threads that have exited
+std::vector<std::unique_ptr<ThreadRing>> g_rings;
+
+ThreadRing *adopt_ring(const std::string &name) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    for (const std::unique_ptr<ThreadRing> &ring : g_rings) {
+        if (!ring->owned && ring->name == name) {
+            ring->owned = true;
+            return ring.get();
+        }
+    }
+    g_rings.push_back(std::make_unique<ThreadRing>(name));
+    return g_rings.back().get();
+}
+
+// hands the ring back when the thread exits
+struct ThreadSlot {
+    ThreadRing *ring = nullptr;
+
+    ~ThreadSlot(void) {
+        release();
+    }
+
+    void release(void) {
+        if (ring) {
+            std::lock_guard<std::mutex> lock(g_mutex);
+            ring->owned = false;
+            ring = nullptr;
+        }
+    }
+};
+
+thread_local ThreadSlot t_slot;
+
+template <class T>
+void put(std::string &out, const T &value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <class T>
+void get(std::ifstream &in, T &value) {
+    if (!in.read(reinterpret_cast<char *>(&value), sizeof(T))) {
+        throw std::runtime_error("trace dump is truncated");
+    }
+}
+
+} // namespace
+
+void detail::write(const Record &record) noexcept {
+    ThreadSlot &slot = t_slot;
+    if (!slot.ring) [[unlikely]] {
+        try {
+            slot.ring = adopt_ring(fmt::format("tid-{}", syscall(SYS_gettid)));
+        } catch (...) {
+            return;
+        }
+    }
+    slot.ring->ring.publish(record);
+}
+
+void set_enabled(bool on) noexcept {
+    detail::enabled.store(on, std::memory_order_relaxed);
+}
+
+void name_thread(const std::string &name) {
+    t_slot.release();
+    t_slot.ring = adopt_ring(name);
+}
+
+std::string snapshot(void) {
+    const auto wall = std::chrono::system_clock::now().time_since_epoch();
+    const auto steady = std::chrono::steady_clock::now().time_since_epoch();
+    const int64_t wall_offset_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(wall - steady).count();
+
+    std::vector<std::pair<std::string, const BroadcastRing<Record> *>> rings;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        for (const std::unique_ptr<ThreadRing> &ring : g_rings) {
+            rings.emplace_back(ring->name, &ring->ring);
+        }
+    }
+
+    std::string out(kDumpMagic);
+    put(out, static_cast<uint32_t>(sizeof(Record)));
+    put(out, static_cast<uint32_t>(rings.size()));
+    put(out, wall_offset_ns);
+
+    std::vector<Record> records(kRecordsPerThread);
+    for (const auto &[name, ring] : rings) {
+        const uint64_t head = ring->head();
+        uint64_t cursor = head > ring->capacity() ? head - ring->capacity() : 0;
+        uint64_t skipped = 0;
+        // records published while this runs are left for the next dump
+        const size_t n = ring->read(
+            cursor, std::span(records.data(), std::min<uint64_t>(head - cursor, records.size())),
+            skipped);
+
+        put(out, static_cast<uint32_t>(name.size()));
+        out += name;
+        put(out, static_cast<uint64_t>(n));
+        out.append(reinterpret_cast<const char *>(records.data()), n * sizeof(Record));
+    }
+    return out;
+}
+
+bool write_dump(const std::filesystem::path &path) {
+    const std::string bytes = snapshot();
+    const std::filesystem::path tmp = path.string() + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()))) {
+            spdlog::error("Could not write {}", tmp.string());
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) {
+        spdlog::error("Could not rename {}: {}", tmp.string(), ec.message());
+        return false;
+    }
+    spdlog::info("Wrote trace dump {} ({} bytes)", path.string(), bytes.size());
+    return true;
+}
+
+TraceDump read_dump(const std::filesystem::path &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("could not open " + path.string());
+    }
+
+    char magic[kDumpMagic.size()];
+    if (!in.read(magic, sizeof(magic)) || std::string_view(magic, sizeof(magic)) != kDumpMagic) {
+        throw std::runtime_error(path.string() + " is not a trace dump");
+    }
+
+    uint32_t record_size = 0;
+    uint32_t n_threads = 0;
+    TraceDump dump;
+    get(in, record_size);
+    get(in, n_threads);
+    get(in, dump.wall_offset_ns);
+    if (record_size != sizeof(Record)) {
+        throw std::runtime_error(fmt::format("unsupported trace record size {}", record_size));
+    }
+
+    for (uint32_t i = 0; i < n_threads; i++) {
+        ThreadTrace &thread = dump.threads.emplace_back();
+        uint32_t name_len = 0;
+        get(in, name_len);
+        thread.name.resize(name_len);
+        if (!in.read(thread.name.data(), name_len)) {
+            throw std::runtime_error("trace dump is truncated");
+        }
+
+        uint64_t n_records = 0;
+        get(in, n_records);
+        if (n_records > kRecordsPerThread) {
+            throw std::runtime_error("trace dump is damaged");
+        }
+        thread.records.resize(n_records);
+        if (!in.read(reinterpret_cast<char *>(thread.records.data()),
+                static_cast<std::streamsize>(n_records * sizeof(Record)))) {
+            throw std::runtime_error("trace dump is truncated");
+        }
+    }
+    return dump;
+}
+
+} // namespace pr::midi::trace
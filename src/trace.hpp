@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Binary trace of the hot paths, cheap enough to leave on in production.
+//
+// Every thread that records gets its own ring of fixed-size records (raw structs and a
+// steady_clock stamp, nothing formatted), so recording is a few stores with no lock and no
+// allocation; the oldest records are overwritten once a ring is full. A dump collects all rings
+// into one file that piano-recorder-trace decodes offline.
+namespace pr::midi::trace {
+
+static constexpr std::string_view kDumpMagic = "PRTRACE2";
+static constexpr std::string_view kDumpExtension = ".prtrace";
+static constexpr size_t kRecordsPerThread = 1 << 14;
+
+enum class Kind : uint8_t {
+    // snd_seq_event_t as read from the sequencer
+    SEQ_EVENT = 1,
+    // sequencer input overrun, no payload
+    SEQ_OVERRUN,
+    // CaptureTrace, pushed to the capture ring
+    CAPTURED,
+    // CaptureTrace that didn't fit in the capture ring
+    DROPPED,
+    // SaveTrace
+    SAVE,
+};
+
+struct Record {
+    // steady_clock
+    int64_t ns;
+    Kind kind;
+    uint8_t len;
+    uint16_t reserved0;
+    uint32_t reserved1;
+    uint8_t payload[48];
+};
+
+static_assert(sizeof(Record) == 64);
+
+struct CaptureTrace {
+    int64_t tick;
+    uint16_t track;
+    uint8_t len;
+    uint8_t bytes[3];
+    // kernel stamp to dequeue, or -1 if the event wasn't stamped
+    int64_t skew_ns;
+};
+
+struct SaveTrace {
+    int64_t duration_ns;
+    uint32_t tracks;
+    uint32_t events;
+};
+
+namespace detail {
+inline std::atomic<bool> enabled{false};
+void write(const Record &record) noexcept;
+} // namespace detail
+
+inline bool enabled(void) noexcept {
+    return detail::enabled.load(std::memory_order_relaxed);
+}
+
+void set_enabled(bool on) noexcept;
+
+// Names the calling thread's ring in dumps. A thread started again under the same name (the
+// recorder's threads on restart) takes over the ring the last one left behind, so records from
+// before the restart are kept and the number of rings stays bounded.
+void name_thread(const std::string &name);
+
+inline void record(Kind kind) noexcept {
+    if (enabled()) {
+        detail::write(Record{
+            .ns = std::chrono::steady_clock::now().time_since_epoch().count(), .kind = kind});
+    }
+}
+
+template <class T>
+inline void record(Kind kind, const T &payload) noexcept {
+    static_assert(std::is_trivially_copyable_v<T> && sizeof(T) <= sizeof(Record::payload));
+    if (enabled()) {
+        Record r{.ns = std::chrono::steady_clock::now().time_since_epoch().count(),
+            .kind = kind,
+            .len = sizeof(T)};
+        std::memcpy(r.payload, &payload, sizeof(T));
+        detail::write(r);
+    }
+}
+
+// Dump file layout, host byte order:
+//   header   magic "PRTRACE2", u32 record size, u32 thread count,
+//            i64 system_clock minus steady_clock in ns at the time of the dump
+//   threads  u32 name length, name, u64 record count, records oldest first
+struct ThreadTrace {
+    std::string name;
+    std::vector<Record> records;
+};
+
+struct TraceDump {
+    int64_t wall_offset_ns = 0;
+    std::vector<ThreadTrace> threads;
+};
+
+// Everything still in the rings, serialized; safe to call while other threads record
+std::string snapshot(void);
+
+// Writes snapshot() to path by way of a temporary file; false (and a log line) on failure
+bool write_dump(const std::filesystem::path &path);
+
+// throws std::runtime_error if the file can't be read or isn't a dump
+TraceDump read_dump(const std::filesystem::path &path);
+
+} // namespace pr::midi::trace
@@ -0,0 +1,407 @@
+#include "wav_renderer.hpp"
+#include "file_io.hpp"
+#include "smf_reader.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <numbers>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace pr::midi {
+
+// eight consecutive samples of one partial
+using Lanes = float __attribute__((vector_size(32)));
+static constexpr int kLanes = 8;
+
+static constexpr int kPartials = 8;
+// fixed, so the output doesn't depend on how the blocks are spread over threads
+static constexpr int64_t kBlockFrames = 1 << 14;
+static constexpr double kAttackSeconds = 0.002;
+static constexpr double kDamperSeconds = 0.25;
+// a voice stops once all its partials together are this far down
+static constexpr double kSilence = 1e-4;
+static constexpr double kSixtyDb = 6.907755278982137;
+static constexpr uint32_t kWavHeaderBytes = 44;
+
+struct Partial {
+    // radians per frame
+    double omega;
+    float amplitude;
+    // natural-log amplitude decay per frame
+    double decay;
+};
+
+// one struck note, in frames
+struct Voice {
+    int64_t on;
+    int64_t off;
+    int64_t end;
+    float left;
+    float right;
+    // extra decay per frame once the damper is down
+    double damper;
+    std::array<Partial, kPartials> partials;
+};
+
+struct Note {
+    double on_s;
+    double off_s;
+    uint8_t key;
+    uint8_t velocity;
+};
+
+// notes with note-off moved to the next pedal release if the sustain pedal was down at the time
+static std::vector<Note> read_notes(const std::filesystem::path &path, double &duration_s) {
+    const SmfReader reader(path);
+    const SmfTempoMap tempo(reader);
+
+    struct Timed {
+        double seconds;
+        uint8_t bytes[3];
+    };
+    std::vector<Timed> events;
+    uint64_t end_tick = 0;
+    for (const SmfTrack &track : reader.tracks()) {
+        for (const SmfEvent &ev : track) {
+            end_tick = std::max(end_tick, ev.tick);
+            const int status = ev.status & 0xF0;
+            if (status == 0x80 || status == 0x90 || (status == 0xB0 && ev.data[0] == 64)) {
+                events.push_back(Timed{.seconds = tempo.seconds(ev.tick),
+                    .bytes = {ev.status, ev.data[0], ev.data[1]}});
+            }
+        }
+    }
+    duration_s = tempo.seconds(end_tick);
+    std::stable_sort(events.begin(), events.end(),
+        [](const Timed &a, const Timed &b) { return a.seconds < b.seconds; });
+
+    std::vector<Note> notes;
+    // index into notes + 1, by channel * 128 + key
+    std::array<size_t, 16 * 128> held{};
+    std::array<size_t, 16 * 128> sustained{};
+    std::array<bool, 16> pedal{};
+
+    const auto release = [&](std::array<size_t, 16 * 128> &slots, size_t index, double seconds) {
+        if (slots[index] != 0) {
+            notes[slots[index] - 1].off_s = seconds;
+            slots[index] = 0;
+        }
+    };
+
+    for (const Timed &ev : events) {
+        const size_t channel = ev.bytes[0] & 0x0Fu;
+        const size_t index = channel * 128 + (ev.bytes[1] & 0x7Fu);
+        const int status = ev.bytes[0] & 0xF0;
+
+        if (status == 0xB0) {
+            pedal[channel] = ev.bytes[2] >= 64;
+            if (!pedal[channel]) {
+                for (size_t key = 0; key < 128; key++) {
+                    release(sustained, channel * 128 + key, ev.seconds);
+                }
+            }
+        } else if (status == 0x90 && ev.bytes[2] > 0) {
+            // striking the same string again ends what was left of it
+            release(held, index, ev.seconds);
+            release(sustained, index, ev.seconds);
+            notes.push_back(Note{.on_s = ev.seconds,
+                .off_s = duration_s,
+                .key = static_cast<uint8_t>(ev.bytes[1] & 0x7F),
+                .velocity = ev.bytes[2]});
+            held[index] = notes.size();
+        } else if (held[index] != 0) {
+            if (pedal[channel]) {
+                sustained[index] = held[index];
+                held[index] = 0;
+            } else {
+                release(held, index, ev.seconds);
+            }
+        }
+    }
+
+    return notes;
+}
+
+static Voice make_voice(const Note &note, double sample_rate) {
+    const double key = note.key;
+    const double velocity = note.velocity / 127.0;
+    const double f0 = 440.0 * std::exp2((key - 69.0) / 12.0);
+    // string stiffness stretches the upper partials
+    const double inharmonicity = 1e-4 * std::exp2((key - 21.0) / 24.0);
+    // low strings ring for much longer than high ones
+    const double t60 = std::clamp(24.0 * std::exp2(-(key - 21.0) / 16.0), 0.6, 24.0);
+    const double base_decay = kSixtyDb / (t60 * sample_rate);
+    // harder strikes are louder and brighter
+    const double loudness = 0.08 + 0.92 * velocity * velocity;
+    const double rolloff = 2.4 - 1.4 * velocity;
+
+    Voice voice{};
+    double total = 0;
+    for (int n = 1; n <= kPartials; n++) {
+        const double freq = n * f0 * std::sqrt(1.0 + inharmonicity * n * n);
+        Partial &p = voice.partials[static_cast<size_t>(n - 1)];
+        p.omega = 2.0 * std::numbers::pi * freq / sample_rate;
+        p.amplitude =
+            freq < 0.45 * sample_rate ? static_cast<float>(loudness * std::pow(n, -rolloff)) : 0;
+        p.decay = base_decay * (1.0 + 0.7 * (n - 1));
+        total += p.amplitude;
+    }
+    voice.damper = kSixtyDb / (kDamperSeconds * sample_rate);
+
+    // everything decays at least as fast as the fundamental
+    voice.on = static_cast<int64_t>(std::llround(note.on_s * sample_rate));
+    voice.off = std::max<int64_t>(voice.on, std::llround(note.off_s * sample_rate));
+    const double headroom = std::log(std::max(total, kSilence) / kSilence);
+    const auto natural_end = voice.on + static_cast<int64_t>(headroom / base_decay);
+    const double held_for = static_cast<double>(voice.off - voice.on);
+    const auto damped_end = voice.off +
+        static_cast<int64_t>(std::max(0.0, headroom - base_decay * held_for) /
+            (base_decay + voice.damper));
+    voice.end = std::min(natural_end, damped_end) + 1;
+
+    // low keys to the left, as seen from the bench
+    const double angle = std::numbers::pi / 4 * (1.0 + 0.6 * (key - 64.0) / 44.0);
+    voice.left = static_cast<float>(std::cos(angle));
+    voice.right = static_cast<float>(std::sin(angle));
+    return voice;
+}
+
+// adds one partial to out[0, count), starting from its closed-form state at elapsed frames
+static void add_partial(
+    const Partial &p, double elapsed, double amplitude, double decay, int64_t count, float *out) {
+    const double phase = std::fmod(p.omega * elapsed, 2.0 * std::numbers::pi);
+
+    Lanes re, im, amp;
+    for (int k = 0; k < kLanes; k++) {
+        re[k] = static_cast<float>(std::cos(phase + p.omega * k));
+        im[k] = static_cast<float>(std::sin(phase + p.omega * k));
+        amp[k] = static_cast<float>(amplitude * std::exp(-decay * k));
+    }
+    const auto c = static_cast<float>(std::cos(p.omega * kLanes));
+    const auto s = static_cast<float>(std::sin(p.omega * kLanes));
+    const auto d = static_cast<float>(std::exp(-decay * kLanes));
+
+    int64_t i = 0;
+    for (; i + kLanes <= count; i += kLanes) {
+        Lanes acc;
+        std::memcpy(&acc, out + i, sizeof(acc));
+        acc += im * amp;
+        std::memcpy(out + i, &acc, sizeof(acc));
+
+        const Lanes next_re = re * c - im * s;
+        im = re * s + im * c;
+        re = next_re;
+        amp *= d;
+    }
+    for (int k = 0; i < count; i++, k++) {
+        out[i] += im[k] * amp[k];
+    }
+}
+
+// the voice over frames [from, to) of the output into scratch[0, to - from)
+static void render_voice(const Voice &v, int64_t from, int64_t to, float *scratch) {
+    std::fill(scratch, scratch + (to - from), 0.0f);
+
+    const int64_t held_to = std::min(v.off, to);
+    for (const Partial &p : v.partials) {
+        if (p.amplitude == 0) {
+            continue;
+        }
+
+        if (from < held_to) {
+            const auto elapsed = static_cast<double>(from - v.on);
+            add_partial(p, elapsed, p.amplitude * std::exp(-p.decay * elapsed), p.decay,
+                held_to - from, scratch);
+        }
+
+        const int64_t damped_from = std::max(v.off, from);
+        if (damped_from < to) {
+            const auto held = static_cast<double>(v.off - v.on);
+            const auto since_off = static_cast<double>(damped_from - v.off);
+            const double amplitude =
+                p.amplitude * std::exp(-p.decay * held - (p.decay + v.damper) * since_off);
+            add_partial(p, held + since_off, amplitude, p.decay + v.damper, to - damped_from,
+                scratch + (damped_from - from));
+        }
+    }
+}
+
+struct BlockBuffers {
+    std::vector<float> left = std::vector<float>(kBlockFrames);
+    std::vector<float> right = std::vector<float>(kBlockFrames);
+    std::vector<float> scratch = std::vector<float>(kBlockFrames);
+    std::vector<int16_t> pcm = std::vector<int16_t>(2 * kBlockFrames);
+};
+
+// renders frames [first, first + frames) to interleaved PCM in buf.pcm, returns clipped samples
+static uint64_t render_block(const std::vector<Voice> &voices, int64_t longest, int64_t first,
+    int64_t frames, int64_t attack_frames, float gain, BlockBuffers &buf) {
+    std::fill_n(buf.left.begin(), frames, 0.0f);
+    std::fill_n(buf.right.begin(), frames, 0.0f);
+
+    const int64_t last = first + frames;
+    auto it = std::lower_bound(voices.begin(), voices.end(), first - longest,
+        [](const Voice &v, int64_t t) { return v.on < t; });
+    for (; it != voices.end() && it->on < last; ++it) {
+        const Voice &v = *it;
+        const int64_t from = std::max(v.on, first);
+        const int64_t to = std::min(v.end, last);
+        if (from >= to) {
+            continue;
+        }
+
+        render_voice(v, from, to, buf.scratch.data());
+        for (int64_t t = from; t < std::min(to, v.on + attack_frames); t++) {
+            buf.scratch[static_cast<size_t>(t - from)] *=
+                static_cast<float>(t - v.on) / static_cast<float>(attack_frames);
+        }
+
+        float *left = buf.left.data() + (from - first);
+        float *right = buf.right.data() + (from - first);
+        const float *mono = buf.scratch.data();
+        for (int64_t i = 0; i < to - from; i++) {
+            left[i] += mono[i] * v.left;
+            right[i] += mono[i] * v.right;
+        }
+    }
+
+    uint64_t clipped = 0;
+    const auto to_pcm = [&](float sample) {
+        const float scaled = sample * gain * 32767.0f;
+        if (std::fabs(scaled) > 32767.0f) {
+            clipped++;
+        }
+        return static_cast<int16_t>(std::lrint(std::clamp(scaled, -32767.0f, 32767.0f)));
+    };
+    for (int64_t i = 0; i < frames; i++) {
+        buf.pcm[static_cast<size_t>(2 * i)] = to_pcm(buf.left[static_cast<size_t>(i)]);
+        buf.pcm[static_cast<size_t>(2 * i + 1)] = to_pcm(buf.right[static_cast<size_t>(i)]);
+    }
+    return clipped;
+}
+
+// WAV is little-endian; the header and the samples are written as they are in memory
+static_assert(std::endian::native == std::endian::little);
+
+// canonical 44-byte PCM header
+static std::array<char, kWavHeaderBytes> wav_header(uint32_t sample_rate, uint32_t data_bytes) {
+    constexpr uint16_t kChannels = 2;
+    constexpr uint16_t kBits = 16;
+    const uint32_t byte_rate = sample_rate * kChannels * kBits / 8;
+    const uint32_t riff_bytes = data_bytes + kWavHeaderBytes - 8;
+    const uint32_t fmt_bytes = 16;
+    const uint16_t pcm = 1;
+    const uint16_t block_align = kChannels * kBits / 8;
+
+    std::array<char, kWavHeaderBytes> header{};
+    char *p = header.data();
+    const auto put = [&](const void *data, size_t len) {
+        std::memcpy(p, data, len);
+        p += len;
+    };
+    put("RIFF", 4);
+    put(&riff_bytes, 4);
+    put("WAVEfmt ", 8);
+    put(&fmt_bytes, 4);
+    put(&pcm, 2);
+    put(&kChannels, 2);
+    put(&sample_rate, 4);
+    put(&byte_rate, 4);
+    put(&block_align, 2);
+    put(&kBits, 2);
+    put("data", 4);
+    put(&data_bytes, 4);
+    return header;
+}
+
+RenderStats render_midi_to_wav(const std::filesystem::path &midi_path,
+    const std::filesystem::path &wav_path, const RenderOptions &options) {
+    const auto start = std::chrono::steady_clock::now();
+    if (options.sample_rate < 8000 || options.sample_rate > 192000) {
+        throw std::runtime_error("unsupported sample rate: " + std::to_string(options.sample_rate));
+    }
+    const double sample_rate = options.sample_rate;
+
+    double duration_s = 0;
+    const std::vector<Note> notes = read_notes(midi_path, duration_s);
+
+    std::vector<Voice> voices;
+    voices.reserve(notes.size());
+    int64_t longest = 0;
+    auto frames = static_cast<int64_t>(std::ceil(duration_s * sample_rate));
+    for (const Note &note : notes) {
+        voices.push_back(make_voice(note, sample_rate));
+        longest = std::max(longest, voices.back().end - voices.back().on);
+        frames = std::max(frames, voices.back().end);
+    }
+    std::stable_sort(
+        voices.begin(), voices.end(), [](const Voice &a, const Voice &b) { return a.on < b.on; });
+
+    if (frames * 4 > int64_t{UINT32_MAX} - kWavHeaderBytes) {
+        throw std::runtime_error(midi_path.string() + " is too long for a WAV file");
+    }
+
+    const int fd = ::open(wav_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("could not create " + wav_path.string() + ": " + strerror(errno));
+    }
+
+    const auto header =
+        wav_header(static_cast<uint32_t>(options.sample_rate), static_cast<uint32_t>(frames * 4));
+    std::atomic<bool> failed = !pwrite_all(fd, header.data(), header.size(), 0);
+
+    const int64_t blocks = (frames + kBlockFrames - 1) / kBlockFrames;
+    const auto attack_frames = std::max<int64_t>(1, std::llround(kAttackSeconds * sample_rate));
+    unsigned threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+    threads = static_cast<unsigned>(std::clamp<int64_t>(threads, 1, std::max<int64_t>(blocks, 1)));
+
+    std::atomic<int64_t> next_block = 0;
+    std::atomic<uint64_t> clipped = 0;
+    const auto worker = [&]() {
+        BlockBuffers buf;
+        for (int64_t block = next_block++; block < blocks && !failed; block = next_block++) {
+            const int64_t first = block * kBlockFrames;
+            const int64_t count = std::min(kBlockFrames, frames - first);
+            clipped += render_block(
+                voices, longest, first, count, attack_frames, options.gain, buf);
+            if (!pwrite_all(fd, buf.pcm.data(), static_cast<size_t>(count) * 4,
+                    static_cast<off_t>(kWavHeaderBytes + first * 4))) {
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : pool) {
+        t.join();
+    }
+
+    if (::close(fd) != 0 || failed) {
+        throw std::runtime_error("could not write " + wav_path.string());
+    }
+
+    return RenderStats{
+        .frames = static_cast<uint64_t>(frames),
+        .notes = notes.size(),
+        .clipped = clipped,
+        .threads = threads,
+        .elapsed = std::chrono::steady_clock::now() - start,
+    };
+}
+
+} // namespace pr::midi
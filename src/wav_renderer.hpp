@@ -0,0 +1,38 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+
+namespace pr::midi {
+
+struct RenderOptions {
+    int sample_rate = 48000;
+    // 0 uses every core
+    unsigned threads = 0;
+    float gain = 0.25f;
+};
+
+struct RenderStats {
+    uint64_t frames = 0;
+    uint64_t notes = 0;
+    uint64_t clipped = 0;
+    unsigned threads = 0;
+    std::chrono::duration<double> elapsed{0};
+};
+
+// Renders a .mid into a 16-bit stereo WAV with a built-in additive piano: every note is a stack of
+// slightly stretched partials that decay faster the higher they are, released by note-off or the
+// sustain pedal.
+//
+// The output is cut into fixed blocks that are rendered in parallel. A voice carries no state from
+// one block to the next; its phase and envelope at each block start are computed in closed form
+// from the note, so the result is bit-identical for any thread count. Within a block each partial
+// runs as a phasor over eight samples at a time (GCC/Clang vector extensions, which become
+// SSE/AVX/NEON as the target allows).
+//
+// Throws std::runtime_error if the input can't be read or the output can't be written.
+RenderStats render_midi_to_wav(const std::filesystem::path &midi_path,
+    const std::filesystem::path &wav_path, const RenderOptions &options);
+
+} // namespace pr::midi
@@ -0,0 +1,140 @@
+// Pretty-prints a .prtrace dump written by piano-recorder --trace.
+//
+// The records of all threads are merged into one timeline, one line per record:
+//   <local time> <thread> <gap since the previous record> <kind> <details>
+#include "alsa_sequencer.hpp"
+#include "trace.hpp"
+
+#include <alsa/asoundlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cxxopts.hpp>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+namespace {
+
+using pr::midi::trace::Kind;
+using pr::midi::trace::Record;
+
+struct Line {
+    const Record *record;
+    const std::string *thread;
+};
+
+template <class T>
+T payload_as(const Record &r) {
+    T value{};
+    std::memcpy(&value, r.payload, std::min<size_t>(sizeof(T), r.len));
+    return value;
+}
+
+std::string local_time(int64_t wall_ns) {
+    const time_t secs = static_cast<time_t>(wall_ns / 1'000'000'000);
+    struct tm local {};
+    localtime_r(&secs, &local);
+
+    char buf[32];
+    const size_t len = strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &local);
+    return fmt::format("{}.{:06}", std::string_view(buf, len), wall_ns / 1000 % 1'000'000);
+}
+
+std::string describe(const Record &r) {
+    switch (r.kind) {
+        case Kind::SEQ_EVENT: {
+            const auto ev = payload_as<snd_seq_event_t>(r);
+            std::ostringstream os;
+            os << ev;
+            return fmt::format("SEQ_EVENT    {} from {}:{}", os.str(), ev.source.client,
+                ev.source.port);
+        }
+
+        case Kind::SEQ_OVERRUN:
+            return "SEQ_OVERRUN  sequencer input overrun, events were lost";
+
+        case Kind::CAPTURED:
+        case Kind::DROPPED: {
+            const auto ev = payload_as<pr::midi::trace::CaptureTrace>(r);
+            std::string bytes;
+            for (size_t i = 0; i < std::min<size_t>(ev.len, sizeof(ev.bytes)); i++) {
+                bytes += fmt::format("{}{:02X}", i ? " " : "", ev.bytes[i]);
+            }
+            std::string line = fmt::format("{:<12} tick={} track={} [{}]",
+                r.kind == Kind::CAPTURED ? "CAPTURED" : "DROPPED", ev.tick, ev.track, bytes);
+            if (ev.skew_ns >= 0) {
+                line += fmt::format(" skew={:.1f}us", static_cast<double>(ev.skew_ns) / 1e3);
+            }
+            return line;
+        }
+
+        case Kind::SAVE: {
+            const auto save = payload_as<pr::midi::trace::SaveTrace>(r);
+            return fmt::format("SAVE         {} events to {} tracks in {:.3f}ms", save.events,
+                save.tracks, static_cast<double>(save.duration_ns) / 1e6);
+        }
+    }
+    return fmt::format("0x{:02x}         (unknown record)", static_cast<unsigned>(r.kind));
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    // clang-format off
+    cxxopts::Options options("piano-recorder-trace", "Decode a piano-recorder trace dump");
+    options.add_options()
+        ("dump", "Trace dump (.prtrace)", cxxopts::value<std::string>())
+        ("t,thread", "Only show records from this thread", cxxopts::value<std::string>())
+        ("n,tail", "Only show the last N records (0 shows all)", cxxopts::value<size_t>()->default_value("0"))
+        ("h,help", "Print help");
+    // clang-format on
+    options.parse_positional({"dump"});
+    options.positional_help("<dump.prtrace>");
+
+    const cxxopts::ParseResult args = options.parse(argc, argv);
+    if (args["help"].as<bool>() || !args.count("dump")) {
+        std::cout << options.help() << "\n";
+        return args.count("dump") ? 0 : 1;
+    }
+
+    pr::midi::trace::TraceDump dump;
+    try {
+        dump = pr::midi::trace::read_dump(args["dump"].as<std::string>());
+    } catch (const std::exception &e) {
+        spdlog::error("{}", e.what());
+        return 1;
+    }
+
+    std::vector<Line> lines;
+    size_t thread_width = 0;
+    for (const pr::midi::trace::ThreadTrace &thread : dump.threads) {
+        if (args.count("thread") && thread.name != args["thread"].as<std::string>()) {
+            continue;
+        }
+        thread_width = std::max(thread_width, thread.name.size());
+        for (const Record &r : thread.records) {
+            lines.push_back(Line{.record = &r, .thread = &thread.name});
+        }
+    }
+    std::stable_sort(lines.begin(), lines.end(),
+        [](const Line &a, const Line &b) { return a.record->ns < b.record->ns; });
+
+    const size_t tail = args["tail"].as<size_t>();
+    const size_t first = tail > 0 && lines.size() > tail ? lines.size() - tail : 0;
+    int64_t prev_ns = first < lines.size() ? lines[first > 0 ? first - 1 : 0].record->ns : 0;
+    for (size_t i = first; i < lines.size(); i++) {
+        const Record &r = *lines[i].record;
+        std::cout << fmt::format("{} {:<{}} {:>+12.3f}us  {}\n",
+            local_time(r.ns + dump.wall_offset_ns), *lines[i].thread, thread_width,
+            static_cast<double>(r.ns - prev_ns) / 1e3, describe(r));
+        prev_ns = r.ns;
+    }
+
+    return 0;
+}